@@ -49,6 +49,7 @@ HEADERS += src/activemasternode.h \
            src/keystore.h \
            src/leveldbwrapper.h \
            src/limitedmap.h \
+           src/memusage.h \
            src/main.h \
            src/masternode-pos.h \
            src/masternode.h \
@@ -80,6 +81,7 @@ HEADERS += src/activemasternode.h \
            src/sph_skein.h \
            src/sph_types.h \
            src/spork.h \
+           src/stratum.h \
            src/sync.h \
            src/threadsafety.h \
            src/tinyformat.h \
@@ -350,6 +352,7 @@ SOURCES += src/activemasternode.cpp \
            src/simd.c \
            src/skein.c \
            src/spork.cpp \
+           src/stratum.cpp \
            src/sync.cpp \
            src/torcontrol.cpp \
            src/txdb.cpp \
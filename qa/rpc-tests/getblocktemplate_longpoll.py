@@ -0,0 +1,121 @@
+#!/usr/bin/env python
+# Copyright (c) 2014 The Bitcoin Core developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Exercise BIP22 long polling in getblocktemplate
+
+# Add python-bitcoinrpc to module search path:
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), "python-bitcoinrpc"))
+
+import json
+import shutil
+import subprocess
+import tempfile
+import threading
+import time
+import traceback
+
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+
+
+class LongpollThread(threading.Thread):
+    def __init__(self, node_num, longpollid):
+        threading.Thread.__init__(self)
+        self.longpollid = longpollid
+        # Each long poll needs its own connection, the shared one would block
+        self.node = AuthServiceProxy("http://rt:rt@127.0.0.1:%d"%(START_RPC_PORT+node_num,))
+        self.result = None
+
+    def run(self):
+        self.result = self.node.getblocktemplate({'longpollid':self.longpollid})
+
+def run_test(nodes):
+    print("Long poll id is returned and stays stable while nothing changes")
+    tmpl = nodes[0].getblocktemplate()
+    assert('longpollid' in tmpl)
+    longpollid = tmpl['longpollid']
+    assert_equal(nodes[0].getblocktemplate()['longpollid'], longpollid)
+
+    print("Long poll waits while nothing changes")
+    thr = LongpollThread(0, longpollid)
+    thr.start()
+    thr.join(5)
+    assert(thr.is_alive())
+
+    print("Long poll returns when the tip changes")
+    nodes[1].setgenerate(True, 1)
+    sync_blocks(nodes)
+    thr.join(30)
+    assert(not thr.is_alive())
+    assert(thr.result['longpollid'] != longpollid)
+    assert_equal(thr.result['previousblockhash'], nodes[0].getbestblockhash())
+
+    print("Long poll returns when the template collects more fees")
+    longpollid = nodes[0].getblocktemplate()['longpollid']
+    thr = LongpollThread(0, longpollid)
+    thr.start()
+    thr.join(2)
+    assert(thr.is_alive())
+    nodes[1].sendtoaddress(nodes[0].getnewaddress(), 1)
+    sync_mempools(nodes)
+    thr.join(30)
+    assert(not thr.is_alive())
+    assert(len(thr.result['transactions']) > 0)
+
+def main():
+    import optparse
+
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option("--nocleanup", dest="nocleanup", default=False, action="store_true",
+                      help="Leave bitcoinds and test.* datadir on exit or error")
+    parser.add_option("--srcdir", dest="srcdir", default="../../src",
+                      help="Source directory containing bitcoind/bitcoin-cli (default: %default%)")
+    parser.add_option("--tmpdir", dest="tmpdir", default=tempfile.mkdtemp(prefix="test"),
+                      help="Root directory for datadirs")
+    (options, args) = parser.parse_args()
+
+    os.environ['PATH'] = options.srcdir+":"+os.environ['PATH']
+
+    check_json_precision()
+
+    success = False
+    nodes = []
+    try:
+        print("Initializing test directory "+options.tmpdir)
+        if not os.path.isdir(options.tmpdir):
+            os.makedirs(options.tmpdir)
+        initialize_chain(options.tmpdir)
+
+        nodes = start_nodes(2, options.tmpdir)
+        connect_nodes(nodes[1], 0)
+        sync_blocks(nodes)
+
+        run_test(nodes)
+
+        success = True
+
+    except AssertionError as e:
+        print("Assertion failed: "+e.message)
+    except Exception as e:
+        print("Unexpected exception caught during testing: "+str(e))
+        traceback.print_tb(sys.exc_info()[2])
+
+    if not options.nocleanup:
+        print("Cleaning up")
+        stop_nodes(nodes)
+        wait_bitcoinds()
+        shutil.rmtree(options.tmpdir)
+
+    if success:
+        print("Tests successful")
+        sys.exit(0)
+    else:
+        print("Failed")
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
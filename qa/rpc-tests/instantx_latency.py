@@ -0,0 +1,168 @@
+#!/usr/bin/env python
+# Copyright (c) 2015 The Chaincoin developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# InstantX lock latency benchmark: brings up a regtest network of
+# masternodes funded by node0, then has node0 send InstantX
+# transactions to node1 and reports how long node1 takes to see
+# each lock complete. A lock needs 15 of the top 20 masternodes,
+# so run with at least 15 masternodes.
+
+# Add python-bitcoinrpc to module search path:
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), "python-bitcoinrpc"))
+
+import json
+import shutil
+import subprocess
+import tempfile
+import time
+import traceback
+
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+
+COLLATERAL = 1000
+MIN_CONFIRMATIONS = 15
+
+
+def create_datadir(dirname, n):
+    datadir = os.path.join(dirname, "node"+str(n))
+    if not os.path.isdir(datadir):
+        os.makedirs(datadir)
+    with open(os.path.join(datadir, "dash.conf"), 'w') as f:
+        f.write("regtest=1\n");
+        f.write("rpcuser=rt\n");
+        f.write("rpcpassword=rt\n");
+        f.write("port="+str(START_P2P_PORT+n)+"\n");
+        f.write("rpcport="+str(START_RPC_PORT+n)+"\n");
+
+def wait_until(predicate, timeout):
+    deadline = time.time() + timeout
+    while not predicate():
+        if time.time() > deadline:
+            raise AssertionError("timed out")
+        time.sleep(0.5)
+
+def setup_masternodes(nodes, dirname, count):
+    # Masternode keys come from node0, the daemons get their own datadirs past the cached nodes
+    keys = [ nodes[0].masternode("genkey") for i in range(count) ]
+    extra_args = []
+    for i in range(count):
+        n = 2 + i
+        if n >= 4:
+            create_datadir(dirname, n)
+        extra_args.append([ "-listen", "-masternode=1", "-masternodeprivkey="+keys[i],
+                            "-masternodeaddr=127.0.0.1:"+str(START_P2P_PORT+n),
+                            "-connect=127.0.0.1:"+str(START_P2P_PORT) ])
+    all_args = [ [], [] ] + extra_args
+    nodes.extend(start_nodes_from(2, len(all_args), dirname, all_args))
+    for i in range(1, len(nodes)):
+        connect_nodes(nodes[i], 0)
+    sync_blocks(nodes)
+
+    # Fund a 1000 coin collateral in every masternode's own wallet
+    needed = COLLATERAL * count + 10
+    while nodes[0].getbalance() < needed:
+        nodes[0].setgenerate(True, 10)
+    for i in range(count):
+        nodes[0].sendtoaddress(nodes[2 + i].getnewaddress(), COLLATERAL)
+    nodes[0].setgenerate(True, MIN_CONFIRMATIONS + 1)
+    sync_blocks(nodes)
+
+    # Masternodes start themselves once their collateral is old enough
+    wait_until(lambda: nodes[1].masternode("count", "enabled") >= count, 600)
+
+def start_nodes_from(first, num_nodes, dirname, extra_args):
+    # Like start_nodes(), for the daemons from index first on
+    devnull = open("/dev/null", "w+")
+    for i in range(first, num_nodes):
+        datadir = os.path.join(dirname, "node"+str(i))
+        args = [ "dashd", "-datadir="+datadir ] + extra_args[i]
+        bitcoind_processes.append(subprocess.Popen(args))
+        subprocess.check_call([ "dash-cli", "-datadir="+datadir,
+                                "-rpcwait", "getblockcount"], stdout=devnull)
+    devnull.close()
+    return [ AuthServiceProxy("http://rt:rt@127.0.0.1:%d"%(START_RPC_PORT+i,)) for i in range(first, num_nodes) ]
+
+def send_instantx(node, address):
+    # InstantX wants inputs at least 6 blocks deep and a 0.01 fee
+    utxo = [ u for u in node.listunspent(6) if u["amount"] > 1 ][0]
+    raw = node.createrawtransaction([{ "txid" : utxo["txid"], "vout" : utxo["vout"] }],
+                                    { address : float(utxo["amount"]) - 0.1 })
+    signed = node.signrawtransaction(raw)
+    return node.sendrawtransaction(signed["hex"], False, True)
+
+def run_test(nodes, txcount):
+    address = nodes[1].getnewaddress()
+
+    latencies = []
+    for i in range(txcount):
+        start = time.time()
+        txid = send_instantx(nodes[0], address)
+        # The wallet reports a completed lock as InstantX depth without any block
+        wait_until(lambda: nodes[1].gettransaction(txid)["confirmations"] > 0, 60)
+        latencies.append(time.time() - start)
+
+    latencies.sort()
+    print("%d InstantX locks: min %.3fs median %.3fs max %.3fs" %
+          (txcount, latencies[0], latencies[len(latencies) / 2], latencies[-1]))
+
+def main():
+    import optparse
+
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option("--nocleanup", dest="nocleanup", default=False, action="store_true",
+                      help="Leave bitcoinds and test.* datadir on exit or error")
+    parser.add_option("--srcdir", dest="srcdir", default="../../src",
+                      help="Source directory containing bitcoind/bitcoin-cli (default: %default%)")
+    parser.add_option("--tmpdir", dest="tmpdir", default=tempfile.mkdtemp(prefix="test"),
+                      help="Root directory for datadirs")
+    parser.add_option("--masternodes", dest="masternodes", default=20, type="int",
+                      help="Number of masternode daemons (default: %default%)")
+    parser.add_option("--txcount", dest="txcount", default=20, type="int",
+                      help="Number of InstantX transactions to time (default: %default%)")
+    (options, args) = parser.parse_args()
+
+    os.environ['PATH'] = options.srcdir+":"+os.environ['PATH']
+
+    check_json_precision()
+
+    success = False
+    nodes = []
+    try:
+        print("Initializing test directory "+options.tmpdir)
+        if not os.path.isdir(options.tmpdir):
+            os.makedirs(options.tmpdir)
+        initialize_chain(options.tmpdir)
+
+        nodes = start_nodes(2, options.tmpdir)
+        setup_masternodes(nodes, options.tmpdir, options.masternodes)
+
+        run_test(nodes, options.txcount)
+
+        success = True
+
+    except AssertionError as e:
+        print("Assertion failed: "+e.message)
+    except Exception as e:
+        print("Unexpected exception caught during testing: "+str(e))
+        traceback.print_tb(sys.exc_info()[2])
+
+    if not options.nocleanup:
+        print("Cleaning up")
+        stop_nodes(nodes)
+        wait_bitcoinds()
+        shutil.rmtree(options.tmpdir)
+
+    if success:
+        print("Tests successful")
+        sys.exit(0)
+    else:
+        print("Failed")
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
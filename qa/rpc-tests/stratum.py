@@ -0,0 +1,166 @@
+#!/usr/bin/env python
+# Copyright (c) 2015 The Chaincoin developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Exercise the built-in Stratum server with a mock miner
+
+# Add python-bitcoinrpc to module search path:
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), "python-bitcoinrpc"))
+
+import json
+import shutil
+import socket
+import subprocess
+import tempfile
+import time
+import traceback
+
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+
+STRATUM_PORT=11200
+
+class MockMiner(object):
+    """Speaks just enough Stratum v1 to fetch jobs and submit nonces"""
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port), 30)
+        self.buf = b""
+        self.nextid = 1
+        self.notifications = []
+
+    def readmsg(self):
+        while b"\n" not in self.buf:
+            data = self.sock.recv(4096)
+            if not data:
+                raise RuntimeError("stratum connection closed")
+            self.buf += data
+        line, self.buf = self.buf.split(b"\n", 1)
+        return json.loads(line.decode())
+
+    def call(self, method, params):
+        reqid = self.nextid
+        self.nextid += 1
+        self.sock.sendall((json.dumps({"id":reqid, "method":method, "params":params})+"\n").encode())
+        while True:
+            msg = self.readmsg()
+            if msg.get("id") == reqid:
+                return msg
+            self.notifications.append(msg)
+
+    def wait_notification(self, method):
+        while True:
+            for msg in self.notifications:
+                if msg["method"] == method:
+                    self.notifications.remove(msg)
+                    return msg["params"]
+            self.notifications.append(self.readmsg())
+
+def run_test(nodes, payout_address):
+    miner = MockMiner(STRATUM_PORT)
+
+    print("Subscribe and authorize")
+    reply = miner.call("mining.subscribe", [])
+    assert(reply["error"] is None)
+    extranonce1 = reply["result"][1]
+    assert_equal(len(extranonce1), 8)
+    assert_equal(reply["result"][2], 4)
+    assert(miner.call("mining.authorize", ["worker", "x"])["result"])
+    assert(len(miner.wait_notification("mining.set_difficulty")) == 1)
+    job = miner.wait_notification("mining.notify")
+    assert_equal(len(job), 9)
+    assert(job[8])
+
+    print("Bad submissions are rejected")
+    assert_equal(miner.call("mining.submit", ["worker", "ffffff", "00000000", job[7], "00000000"])["error"][0], 21)
+    assert_equal(miner.call("mining.submit", ["worker", job[0], "00", job[7], "00000000"])["error"][0], 20)
+    # nTime before the job's median time past, and too far in the future
+    assert_equal(miner.call("mining.submit", ["worker", job[0], "00000000", "00000001", "00000000"])["error"][0], 20)
+    assert_equal(miner.call("mining.submit", ["worker", job[0], "00000000", "%08x"%(int(job[7], 16) + 3*60*60), "00000000"])["error"][0], 20)
+
+    print("Grind nonces until a share is a block")
+    # Regtest blocks are trivially easy, so one of the first few nonces solves the block
+    height = nodes[0].getblockcount()
+    for nonce in range(1000):
+        reply = miner.call("mining.submit", ["worker", job[0], "00000000", job[7], "%08x"%nonce])
+        assert(reply["error"] is None)
+        if nodes[0].getblockcount() > height:
+            break
+    assert_equal(nodes[0].getblockcount(), height+1)
+
+    print("Duplicate shares are rejected")
+    assert_equal(miner.call("mining.submit", ["worker", job[0], "00000000", job[7], "%08x"%nonce])["error"][0], 22)
+
+    print("Miners move to the new tip and the block pays the stratum address")
+    job2 = miner.wait_notification("mining.notify")
+    assert(job2[0] != job[0])
+    assert(job2[8])
+    sync_blocks(nodes)
+    block = nodes[0].getblock(nodes[0].getbestblockhash())
+    txs = [ tx for tx in nodes[1].listtransactions("*", 100) if tx.get("txid") == block["tx"][0] ]
+    assert_equal(len(txs), 1)
+    assert_equal(txs[0]["address"], payout_address)
+
+def main():
+    import optparse
+
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option("--nocleanup", dest="nocleanup", default=False, action="store_true",
+                      help="Leave bitcoinds and test.* datadir on exit or error")
+    parser.add_option("--srcdir", dest="srcdir", default="../../src",
+                      help="Source directory containing bitcoind/bitcoin-cli (default: %default%)")
+    parser.add_option("--tmpdir", dest="tmpdir", default=tempfile.mkdtemp(prefix="test"),
+                      help="Root directory for datadirs")
+    (options, args) = parser.parse_args()
+
+    os.environ['PATH'] = options.srcdir+":"+os.environ['PATH']
+
+    check_json_precision()
+
+    success = False
+    nodes = []
+    try:
+        print("Initializing test directory "+options.tmpdir)
+        if not os.path.isdir(options.tmpdir):
+            os.makedirs(options.tmpdir)
+        initialize_chain(options.tmpdir)
+
+        # Pay stratum blocks to a fresh address of node 1
+        nodes = start_nodes(2, options.tmpdir)
+        payout_address = nodes[1].getnewaddress()
+        stop_nodes(nodes)
+        wait_bitcoinds()
+
+        nodes = start_nodes(2, options.tmpdir, [["-stratum", "-stratumport=%d"%STRATUM_PORT,
+                                                 "-stratumaddress="+payout_address, "-stratumdifficulty=0.00000001",
+                                                 "-debug=stratum"], []])
+        connect_nodes(nodes[1], 0)
+        sync_blocks(nodes)
+
+        run_test(nodes, payout_address)
+
+        success = True
+
+    except AssertionError as e:
+        print("Assertion failed: "+e.message)
+    except Exception as e:
+        print("Unexpected exception caught during testing: "+str(e))
+        traceback.print_tb(sys.exc_info()[2])
+
+    if not options.nocleanup:
+        print("Cleaning up")
+        stop_nodes(nodes)
+        wait_bitcoinds()
+        shutil.rmtree(options.tmpdir)
+
+    if success:
+        print("Tests successful")
+        sys.exit(0)
+    else:
+        print("Failed")
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
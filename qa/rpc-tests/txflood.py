@@ -0,0 +1,118 @@
+#!/usr/bin/env python
+# Copyright (c) 2014 The Bitcoin Core developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Transaction flood benchmark: node0 floods node1 with wallet
+# transactions while mining, and reports how fast node1 takes in
+# the flood and how long a block mined during the flood takes to
+# reach it. Run with different -txprevalidation settings to compare.
+
+# Add python-bitcoinrpc to module search path:
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), "python-bitcoinrpc"))
+
+import json
+import shutil
+import subprocess
+import tempfile
+import time
+import traceback
+
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+
+
+def run_test(nodes, txcount):
+    address = nodes[1].getnewaddress()
+
+    start = time.time()
+    txids = []
+    for i in range(txcount):
+        txids.append(nodes[0].sendtoaddress(address, 0.1))
+        if i == txcount / 2:
+            # Mine in the middle of the flood and time the block's arrival at node1
+            height = nodes[1].getblockcount()
+            block_start = time.time()
+            nodes[0].setgenerate(True, 1)
+            while nodes[1].getblockcount() == height:
+                time.sleep(0.01)
+            block_latency = time.time() - block_start
+    sent = time.time()
+
+    # Wait until node1 has seen every transaction
+    pending = set(txids)
+    while pending:
+        pending.difference_update(nodes[1].getrawmempool())
+        for txid in list(pending):
+            try:
+                if nodes[1].gettransaction(txid)["confirmations"] > 0:
+                    pending.discard(txid)
+            except JSONRPCException:
+                pass
+        time.sleep(0.05)
+    done = time.time()
+
+    print("%d transactions sent in %.2fs, relayed to node1 after %.2fs (%.1f tx/s)" %
+          (txcount, sent - start, done - start, txcount / (done - start)))
+    print("block mined during the flood reached node1 after %.3fs" % block_latency)
+
+def main():
+    import optparse
+
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option("--nocleanup", dest="nocleanup", default=False, action="store_true",
+                      help="Leave bitcoinds and test.* datadir on exit or error")
+    parser.add_option("--srcdir", dest="srcdir", default="../../src",
+                      help="Source directory containing bitcoind/bitcoin-cli (default: %default%)")
+    parser.add_option("--tmpdir", dest="tmpdir", default=tempfile.mkdtemp(prefix="test"),
+                      help="Root directory for datadirs")
+    parser.add_option("--txcount", dest="txcount", default=500, type="int",
+                      help="Number of transactions in the flood (default: %default%)")
+    parser.add_option("--prevalidation", dest="prevalidation", default=2, type="int",
+                      help="-txprevalidation threads on the receiving node (default: %default%)")
+    (options, args) = parser.parse_args()
+
+    os.environ['PATH'] = options.srcdir+":"+os.environ['PATH']
+
+    check_json_precision()
+
+    success = False
+    nodes = []
+    try:
+        print("Initializing test directory "+options.tmpdir)
+        if not os.path.isdir(options.tmpdir):
+            os.makedirs(options.tmpdir)
+        initialize_chain(options.tmpdir)
+
+        nodes = start_nodes(2, options.tmpdir,
+                            [[], ["-txprevalidation=%d" % options.prevalidation]])
+        connect_nodes(nodes[1], 0)
+        sync_blocks(nodes)
+
+        run_test(nodes, options.txcount)
+
+        success = True
+
+    except AssertionError as e:
+        print("Assertion failed: "+e.message)
+    except Exception as e:
+        print("Unexpected exception caught during testing: "+str(e))
+        traceback.print_tb(sys.exc_info()[2])
+
+    if not options.nocleanup:
+        print("Cleaning up")
+        stop_nodes(nodes)
+        wait_bitcoinds()
+        shutil.rmtree(options.tmpdir)
+
+    if success:
+        print("Tests successful")
+        sys.exit(0)
+    else:
+        print("Failed")
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -4,6 +4,8 @@
 
 #include "allocators.h"
 
+#include <algorithm>
+
 #ifdef WIN32
 #ifdef _WIN32_WINNT
 #undef _WIN32_WINNT
@@ -65,3 +67,74 @@ LockedPageManager::LockedPageManager() : LockedPageManagerBase<MemoryPageLocker>
 {
 }
 
+BufferPool* BufferPool::_instance = NULL;
+boost::once_flag BufferPool::init_flag = BOOST_ONCE_INIT;
+
+BufferPool::BufferPool()
+{
+    for (int i = 0; i <= MAX_CLASS_BITS - MIN_CLASS_BITS; i++)
+    {
+        vFree[i] = NULL;
+        vFreeCount[i] = 0;
+    }
+}
+
+/** Size class of an n byte request, -1 if it is too large to pool */
+static inline int GetBufferClass(size_t n)
+{
+    int nBits = BufferPool::MIN_CLASS_BITS;
+    while (nBits <= BufferPool::MAX_CLASS_BITS && ((size_t)1 << nBits) < n)
+        nBits++;
+    if (nBits > BufferPool::MAX_CLASS_BITS)
+        return -1;
+    return nBits - BufferPool::MIN_CLASS_BITS;
+}
+
+void* BufferPool::Allocate(size_t n)
+{
+    int nClass = GetBufferClass(n);
+    if (nClass < 0)
+        return ::operator new(n);
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        FreeBlock* pBlock = vFree[nClass];
+        if (pBlock != NULL)
+        {
+            vFree[nClass] = pBlock->pNext;
+            vFreeCount[nClass]--;
+            return pBlock;
+        }
+    }
+    return ::operator new((size_t)1 << (nClass + MIN_CLASS_BITS));
+}
+
+void BufferPool::Free(void* p, size_t n)
+{
+    if (p == NULL)
+        return;
+    int nClass = GetBufferClass(n);
+    if (nClass >= 0)
+    {
+        size_t nMaxCount = std::max((size_t)4, MAX_CACHED_PER_CLASS >> (nClass + MIN_CLASS_BITS));
+        boost::mutex::scoped_lock lock(mutex);
+        if (vFreeCount[nClass] < nMaxCount)
+        {
+            FreeBlock* pBlock = static_cast<FreeBlock*>(p);
+            pBlock->pNext = vFree[nClass];
+            vFree[nClass] = pBlock;
+            vFreeCount[nClass]++;
+            return;
+        }
+    }
+    ::operator delete(p);
+}
+
+size_t BufferPool::GetCachedBytes()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    size_t nBytes = 0;
+    for (int i = 0; i <= MAX_CLASS_BITS - MIN_CLASS_BITS; i++)
+        nBytes += vFreeCount[i] << (i + MIN_CLASS_BITS);
+    return nBytes;
+}
+
@@ -249,6 +249,108 @@ struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+//
+// Singleton holding size-class free lists for buffers that do not need to be
+// cleared, such as data received from the network. Requests are rounded up
+// to a power of two between 256 bytes and 1MB so that a buffer released by
+// one message can be reused by the next one of a similar size. Larger
+// requests, and blocks beyond the per-class cap, go straight to the heap.
+//
+class BufferPool
+{
+public:
+    static const int MIN_CLASS_BITS = 8;
+    static const int MAX_CLASS_BITS = 20;
+    // Every class may keep this many bytes, and at least 4 blocks
+    static const size_t MAX_CACHED_PER_CLASS = 1024 * 1024;
+
+    static BufferPool& Instance()
+    {
+        boost::call_once(BufferPool::CreateInstance, BufferPool::init_flag);
+        return *BufferPool::_instance;
+    }
+
+    void* Allocate(size_t n);
+    void Free(void* p, size_t n);
+
+    // Get number of bytes held in the free lists for diagnostics
+    size_t GetCachedBytes();
+
+private:
+    BufferPool();
+
+    static void CreateInstance()
+    {
+        static BufferPool instance;
+        BufferPool::_instance = &instance;
+    }
+
+    static BufferPool* _instance;
+    static boost::once_flag init_flag;
+
+    // Free blocks are chained through their first bytes
+    struct FreeBlock
+    {
+        FreeBlock* pNext;
+    };
+
+    boost::mutex mutex;
+    FreeBlock* vFree[MAX_CLASS_BITS - MIN_CLASS_BITS + 1];
+    size_t vFreeCount[MAX_CLASS_BITS - MIN_CLASS_BITS + 1];
+};
+
+//
+// Allocator for serialization buffers. By default it clears its contents
+// before deletion, like zero_after_free_allocator. Instances created with
+// fPooled hold data that is not secret: those skip the clearing and recycle
+// their memory through BufferPool. Containers using different kinds must
+// not be swapped, as the buffer would be released by the other allocator.
+//
+template<typename T>
+struct serialize_allocator : public std::allocator<T>
+{
+    // MSVC8 default copy constructor is broken
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    bool fPooled;
+    serialize_allocator() throw() : fPooled(false) {}
+    explicit serialize_allocator(bool fPooledIn) throw() : fPooled(fPooledIn) {}
+    serialize_allocator(const serialize_allocator& a) throw() : base(a), fPooled(a.fPooled) {}
+    template <typename U>
+    serialize_allocator(const serialize_allocator<U>& a) throw() : base(a), fPooled(a.fPooled) {}
+    ~serialize_allocator() throw() {}
+    template<typename _Other> struct rebind
+    { typedef serialize_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        if (fPooled)
+            return static_cast<T*>(BufferPool::Instance().Allocate(sizeof(T) * n));
+        return std::allocator<T>::allocate(n, hint);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (fPooled)
+        {
+            BufferPool::Instance().Free(p, sizeof(T) * n);
+            return;
+        }
+        if (p != NULL)
+            OPENSSL_cleanse(p, sizeof(T) * n);
+        std::allocator<T>::deallocate(p, n);
+    }
+
+    bool operator==(const serialize_allocator& a) const { return fPooled == a.fPooled; }
+    bool operator!=(const serialize_allocator& a) const { return fPooled != a.fPooled; }
+};
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
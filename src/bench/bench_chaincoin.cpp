@@ -0,0 +1,65 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#define BOOST_TEST_MODULE Chaincoin Benchmarks
+
+#include "main.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#ifdef ENABLE_WALLET
+#include "wallet.h"
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+CWallet* pwalletMain;
+
+extern bool fPrintToConsole;
+extern void noui_connect();
+
+// A chain with only the genesis block, enough for the code under measurement
+struct BenchSetup {
+    CCoinsViewDB *pcoinsdbview;
+    boost::filesystem::path pathTemp;
+
+    BenchSetup() {
+        fPrintToDebugLog = false;
+        noui_connect();
+        pathTemp = GetTempPath() / strprintf("bench_chaincoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        pblocktree = new CBlockTreeDB(1 << 20, true);
+        pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+        pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        InitBlockIndex();
+        RegisterNodeSignals(GetNodeSignals());
+    }
+    ~BenchSetup()
+    {
+        UnregisterNodeSignals(GetNodeSignals());
+        delete pcoinsTip;
+        delete pcoinsdbview;
+        delete pblocktree;
+        boost::filesystem::remove_all(pathTemp);
+    }
+};
+
+BOOST_GLOBAL_FIXTURE(BenchSetup);
+
+void Shutdown(void* parg)
+{
+  exit(0);
+}
+
+void StartShutdown()
+{
+  exit(0);
+}
+
+bool ShutdownRequested()
+{
+  return false;
+}
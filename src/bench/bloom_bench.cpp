@@ -0,0 +1,67 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bloom.h"
+
+#include "memusage.h"
+#include "mruset.h"
+#include "protocol.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_bench)
+
+static vector<CInv> RandomInvs(int nCount)
+{
+    vector<CInv> vInv;
+    for (int i = 0; i < nCount; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+    return vInv;
+}
+
+BOOST_AUTO_TEST_CASE(inventory_known_bench)
+{
+    const unsigned int nKnown = 1000; // per peer, as with the default -maxsendbuffer
+    const int vPeerCounts[] = { 125, 1000 };
+    vector<CInv> vInv = RandomInvs(2 * nKnown);
+
+    BOOST_FOREACH(int nPeers, vPeerCounts) {
+        int64_t nStart = GetTimeMicros();
+        size_t nSetUsage = 0;
+        int nFound = 0;
+        for (int n = 0; n < nPeers; n++) {
+            mruset<CInv> setKnown(nKnown);
+            BOOST_FOREACH(const CInv& inv, vInv)
+                setKnown.insert(inv);
+            BOOST_FOREACH(const CInv& inv, vInv)
+                nFound += setKnown.count(inv);
+            // set node plus the deque slot for every entry
+            nSetUsage += nKnown * (memusage::MallocUsage(sizeof(CInv) + 4 * sizeof(void*)) + sizeof(CInv));
+        }
+        int64_t nSetTime = GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        size_t nFilterUsage = 0;
+        for (int n = 0; n < nPeers; n++) {
+            CRollingBloomFilter filterKnown(nKnown, 0.000001, n);
+            BOOST_FOREACH(const CInv& inv, vInv)
+                filterKnown.insert(inv);
+            BOOST_FOREACH(const CInv& inv, vInv)
+                nFound += filterKnown.contains(inv);
+            nFilterUsage += filterKnown.DynamicMemoryUsage();
+        }
+        int64_t nFilterTime = GetTimeMicros() - nStart;
+
+        BOOST_TEST_MESSAGE(strprintf("known inventory for %d peers: mruset %u KB %.2fms, rolling bloom %u KB %.2fms (%d found)",
+            nPeers, nSetUsage / 1024, nSetTime * 0.001, nFilterUsage / 1024, nFilterTime * 0.001, nFound));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
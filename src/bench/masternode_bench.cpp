@@ -0,0 +1,106 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "util.h"
+
+#include <list>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(masternode_bench)
+
+// Extend pindexFork by nBlocks fake block indexes with random hashes
+static CBlockIndex* ExtendChain(CBlockIndex* pindexFork, int nBlocks, list<uint256>& hashes, list<CBlockIndex>& indexes)
+{
+    CBlockIndex* pindex = pindexFork;
+    for (int i = 0; i < nBlocks; i++) {
+        hashes.push_back(GetRandHash());
+        indexes.push_back(CBlockIndex());
+        CBlockIndex* pnext = &indexes.back();
+        pnext->phashBlock = &hashes.back();
+        pnext->pprev = pindex;
+        pnext->nHeight = pindex->nHeight + 1;
+        pindex = pnext;
+    }
+    return pindex;
+}
+
+static CMasternode MakeMasternode(int i)
+{
+    std::vector<unsigned char> vchPubKey(33);
+    vchPubKey[0] = 0x02;
+    uint256 hashKey = GetRandHash();
+    memcpy(&vchPubKey[1], hashKey.begin(), 32);
+    CPubKey pubkey(vchPubKey);
+
+    CService addr(strprintf("1.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff), 11994);
+    CTxIn vin(GetRandHash(), i % 4);
+    CMasternode mn(addr, vin, pubkey, std::vector<unsigned char>(), GetAdjustedTime(), pubkey, PROTOCOL_VERSION, CScript(), 0);
+    mn.UpdateLastSeen();
+    return mn;
+}
+
+BOOST_AUTO_TEST_CASE(masternode_registry_bench)
+{
+    const int nMasternodes = 10000;
+
+    CBlockIndex* pindexOldTip = chainActive.Tip();
+    list<uint256> hashes;
+    list<CBlockIndex> indexes;
+    chainActive.SetTip(ExtendChain(chainActive.Genesis(), 10, hashes, indexes));
+
+    CMasternodeMan man;
+    std::vector<CMasternode> vMasternodes;
+    for (int i = 0; i < nMasternodes; i++)
+        vMasternodes.push_back(MakeMasternode(i));
+
+    int64_t nStart = GetTimeMicros();
+    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+        man.Add(mn);
+    BOOST_TEST_MESSAGE(strprintf("add: %d masternodes in %.2fms", nMasternodes, (GetTimeMicros() - nStart) * 0.001));
+    BOOST_REQUIRE_EQUAL(man.size(), nMasternodes);
+
+    // dsee/dseep style lookups, one per known entry
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        CMasternode* pmn = man.Find(mn.vin);
+        BOOST_REQUIRE(pmn != NULL);
+        pmn->UpdateLastSeen();
+    }
+    BOOST_TEST_MESSAGE(strprintf("find by collateral: %d pings in %.2fms", nMasternodes, (GetTimeMicros() - nStart) * 0.001));
+
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        BOOST_REQUIRE(man.Find(mn.pubkey2) != NULL);
+        BOOST_REQUIRE(man.Find(mn.addr) != NULL);
+    }
+    BOOST_TEST_MESSAGE(strprintf("find by pubkey and address: %d each in %.2fms", nMasternodes, (GetTimeMicros() - nStart) * 0.001));
+
+    // The first rank query builds the table, later ones are lookups
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+        man.GetMasternodeRank(mn.vin, 5);
+    BOOST_TEST_MESSAGE(strprintf("rank: %d queries in %.2fms", nMasternodes, (GetTimeMicros() - nStart) * 0.001));
+
+    // Readers share one snapshot until the list changes
+    nStart = GetTimeMicros();
+    MasternodeSnapshot snapshot1 = man.GetMasternodeSnapshot();
+    MasternodeSnapshot snapshot2 = man.GetMasternodeSnapshot();
+    BOOST_TEST_MESSAGE(strprintf("snapshot: 2 readers in %.2fms", (GetTimeMicros() - nStart) * 0.001));
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nMasternodes; i += 2)
+        man.Remove(vMasternodes[i].vin);
+    BOOST_TEST_MESSAGE(strprintf("remove: %d masternodes in %.2fms", nMasternodes / 2, (GetTimeMicros() - nStart) * 0.001));
+
+    chainActive.SetTip(pindexOldTip);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
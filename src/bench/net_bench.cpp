@@ -0,0 +1,124 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "net.h"
+#include "serialize.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(net_bench)
+
+static CBlock MakeBlock(int nTransactions)
+{
+    CBlock block;
+    for (int i = 0; i < nTransactions; i++) {
+        CTransaction tx;
+        tx.vin.resize(2);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 1) << vector<unsigned char>(33, 2);
+        tx.vin[1] = tx.vin[0];
+        tx.vout.resize(2);
+        tx.vout[0].nValue = i;
+        tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 3) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1] = tx.vout[0];
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+static void ClearSendQueue(CNode& node)
+{
+    LOCK(node.cs_vSend);
+    node.vSendMsg.clear();
+    node.nSendSize = 0;
+    node.nSendOffset = 0;
+}
+
+static void ReadMessage(CNetMessage& msg, const char* pch, unsigned int nBytes)
+{
+    while (nBytes > 0) {
+        int handled = msg.in_data ? msg.readData(pch, nBytes) : msg.readHeader(pch, nBytes);
+        BOOST_REQUIRE(handled > 0);
+        pch += handled;
+        nBytes -= handled;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(net_broadcast_bench)
+{
+    const int nPeers = 100;
+    const int nRounds = 5;
+    CBlock block = MakeBlock(1000);
+
+    vector<CNode*> vPeers;
+    for (int i = 0; i < nPeers; i++)
+        vPeers.push_back(new CNode(INVALID_SOCKET, CAddress(), "", true));
+
+    // Each peer serializes and checksums its own copy
+    int64_t nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++) {
+        BOOST_FOREACH(CNode* pnode, vPeers)
+            pnode->PushMessage("block", block);
+        BOOST_FOREACH(CNode* pnode, vPeers)
+            ClearSendQueue(*pnode);
+    }
+    int64_t nPerPeer = GetTimeMicros() - nStart;
+
+    // One buffer for all peers
+    nStart = GetTimeMicros();
+    size_t nSize = 0;
+    for (int n = 0; n < nRounds; n++) {
+        CSerializeDataRef msg = SerializeMessage("block", block);
+        nSize = msg->size();
+        BOOST_FOREACH(CNode* pnode, vPeers)
+            pnode->PushSerializedMessage(msg);
+        BOOST_FOREACH(CNode* pnode, vPeers)
+            ClearSendQueue(*pnode);
+    }
+    int64_t nShared = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("broadcast of a %u byte block to %d peers: %.2fms per-peer serialization, %.2fms shared",
+        nSize, nPeers, nPerPeer * 0.001 / nRounds, nShared * 0.001 / nRounds));
+
+    BOOST_FOREACH(CNode* pnode, vPeers)
+        delete pnode;
+}
+
+BOOST_AUTO_TEST_CASE(net_receive_bench)
+{
+    const int nMessages = 20000;
+    // Mostly inv/tx sized messages with an occasional block
+    vector<CSerializeDataRef> vMsgs;
+    vMsgs.push_back(SerializeMessage("inv", vector<CInv>(10, CInv(MSG_TX, GetRandHash()))));
+    vMsgs.push_back(SerializeMessage("tx", MakeBlock(1).vtx[0]));
+    vMsgs.push_back(SerializeMessage("block", MakeBlock(500)));
+
+    // Full size up front, cleared on free
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nMessages; i++) {
+        const CSerializeData& data = *vMsgs[i % 50 == 0 ? 2 : i % 2];
+        CDataStream vRecv(SER_NETWORK, PROTOCOL_VERSION);
+        vRecv.resize(data.size() - CMessageHeader::HEADER_SIZE);
+        memcpy(&vRecv[0], &data[CMessageHeader::HEADER_SIZE], vRecv.size());
+    }
+    int64_t nPlain = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nMessages; i++) {
+        const CSerializeData& data = *vMsgs[i % 50 == 0 ? 2 : i % 2];
+        CNetMessage msg(SER_NETWORK, PROTOCOL_VERSION);
+        ReadMessage(msg, &data[0], data.size());
+    }
+    int64_t nPooled = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("receive of %d messages: %.2fms zeroing buffers, %.2fms pooled buffers",
+        nMessages, nPlain * 0.001, nPooled * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
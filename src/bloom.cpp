@@ -5,6 +5,8 @@
 #include "bloom.h"
 
 #include "core.h"
+#include "memusage.h"
+#include "protocol.h"
 #include "script.h"
 
 #include <math.h>
@@ -31,6 +33,16 @@ nFlags(nFlagsIn)
 {
 }
 
+CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweakIn) :
+vData((unsigned int)(-1  / LN2SQUARED * nElements * log(nFPRate)) / 8),
+isFull(false),
+isEmpty(true),
+nHashFuncs((unsigned int)(vData.size() * 8 / nElements * LN2)),
+nTweak(nTweakIn),
+nFlags(BLOOM_UPDATE_NONE)
+{
+}
+
 inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
 {
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
@@ -180,3 +192,81 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+void CBloomFilter::clear()
+{
+    vData.assign(vData.size(), 0);
+    isFull = false;
+    isEmpty = true;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak) :
+    b1(nElements * 2, nFPRate, nTweak), b2(nElements * 2, nFPRate, nTweak)
+{
+    // Each filter holds at most nBloomSize items, and the one answering
+    // lookups has taken at least the last nBloomSize / 2 of them
+    nBloomSize = nElements * 2;
+    nInsertions = 0;
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    if (nInsertions == 0)
+        b1.clear();
+    else if (nInsertions == nBloomSize / 2)
+        b2.clear();
+    b1.insert(vKey);
+    b2.insert(vKey);
+    if (++nInsertions == nBloomSize)
+        nInsertions = 0;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    vector<unsigned char> data(hash.begin(), hash.end());
+    insert(data);
+}
+
+// The type is part of the key: a transaction and its lock request share a hash
+static inline vector<unsigned char> InvKey(const CInv& inv)
+{
+    vector<unsigned char> data(sizeof(inv.type) + inv.hash.size());
+    memcpy(&data[0], &inv.type, sizeof(inv.type));
+    memcpy(&data[sizeof(inv.type)], inv.hash.begin(), inv.hash.size());
+    return data;
+}
+
+void CRollingBloomFilter::insert(const CInv& inv)
+{
+    insert(InvKey(inv));
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    if (nInsertions < nBloomSize / 2)
+        return b2.contains(vKey);
+    return b1.contains(vKey);
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    vector<unsigned char> data(hash.begin(), hash.end());
+    return contains(data);
+}
+
+bool CRollingBloomFilter::contains(const CInv& inv) const
+{
+    return contains(InvKey(inv));
+}
+
+void CRollingBloomFilter::clear()
+{
+    b1.clear();
+    b2.clear();
+    nInsertions = 0;
+}
+
+size_t CRollingBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(b1.vData) + memusage::DynamicUsage(b2.vData);
+}
@@ -9,6 +9,7 @@
 
 #include <vector>
 
+class CInv;
 class COutPoint;
 class CTransaction;
 class uint256;
@@ -51,6 +52,10 @@ private:
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
 
+    // Private constructor for CRollingBloomFilter, without the protocol size limits
+    CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
+    friend class CRollingBloomFilter;
+
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
     // Note that if the given parameters will result in a filter outside the bounds of the protocol limits,
@@ -87,6 +92,40 @@ public:
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
+
+    // Removes every element, keeping the size and hash functions
+    void clear();
+};
+
+/**
+ * RollingBloomFilter keeps track of the most recently inserted items in a
+ * fixed amount of memory. contains() always returns true for one of the last
+ * nElements items inserted, and returns true for other items with a
+ * probability of about nFPRate.
+ *
+ * Two filters sized for 2 * nElements items take the insertions; they are
+ * cleared in turn every nElements insertions, and lookups go to whichever
+ * has been filling for longer.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    void insert(const CInv& inv);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+    bool contains(const CInv& inv) const;
+
+    void clear();
+    size_t DynamicMemoryUsage() const;
+
+private:
+    unsigned int nBloomSize;
+    unsigned int nInsertions;
+    CBloomFilter b1, b2;
 };
 
 #endif /* BITCOIN_BLOOM_H */
@@ -12,6 +12,9 @@
 
 #include <stdint.h>
 
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+
 // define START_MASTERNODE_PAYMENTS_TESTNET 1420837558 //Fri, 09 Jan 2015 21:05:58 GMT
 // define START_MASTERNODE_PAYMENTS 1403728576 //Wed, 25 Jun 2014 20:36:16 GMT
 #define START_MASTERNODE_PAYMENTS_TESTNET 1437436800 // 21 Jul 2015
@@ -296,6 +299,14 @@ public:
     void print() const;
 };
 
+/** A transaction that is no longer modified, shared between the mempool, the relay map and the InstantX maps */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+
+static inline CTransactionRef MakeTransactionRef(const CTransaction& tx)
+{
+    return boost::make_shared<CTransaction>(tx);
+}
+
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
 {
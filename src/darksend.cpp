@@ -13,6 +13,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include <algorithm>
 #include <boost/assign/list_of.hpp>
@@ -26,6 +27,8 @@ CCriticalSection cs_darksend;
 CDarksendPool darkSendPool;
 // A helper object for signing messages from Masternodes
 CDarkSendSigner darkSendSigner;
+// Threads recovering gossip signatures for CDarkSendSigner::QueueVerify (0 = verify inline)
+int nSigVerifyThreads = 0;
 // The current Darksends in progress on the network
 std::vector<CDarksendQueue> vecDarksendQueue;
 // Keep track of the used Masternodes
@@ -380,94 +383,9 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
 int randomizeList (int i) { return std::rand()%i;}
 
 // Recursively determine the rounds of a given input (How deep is the Darksend chain for a given input)
-int GetInputDarksendRounds(CTxIn in, int rounds)
+int GetInputDarksendRounds(CTxIn in)
 {
-    static std::map<uint256, CWalletTx> mDenomWtxes;
-
-    if(rounds >= 17) return rounds;
-
-    uint256 hash = in.prevout.hash;
-    unsigned int nout = in.prevout.n;
-
-    CWalletTx wtx;
-    if(pwalletMain->GetTransaction(hash, wtx))
-    {
-        std::map<uint256, CWalletTx>::const_iterator mdwi = mDenomWtxes.find(hash);
-        // not known yet, let's add it
-        if(mdwi == mDenomWtxes.end())
-        {
-            if(fDebug) LogPrintf("GetInputDarksendRounds INSERTING %s\n", hash.ToString());
-            mDenomWtxes[hash] = wtx;
-        }
-        // found and it's not an initial value, just return it
-        else if(mDenomWtxes[hash].vout[nout].nRounds != -10)
-        {
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-
-        // bounds check
-        if(nout >= wtx.vout.size())
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -4;
-            if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        mDenomWtxes[hash].vout[nout].nRounds = -3;
-        if(pwalletMain->IsCollateralAmount(wtx.vout[nout].nValue))
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -3;
-            if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        //make sure the final output is non-denominate
-        mDenomWtxes[hash].vout[nout].nRounds = -2;
-        if(/*rounds == 0 && */!pwalletMain->IsDenominatedAmount(wtx.vout[nout].nValue)) //NOT DENOM
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -2;
-            if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        bool fAllDenoms = true;
-        BOOST_FOREACH(CTxOut out, wtx.vout)
-        {
-            fAllDenoms = fAllDenoms && pwalletMain->IsDenominatedAmount(out.nValue);
-        }
-        // this one is denominated but there is another non-denominated output found in the same tx
-        if(!fAllDenoms)
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = 0;
-            if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        int nShortest = -10; // an initial value, should be no way to get this by calculations
-        bool fDenomFound = false;
-        // only denoms here so let's look up
-        BOOST_FOREACH(CTxIn in2, wtx.vin)
-        {
-            if(pwalletMain->IsMine(in2))
-            {
-                int n = GetInputDarksendRounds(in2, rounds+1);
-                // denom found, find the shortest chain or initially assign nShortest with the first found value
-                if(n >= 0 && (n < nShortest || nShortest == -10))
-                {
-                    nShortest = n;
-                    fDenomFound = true;
-                }
-            }
-        }
-        mDenomWtxes[hash].vout[nout].nRounds = fDenomFound
-                ? nShortest + 1 // good, we a +1 to the shortest one
-                : 0;            // too bad, we are the fist one in that chain
-        if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-        return mDenomWtxes[hash].vout[nout].nRounds;
-    }
-
-    return rounds-1;
+    return pwalletMain->GetOutpointDarksendRounds(in.prevout);
 }
 
 void CDarksendPool::Reset(){
@@ -2029,22 +1947,136 @@ bool CDarkSendSigner::SignMessage(std::string strMessage, std::string& errorMess
     return true;
 }
 
-bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+// The same dsee/dseep/mnw/dsq/txlvote/spork reaches us from most of our peers, so signers recovered
+// from (message hash, signature) pairs are remembered. A null CKeyID records a failed recovery.
+static CCriticalSection cs_sigcache;
+static std::map<uint256, CKeyID> mapSigCache;
+static std::deque<uint256> dequeSigCache;
+
+struct CSigVerifyJob
+{
+    uint256 hashEntry;
+    uint256 hashMessage;
+    std::vector<unsigned char> vchSig;
+};
+
+static boost::mutex csSigVerify;
+static boost::condition_variable condSigVerify;
+static boost::condition_variable condSigVerifyDone;
+static std::deque<CSigVerifyJob> queueSigVerify;
+// queued signatures and the peers that parked messages on them
+static std::map<uint256, std::vector<NodeId> > mapSigVerifyPending;
+
+static uint256 GetSignedMessageHash(const std::string& strMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    return ss.GetHash();
+}
 
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+static uint256 GetSigCacheEntry(const uint256& hashMessage, const std::vector<unsigned char>& vchSig)
+{
+    return Hash(BEGIN(hashMessage), END(hashMessage), vchSig.begin(), vchSig.end());
+}
+
+static bool GetCachedSigner(const uint256& hashEntry, CKeyID& keyID)
+{
+    LOCK(cs_sigcache);
+    std::map<uint256, CKeyID>::const_iterator it = mapSigCache.find(hashEntry);
+    if (it == mapSigCache.end())
+        return false;
+    keyID = it->second;
+    return true;
+}
+
+static void CacheSigner(const uint256& hashEntry, const CKeyID& keyID)
+{
+    LOCK(cs_sigcache);
+    if (!mapSigCache.insert(make_pair(hashEntry, keyID)).second)
+        return;
+    dequeSigCache.push_back(hashEntry);
+    while (dequeSigCache.size() > MAX_SIGCACHE_SIZE) {
+        mapSigCache.erase(dequeSigCache.front());
+        dequeSigCache.pop_front();
+    }
+}
+
+// Recover the key that signed hashMessage, or a null CKeyID if vchSig isn't a valid compact signature
+static CKeyID RecoverSigner(const uint256& hashEntry, const uint256& hashMessage, const std::vector<unsigned char>& vchSig)
+{
+    CKeyID keyID;
+    if (GetCachedSigner(hashEntry, keyID))
+        return keyID;
+
+    CPubKey pubkey;
+    if (pubkey.RecoverCompact(hashMessage, vchSig))
+        keyID = pubkey.GetID();
+    CacheSigner(hashEntry, keyID);
+    return keyID;
+}
+
+bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+{
+    uint256 hashMessage = GetSignedMessageHash(strMessage);
+
+    CKeyID keyID = RecoverSigner(GetSigCacheEntry(hashMessage, vchSig), hashMessage, vchSig);
+    if (keyID == CKeyID()) {
         errorMessage = _("Error recovering public key.");
         return false;
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CDarkSendSigner::VerifyMessage -- keys don't match: %s %s", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (fDebug && keyID != pubkey.GetID())
+        LogPrintf("CDarkSendSigner::VerifyMessage -- keys don't match: %s %s", keyID.ToString(), pubkey.GetID().ToString());
+
+    return (keyID == pubkey.GetID());
+}
+
+bool CDarkSendSigner::QueueVerify(const std::string& strMessage, const std::vector<unsigned char>& vchSig, uint256& hashEntry, NodeId idWaiting)
+{
+    if (nSigVerifyThreads <= 0)
+        return false;
+
+    CSigVerifyJob job;
+    job.hashMessage = GetSignedMessageHash(strMessage);
+    job.vchSig = vchSig;
+    job.hashEntry = hashEntry = GetSigCacheEntry(job.hashMessage, vchSig);
+
+    CKeyID keyID;
+    if (GetCachedSigner(hashEntry, keyID))
+        return false;
+
+    {
+        boost::unique_lock<boost::mutex> lock(csSigVerify);
+        std::map<uint256, std::vector<NodeId> >::iterator it = mapSigVerifyPending.find(hashEntry);
+        if (it != mapSigVerifyPending.end()) {
+            if (idWaiting >= 0)
+                it->second.push_back(idWaiting);
+            return true;
+        }
+        if (queueSigVerify.size() >= MAX_SIGVERIFY_QUEUE)
+            return false;
+        std::vector<NodeId>& vWaiting = mapSigVerifyPending[hashEntry];
+        if (idWaiting >= 0)
+            vWaiting.push_back(idWaiting);
+        queueSigVerify.push_back(job);
+    }
+    condSigVerify.notify_one();
+    return true;
+}
+
+bool CDarkSendSigner::IsVerifyPending(const uint256& hashEntry)
+{
+    boost::unique_lock<boost::mutex> lock(csSigVerify);
+    return mapSigVerifyPending.count(hashEntry) > 0;
+}
 
-    return (pubkey2.GetID() == pubkey.GetID());
+void CDarkSendSigner::WaitVerified(const std::vector<uint256>& vHashEntries)
+{
+    boost::unique_lock<boost::mutex> lock(csSigVerify);
+    BOOST_FOREACH(const uint256& hashEntry, vHashEntries)
+        while (mapSigVerifyPending.count(hashEntry))
+            condSigVerifyDone.wait(lock);
 }
 
 bool CDarksendQueue::Sign()
@@ -2085,8 +2117,9 @@ bool CDarksendQueue::Relay()
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
             pnode->AddRef();
     }
+    CSerializeDataRef msg = SerializeMessage("dsq", *this);
     BOOST_FOREACH(CNode* pnode, vNodesCopy)
-            pnode->PushMessage("dsq", (*this));
+            pnode->PushSerializedMessage(msg);
 
     {
         LOCK(cs_vNodes);
@@ -2238,5 +2271,35 @@ void ThreadCheckDarkSendPool()
     }
 }
 
+void ThreadSigVerify()
+{
+    RenameThread("chaincoin-sigverify");
+    while (true)
+    {
+        CSigVerifyJob job;
+        {
+            boost::unique_lock<boost::mutex> lock(csSigVerify);
+            while (queueSigVerify.empty())
+                condSigVerify.wait(lock);
+            job = queueSigVerify.front();
+            queueSigVerify.pop_front();
+        }
 
+        RecoverSigner(job.hashEntry, job.hashMessage, job.vchSig);
 
+        std::vector<NodeId> vWaiting;
+        {
+            boost::unique_lock<boost::mutex> lock(csSigVerify);
+            std::map<uint256, std::vector<NodeId> >::iterator it = mapSigVerifyPending.find(job.hashEntry);
+            if (it != mapSigVerifyPending.end()) {
+                vWaiting.swap(it->second);
+                mapSigVerifyPending.erase(it);
+            }
+        }
+        condSigVerifyDone.notify_all();
+
+        // The parked messages are cache hits now, don't leave them to the next handler tick
+        BOOST_FOREACH(NodeId id, vWaiting)
+            WakeMessageHandler(id);
+    }
+}
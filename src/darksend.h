@@ -47,6 +47,14 @@ class CActiveMasternode;
 #define DARKSEND_RELAY_OUT                2
 #define DARKSEND_RELAY_SIG                3
 
+/** -sigverifythreads default (number of threads recovering masternode message signatures) */
+static const int DEFAULT_SIGVERIFY_THREADS = 2;
+/** Maximum number of message signatures waiting for recovery before they are verified inline */
+static const unsigned int MAX_SIGVERIFY_QUEUE = 5000;
+/** Maximum number of recovered message signatures remembered by CDarkSendSigner */
+static const unsigned int MAX_SIGCACHE_SIZE = 50000;
+
+extern int nSigVerifyThreads;
 extern CDarksendPool darkSendPool;
 extern CDarkSendSigner darkSendSigner;
 extern std::vector<CDarksendQueue> vecDarksendQueue;
@@ -54,8 +62,8 @@ extern std::string strMasterNodePrivKey;
 extern map<uint256, CDarksendBroadcastTx> mapDarksendBroadcastTxes;
 extern CActiveMasternode activeMasternode;
 
-// get the Darksend chain depth for a given input
-int GetInputDarksendRounds(CTxIn in, int rounds=0);
+// get the Darksend chain depth for a given input, see CWallet::GetOutpointDarksendRounds
+int GetInputDarksendRounds(CTxIn in);
 
 /** Holds an Darksend input
  */
@@ -252,6 +260,13 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Hand the signature over to the verification threads, returns false if it's already recovered or can't be queued.
+    /// The message handler of peer idWaiting is woken once it is recovered.
+    bool QueueVerify(const std::string& strMessage, const std::vector<unsigned char>& vchSig, uint256& hashEntry, NodeId idWaiting = -1);
+    /// Is the signature queued as hashEntry still waiting for recovery?
+    bool IsVerifyPending(const uint256& hashEntry);
+    /// Wait until none of the queued signatures is waiting for recovery any more
+    void WaitVerified(const std::vector<uint256>& vHashEntries);
 };
 
 /** Used to keep track of current status of Darksend pool
@@ -525,5 +540,6 @@ struct CompareOutputBIP69
 };
 
 void ThreadCheckDarkSendPool();
+void ThreadSigVerify();
 
 #endif
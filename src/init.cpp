@@ -11,6 +11,7 @@
 #include "init.h"
 
 #include "torcontrol.h"
+#include "stratum.h"
 
 #include "addrman.h"
 #include "checkpoints.h"
@@ -19,6 +20,7 @@
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "socketevents.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -102,6 +104,8 @@ enum BindFlags {
 //
 
 volatile bool fRequestShutdown = false;
+// Only overwrite mempool.dat once it has been fully loaded
+static bool fDumpMempoolLater = false;
 
 void StartShutdown()
 {
@@ -145,6 +149,7 @@ void Shutdown()
     RenameThread("chaincoin-shutoff");
     mempool.AddTransactionsUpdated(1);
     InterruptTorControl();
+    InterruptStratumServer();
     StopRPCThreads();
     ShutdownRPCMining();
 #ifdef ENABLE_WALLET
@@ -152,8 +157,11 @@ void Shutdown()
         bitdb.Flush(false);
     GenerateBitcoins(false, NULL, 0);
 #endif
+    StopStratumServer();
     StopNode();
     DumpMasternodes();
+    if (fDumpMempoolLater && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
     {
@@ -239,19 +247,29 @@ std::string HelpMessage(HelpMessageMode hmm)
     }
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
+    strUsage += "  -limitancestorcount=<n>   " + strprintf(_("Do not accept transactions with <n> or more in-mempool ancestors (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+    strUsage += "  -limitancestorsize=<n>    " + strprintf(_("Do not accept transactions whose in-mempool ancestors exceed <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+    strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+    strUsage += "  -limitdescendantsize=<n>  " + strprintf(_("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> MiB (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL) + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: chaincoind.pid)") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
     strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
+    strUsage += "  -txprevalidation=<n>   " + strprintf(_("Set the number of threads verifying relayed transactions before they take the main lock (0 = verify inline, default: %d)"), DEFAULT_TXPREVALIDATION_THREADS) + "\n";
+    strUsage += "  -msghandthreads=<n>    " + strprintf(_("Set the number of threads handling peer messages (1-%d, default: %d)"), MAX_MSGHAND_THREADS, DEFAULT_MSGHAND_THREADS) + "\n";
+    strUsage += "  -sigverifythreads=<n>  " + strprintf(_("Set the number of threads recovering masternode message signatures (0 = verify inline, default: %d)"), DEFAULT_SIGVERIFY_THREADS) + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
     strUsage += "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n";
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -bind=<addr>           " + _("Bind to given address and always listen on it. Use [host]:port notation for IPv6") + "\n";
+    strUsage += "  -blocksonly            " + strprintf(_("Ask peers not to relay transactions and ignore the ones they send; own transactions are still relayed (default: %u)"), DEFAULT_BLOCKSONLY) + "\n";
     strUsage += "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n";
     strUsage += "  -discover              " + _("Discover own IP address (default: 1 when listening and no -externalip)") + "\n";
     strUsage += "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + _("(default: 1)") + "\n";
@@ -267,6 +285,11 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -port=<port>           " + _("Listen for connections on <port> (default: 11994 or testnet: 21994)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS proxy") + "\n";
     strUsage += "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n";
+#ifdef USE_EPOLL
+    strUsage += "  -socketevents=<mode>   " + _("Wait for socket readiness with <mode> (epoll or select, default: epoll)") + "\n";
+#else
+    strUsage += "  -socketevents=<mode>   " + _("Wait for socket readiness with <mode> (select, default: select)") + "\n";
+#endif
     strUsage += "  -socks=<n>             " + _("Select SOCKS version for -proxy (4 or 5, default: 5)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -torcontrol=<ip>:<port>" + _("Tor control port to use if onion listening enabled (default: 1)") + "\n";
@@ -313,7 +336,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -debug=<category>      " + _("Output debugging information (default: 0, supplying <category> is optional)") + "\n";
     strUsage += "                         " + _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage += "                         " + _("<category> can be:");
-    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net"; // Don't translate these and qt below
+    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net, stratum"; // Don't translate these and qt below
     if (hmm == HMM_BITCOIN_QT)
         strUsage += ", qt";
     strUsage += ".\n";
@@ -368,6 +391,13 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -blockmaxsize=<n>      " + strprintf(_("Set maximum block size in bytes (default: %d)"), DEFAULT_BLOCK_MAX_SIZE) + "\n";
     strUsage += "  -blockprioritysize=<n> " + strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE) + "\n";
 
+    strUsage += "\n" + _("Stratum server options:") + "\n";
+    strUsage += "  -stratum               " + strprintf(_("Accept Stratum mining connections (default: %u)"), DEFAULT_STRATUM) + "\n";
+    strUsage += "  -stratumaddress=<addr> " + _("Address paid by blocks mined through the Stratum server") + "\n";
+    strUsage += "  -stratumbind=<addr>    " + _("Bind the Stratum server to given address (default: 127.0.0.1)") + "\n";
+    strUsage += "  -stratumport=<port>    " + strprintf(_("Listen for Stratum connections on <port> (default: %u)"), DEFAULT_STRATUM_PORT) + "\n";
+    strUsage += "  -stratumdifficulty=<n> " + strprintf(_("Share difficulty sent to Stratum miners (default: %g)"), DEFAULT_STRATUM_DIFFICULTY) + "\n";
+
     strUsage += "\n" + _("RPC server options:") + "\n";
     strUsage += "  -server                " + _("Accept command line and JSON-RPC commands") + "\n";
     strUsage += "  -rpcuser=<user>        " + _("Username for JSON-RPC connections") + "\n";
@@ -448,6 +478,11 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LogPrintf("Warning: Could not open blocks file %s\n", path.string());
         }
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool();
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Sanity checks
@@ -579,7 +614,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    std::string strSocketEvents = GetArg("-socketevents", DEFAULT_SOCKETEVENTS);
+    if (!InitSocketEvents(strSocketEvents))
+        return InitError(strprintf(_("Unsupported -socketevents mode: '%s'"), strSocketEvents));
+    // Only select() is limited to FD_SETSIZE sockets
+    if (strSocketEvents == "select")
+        nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -600,6 +641,8 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     fBenchmark = GetBoolArg("-benchmark", false);
     mempool.setSanityCheck(GetBoolArg("-checkmempool", RegTest()));
+    if (GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) < 1)
+        return InitError(strprintf(_("Invalid -maxmempool=<n>: '%s' (must be at least 1 MiB)"), mapArgs["-maxmempool"]));
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
@@ -707,6 +750,23 @@ bool AppInit2(boost::thread_group& threadGroup)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    nTxPrevalidationThreads = std::max(0, (int)GetArg("-txprevalidation", DEFAULT_TXPREVALIDATION_THREADS));
+    if (nTxPrevalidationThreads) {
+        LogPrintf("Using %u threads for transaction pre-validation\n", nTxPrevalidationThreads);
+        for (int i=0; i<nTxPrevalidationThreads; i++)
+            threadGroup.create_thread(&ThreadTxPrevalidation);
+    }
+
+    nMsgHandlerThreads = std::max(1, std::min(MAX_MSGHAND_THREADS, (int)GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS)));
+    LogPrintf("Using %u threads for peer message handling\n", nMsgHandlerThreads);
+
+    nSigVerifyThreads = std::max(0, (int)GetArg("-sigverifythreads", DEFAULT_SIGVERIFY_THREADS));
+    if (nSigVerifyThreads) {
+        LogPrintf("Using %u threads for masternode message signature verification\n", nSigVerifyThreads);
+        for (int i=0; i<nSigVerifyThreads; i++)
+            threadGroup.create_thread(&ThreadSigVerify);
+    }
+
     if (mapArgs.count("-masternodepaymentskey")) // masternode payments priv key
     {
         if (!masternodePayments.SetPrivKey(GetArg("-masternodepaymentskey", "")))
@@ -901,6 +961,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     // see Step 2: parameter interactions for more information about these
     fNoListen = !GetBoolArg("-listen", true);
     fDiscover = GetBoolArg("-discover", true);
+    fBlocksOnly = GetBoolArg("-blocksonly", DEFAULT_BLOCKSONLY);
+    if (fBlocksOnly)
+        LogPrintf("Blocks only mode: not relaying transactions from peers\n");
     fNameLookup = GetBoolArg("-dns", true);
 
     bool fBound = false;
@@ -1244,6 +1307,11 @@ bool AppInit2(boost::thread_group& threadGroup)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    {
+        // collateral spends are tracked as they happen from here on
+        LOCK(cs_main);
+        mnodeman.CheckCollaterals();
+    }
 
     fMasterNode = GetBoolArg("-masternode", false);
     if(fMasterNode) {
@@ -1344,6 +1412,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     darkSendDenominations.push_back( (.001     * COIN)+1 );
     */
 
+    // The rounds index depends on the denominations above
+    if (pwalletMain)
+        pwalletMain->IndexDarksendRounds();
+
     darkSendPool.InitCollateralAddress();
 
     threadGroup.create_thread(boost::bind(&ThreadCheckDarkSendPool));
@@ -1391,6 +1463,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fServer)
         StartRPCThreads();
 
+    if (GetBoolArg("-stratum", DEFAULT_STRATUM))
+    {
+        std::string strError;
+        if (!StartStratumServer(strError))
+            return InitError(strError);
+    }
+
 #ifdef ENABLE_WALLET
     // Generate coins in the background
     if (pwalletMain)
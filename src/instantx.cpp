@@ -15,18 +15,42 @@
 #include "darksend.h"
 #include "spork.h"
 #include <boost/lexical_cast.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <queue>
 
 using namespace std;
 using namespace boost;
 
-std::map<uint256, CTransaction> mapTxLockReq;
-std::map<uint256, CTransaction> mapTxLockReqRejected;
+std::map<uint256, CTransactionRef> mapTxLockReq;
+std::map<uint256, CTransactionRef> mapTxLockReqRejected;
 std::map<uint256, CConsensusVote> mapTxLockVote;
 std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
 
+// InstantX quorums by block height (collateral -> rank), computed from the list version
+// nQuorumListVersion as of hashQuorumTip
+typedef boost::unordered_map<COutPoint, int, COutPointHasher> QuorumMap;
+static CCriticalSection cs_quorums;
+static std::map<int, QuorumMap> mapQuorums;
+static uint256 hashQuorumTip;
+static unsigned int nQuorumListVersion;
+
+// lock expirations, soonest first. An entry is stale once its lock is gone or got a new nExpiration.
+typedef std::pair<int, uint256> LockExpiry;
+static CCriticalSection cs_lockexpiry;
+static std::priority_queue<LockExpiry, std::vector<LockExpiry>, std::greater<LockExpiry> > heapLockExpiry;
+
+static void SetLockExpiration(CTransactionLock& lock, int nExpiration)
+{
+    lock.nExpiration = nExpiration;
+
+    LOCK(cs_lockexpiry);
+    heapLockExpiry.push(make_pair(nExpiration, lock.txHash));
+}
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -72,6 +96,11 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
+            // Share the mempool's copy rather than keeping another one
+            CTransactionRef ptx = mempool.get(tx.GetHash());
+            if (!ptx)
+                ptx = MakeTransactionRef(tx);
+
             vector<CInv> vInv;
             vInv.push_back(inv);
             LOCK(cs_vNodes);
@@ -80,7 +109,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            mapTxLockReq.insert(make_pair(tx.GetHash(), ptx));
 
             LogPrintf("ProcessMessageInstantX::txlreq - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -90,7 +119,8 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+            CTransactionRef ptx = MakeTransactionRef(tx);
+            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), ptx));
 
             // can we get the conflicting transaction as proof?
 
@@ -115,7 +145,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 
                         CValidationState state;
                         DisconnectBlockAndInputs(state, tx);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                        mapTxLockReq.insert(make_pair(tx.GetHash(), ptx));
                     }
                 }
             }
@@ -243,12 +273,12 @@ int64_t CreateNewLock(CTransaction tx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime()+(60*60); //locks expire after 60 minutes (6 confirmations)
         newLock.nTimeout = GetTime()+(60*5);
         newLock.txHash = tx.GetHash();
+        SetLockExpiration(newLock, GetTime()+(60*60)); //locks expire after 60 minutes (6 confirmations)
         mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
     } else {
-        mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
+        mapTxLocks[tx.GetHash()].SetBlockHeight(nBlockHeight);
         if(fDebug) LogPrintf("CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
     }
 
@@ -262,17 +292,11 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
 {
     if(!fMasterNode) return;
 
-    int n = mnodeman.GetMasternodeRank(activeMasternode.vin, nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+    int n = GetQuorumRank(activeMasternode.vin, nBlockHeight);
 
     if(n == -1)
     {
-        if(fDebug) LogPrintf("InstantX::DoConsensusVote - Unknown Masternode\n");
-        return;
-    }
-
-    if(n > INSTANTX_SIGNATURES_TOTAL)
-    {
-        if(fDebug) LogPrintf("InstantX::DoConsensusVote - Masternode not in the top %d (%d)\n", INSTANTX_SIGNATURES_TOTAL, n);
+        if(fDebug) LogPrintf("InstantX::DoConsensusVote - Masternode not in the top %d\n", INSTANTX_SIGNATURES_TOTAL);
         return;
     }
     /*
@@ -310,26 +334,16 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
 //received a consensus vote
 bool ProcessConsensusVote(CConsensusVote& ctx)
 {
-    int n = mnodeman.GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
-
-    CMasternode* pmn = mnodeman.Find(ctx.vinMasternode);
-    if(pmn != NULL)
-    {
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Masternode ADDR %s %d\n", pmn->addr.ToString().c_str(), n);
-    }
+    int n = GetQuorumRank(ctx.vinMasternode, ctx.nBlockHeight);
 
     if(n == -1)
     {
         //can be caused by past versions trying to vote with an invalid protocol
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Unknown Masternode\n");
+        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Unknown Masternode or not in the top %d - %s\n", INSTANTX_SIGNATURES_TOTAL, ctx.GetHash().ToString().c_str());
         return false;
     }
 
-    if(n > INSTANTX_SIGNATURES_TOTAL)
-    {
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Masternode not in the top %d (%d) - %s\n", INSTANTX_SIGNATURES_TOTAL, n, ctx.GetHash().ToString().c_str());
-        return false;
-    }
+    if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Masternode %s rank %d\n", ctx.vinMasternode.ToString().c_str(), n);
 
     if(!ctx.SignatureValid()) {
         LogPrintf("InstantX::ProcessConsensusVote - Signature invalid\n");
@@ -342,9 +356,9 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime()+(60*60);
         newLock.nTimeout = GetTime()+(60*5);
         newLock.txHash = ctx.txHash;
+        SetLockExpiration(newLock, GetTime()+(60*60));
         mapTxLocks.insert(make_pair(ctx.txHash, newLock));
     } else {
         if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
@@ -368,7 +382,9 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
         if((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
             if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
+            std::map<uint256, CTransactionRef>::iterator itReq = mapTxLockReq.find(ctx.txHash);
+            CTransactionRef ptx = itReq != mapTxLockReq.end() ? itReq->second : MakeTransactionRef(CTransaction());
+            const CTransaction& tx = *ptx;
             if(!CheckForConflictingLocks(tx)){
 
 #ifdef ENABLE_WALLET
@@ -392,7 +408,7 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
                 //if this tx lock was rejected, we need to remove the conflicting blocks
                 if(mapTxLockReqRejected.count((*i).second.txHash)){
                     CValidationState state;
-                    DisconnectBlockAndInputs(state, mapTxLockReqRejected[(*i).second.txHash]);
+                    DisconnectBlockAndInputs(state, *mapTxLockReqRejected[(*i).second.txHash]);
                 }
             }
         }
@@ -403,7 +419,7 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
     return false;
 }
 
-bool CheckForConflictingLocks(CTransaction& tx)
+bool CheckForConflictingLocks(const CTransaction& tx)
 {
     /*
         It's possible (very unlikely though) to get 2 conflicting transaction locks approved by the network.
@@ -416,8 +432,8 @@ bool CheckForConflictingLocks(CTransaction& tx)
         if(mapLockedInputs.count(in.prevout)){
             if(mapLockedInputs[in.prevout] != tx.GetHash()){
                 LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if(mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if(mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
+                if(mapTxLocks.count(tx.GetHash())) SetLockExpiration(mapTxLocks[tx.GetHash()], GetTime());
+                if(mapTxLocks.count(mapLockedInputs[in.prevout])) SetLockExpiration(mapTxLocks[mapLockedInputs[in.prevout]], GetTime());
                 return true;
             }
         }
@@ -445,52 +461,97 @@ void CleanTransactionLocksList()
 {
     if(chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    int64_t nNow = GetTime();
 
-    while(it != mapTxLocks.end()) {
-        if(GetTime() > it->second.nExpiration){ //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    while(true) {
+        LockExpiry expiry;
+        {
+            LOCK(cs_lockexpiry);
+            if(heapLockExpiry.empty() || heapLockExpiry.top().first >= nNow) break;
+            expiry = heapLockExpiry.top();
+            heapLockExpiry.pop();
+        }
 
-            // loop through masternodes that responded
-            for(int nRank = 0; nRank <= INSTANTX_SIGNATURES_TOTAL; nRank++)
-            {
-                CMasternode* pmn = mnodeman.GetMasternodeByRank(nRank, it->second.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
-                if(!pmn) continue;
+        // rescheduled locks have a later heap entry of their own
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(expiry.second);
+        if(it == mapTxLocks.end() || it->second.nExpiration != expiry.first) continue;
 
-                bool fFound = false;
-                BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
-                {
-                    if(pmn->vin == v.vinMasternode){ //Masternode responded
-                        fFound = true;
-                    }
-                }
+        //keep them for an hour
+        LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
 
-                if(!fFound){
-                    //increment a scanning error
-                    CMasternodeScanningError mnse(pmn->vin, SCANNING_ERROR_IX_NO_RESPONSE, it->second.nBlockHeight);
-                    pmn->ApplyScanningError(mnse);
-                }
-            }
+        // loop through masternodes that responded
+        std::set<COutPoint> setResponded;
+        BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
+            setResponded.insert(v.vinMasternode.prevout);
 
-            if(mapTxLockReq.count(it->second.txHash)){
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+        std::vector<CTxIn> vQuorum = mnodeman.GetTopMasternodes(it->second.nBlockHeight, INSTANTX_SIGNATURES_TOTAL, MIN_INSTANTX_PROTO_VERSION);
+        BOOST_FOREACH(const CTxIn& vin, vQuorum)
+        {
+            if(setResponded.count(vin.prevout)) continue;
 
-                BOOST_FOREACH(const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+            CMasternode* pmn = mnodeman.Find(vin);
+            if(!pmn) continue;
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+            //increment a scanning error
+            CMasternodeScanningError mnse(pmn->vin, SCANNING_ERROR_IX_NO_RESPONSE, it->second.nBlockHeight);
+            pmn->ApplyScanningError(mnse);
+        }
 
-                BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
+        if(mapTxLockReq.count(it->second.txHash)){
+            CTransactionRef ptx = mapTxLockReq[it->second.txHash];
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            BOOST_FOREACH(const CTxIn& in, ptx->vin)
+                mapLockedInputs.erase(in.prevout);
+
+            mapTxLockReq.erase(it->second.txHash);
+            mapTxLockReqRejected.erase(it->second.txHash);
+
+            BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
         }
+
+        mapTxLocks.erase(it);
+    }
+}
+
+int GetQuorumRank(const CTxIn& vin, int nBlockHeight)
+{
+    uint256 hashTip;
+    {
+        LOCK(cs_main);
+        if(chainActive.Tip() == NULL) return -1;
+        hashTip = chainActive.Tip()->GetBlockHash();
     }
 
+    LOCK(cs_quorums);
+
+    // the quorums are taken from the list as it is at the tip, start over on a new tip or
+    // once masternodes were added, removed or changed state
+    unsigned int nListVersion = mnodeman.GetListVersion();
+    if(hashTip != hashQuorumTip || nListVersion != nQuorumListVersion) {
+        mapQuorums.clear();
+        hashQuorumTip = hashTip;
+        nQuorumListVersion = nListVersion;
+    }
+
+    std::map<int, QuorumMap>::iterator it = mapQuorums.find(nBlockHeight);
+    if(it == mapQuorums.end()) {
+        std::vector<CTxIn> vQuorum = mnodeman.GetTopMasternodes(nBlockHeight, INSTANTX_SIGNATURES_TOTAL, MIN_INSTANTX_PROTO_VERSION);
+        // no list yet or an unknown block, nothing worth remembering
+        if(vQuorum.empty()) return -1;
+
+        if(mapQuorums.size() >= INSTANTX_QUORUM_CACHE_SIZE)
+            mapQuorums.erase(mapQuorums.begin());
+
+        it = mapQuorums.insert(make_pair(nBlockHeight, QuorumMap())).first;
+        for(unsigned int i = 0; i < vQuorum.size(); i++)
+            it->second[vQuorum[i].prevout] = i + 1;
+    }
+
+    QuorumMap::const_iterator itRank = it->second.find(vin.prevout);
+    if(itRank == it->second.end()) return -1;
+
+    return itRank->second;
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -574,17 +635,11 @@ bool CTransactionLock::SignaturesValid()
 
     BOOST_FOREACH(CConsensusVote vote, vecConsensusVotes)
     {
-        int n = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+        int n = GetQuorumRank(vote.vinMasternode, vote.nBlockHeight);
 
         if(n == -1)
         {
-            LogPrintf("InstantX::DoConsensusVote - Unknown Masternode\n");
-            return false;
-        }
-
-        if(n > INSTANTX_SIGNATURES_TOTAL)
-        {
-            LogPrintf("InstantX::DoConsensusVote - Masternode not in the top %s\n", INSTANTX_SIGNATURES_TOTAL);
+            LogPrintf("InstantX::DoConsensusVote - Masternode not in the top %d\n", INSTANTX_SIGNATURES_TOTAL);
             return false;
         }
 
@@ -600,6 +655,20 @@ bool CTransactionLock::SignaturesValid()
 void CTransactionLock::AddSignature(CConsensusVote& cv)
 {
     vecConsensusVotes.push_back(cv);
+    if(cv.nBlockHeight == nBlockHeight) nSignatures++;
+}
+
+void CTransactionLock::SetBlockHeight(int nBlockHeightIn)
+{
+    if(nBlockHeightIn == nBlockHeight) return;
+
+    nBlockHeight = nBlockHeightIn;
+    nSignatures = 0;
+    BOOST_FOREACH(const CConsensusVote& v, vecConsensusVotes){
+        if(v.nBlockHeight == nBlockHeight){
+            nSignatures++;
+        }
+    }
 }
 
 int CTransactionLock::CountSignatures()
@@ -611,11 +680,5 @@ int CTransactionLock::CountSignatures()
 
     if(nBlockHeight == 0) return -1;
 
-    int n = 0;
-    BOOST_FOREACH(CConsensusVote v, vecConsensusVotes){
-        if(v.nBlockHeight == nBlockHeight){
-            n++;
-        }
-    }
-    return n;
+    return nSignatures;
 }
@@ -23,9 +23,11 @@ class CTransaction;
 class CTransactionLock;
 
 static const int MIN_INSTANTX_PROTO_VERSION = 70066;
+/** Number of block heights whose InstantX quorum is kept around */
+static const unsigned int INSTANTX_QUORUM_CACHE_SIZE = 100;
 
-extern map<uint256, CTransaction> mapTxLockReq;
-extern map<uint256, CTransaction> mapTxLockReqRejected;
+extern map<uint256, CTransactionRef> mapTxLockReq;
+extern map<uint256, CTransactionRef> mapTxLockReqRejected;
 extern map<uint256, CConsensusVote> mapTxLockVote;
 extern map<uint256, CTransactionLock> mapTxLocks;
 extern std::map<COutPoint, uint256> mapLockedInputs;
@@ -37,7 +39,7 @@ int64_t CreateNewLock(CTransaction tx);
 bool IsIXTXValid(const CTransaction& txCollateral);
 
 // if two conflicting locks are approved by the network, they will cancel out
-bool CheckForConflictingLocks(CTransaction& tx);
+bool CheckForConflictingLocks(const CTransaction& tx);
 
 void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
@@ -50,6 +52,9 @@ bool ProcessConsensusVote(CConsensusVote& ctx);
 // keep transaction locks in memory for an hour
 void CleanTransactionLocksList();
 
+// rank (1-based) of vin in the InstantX quorum for nBlockHeight, -1 if it isn't part of it
+int GetQuorumRank(const CTxIn& vin, int nBlockHeight);
+
 int64_t GetAverageVoteTime();
 
 class CConsensusVote
@@ -83,14 +88,27 @@ public:
     int nExpiration;
     int nTimeout;
 
+    CTransactionLock()
+    {
+        nBlockHeight = 0;
+        nExpiration = 0;
+        nTimeout = 0;
+        nSignatures = 0;
+    }
+
     bool SignaturesValid();
     int CountSignatures();
     void AddSignature(CConsensusVote& cv);
+    void SetBlockHeight(int nBlockHeightIn);
 
     uint256 GetHash()
     {
         return txHash;
     }
+
+private:
+    // votes for nBlockHeight, kept up to date by AddSignature and SetBlockHeight
+    int nSignatures;
 };
 
 
@@ -22,12 +22,14 @@
 #include "util.h"
 #include "spork.h"
 
+#include <deque>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 using namespace std;
 using namespace boost;
@@ -47,8 +49,12 @@ CTxMemPool mempool;
 map<uint256, CBlockIndex*> mapBlockIndex;
 CChain chainActive;
 CChain chainMostWork;
+CWaitableCriticalSection csBestBlock;
+boost::condition_variable cvBlockChange;
+uint256 hashBestBlock;
 int64_t nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+int nTxPrevalidationThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
@@ -871,8 +877,18 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 }
 
 
+/** Script verification flags for transactions entering the memory pool */
+static const unsigned int MEMPOOL_SCRIPT_VERIFY_FLAGS = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG;
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees,
+                                bool fScriptsChecked)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -974,21 +990,27 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         int64_t nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
+        // Fee checks use the fee as adjusted by prioritisetransaction
+        double dPriorityDelta = 0;
+        int64_t nFeeDelta = 0;
+        pool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+        int64_t nModifiedFees = nFees + nFeeDelta;
+
         // Don't accept it if it can't get into a block
         if(!ignoreFees){
             int64_t txMinFee = GetMinFee(tx, nSize, true, GMF_RELAY);
-            if (fLimitFree && nFees < txMinFee)
+            if (fLimitFree && nModifiedFees < txMinFee)
                 return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
-                                          hash.ToString(), nFees, txMinFee),
+                                          hash.ToString(), nModifiedFees, txMinFee),
                                  REJECT_INSUFFICIENTFEE, "insufficient fee");
 
             // Continuously rate-limit free transactions
             // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
             // be annoying or make others' transactions take longer to confirm.
-            if (fLimitFree && nFees < CTransaction::nMinRelayTxFee)
+            if (fLimitFree && nModifiedFees < CTransaction::nMinRelayTxFee)
             {
                 static CCriticalSection csFreeLimiter;
                 static double dFreeCount;
@@ -1010,21 +1032,53 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             }
         }
 
+        // Once the pool has been trimmed, require at least the rolling minimum fee
+        size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1024 * 1024;
+        if (!ignoreFees && fLimitFree) {
+            int64_t nMempoolRejectFee = pool.GetMinFee(nMaxMempool) * nSize / 1000;
+            if (nMempoolRejectFee > 0 && nModifiedFees < nMempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                          hash.ToString(), nModifiedFees, nMempoolRejectFee),
+                                 REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         if (fRejectInsaneFee && nFees > CTransaction::nMinRelayTxFee * 10000)
             return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
                          hash.ToString(),
                          nFees, CTransaction::nMinRelayTxFee * 10000);
 
+        // Keep unconfirmed chains short, so the pool's package bookkeeping stays cheap
+        std::string strPackageError;
+        if (!pool.CheckPackageLimits(tx, nSize,
+                                     GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                     GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                     GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                     GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                                     strPackageError))
+            return state.DoS(0, error("AcceptToMemoryPool : %s %s", strPackageError, hash.ToString()),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG))
+        // Scripts may already have been verified outside cs_main by ThreadTxPrevalidation.
+        if (!CheckInputs(tx, state, view, !fScriptsChecked, MEMPOOL_SCRIPT_VERIFY_FLAGS))
         {
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
+
+        // Make room if needed; the new transaction itself may be the one evicted
+        list<CTransaction> removed;
+        pool.TrimToSize(nMaxMempool, removed);
+        BOOST_FOREACH(const CTransaction& txRemoved, removed)
+            mnodeman.UnspendCollaterals(txRemoved);
+        if (!pool.exists(hash))
+            return state.DoS(0, error("AcceptToMemoryPool : mempool full %s", hash.ToString()),
+                             REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
+    mnodeman.SpendCollaterals(tx);
     g_signals.SyncTransaction(hash, tx, NULL);
 
     return true;
@@ -1148,6 +1202,133 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState &state, const CTransact
 }
 
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    FILE* file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nCount = 0;
+    int64_t nSkipped = 0;
+    int64_t nFailed = 0;
+
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool() : unsupported mempool.dat version %u", nVersion);
+
+        uint64_t nTotal;
+        filein >> nTotal;
+        LogPrintf("Loading %u mempool transactions from disk...\n", nTotal);
+        int nLastProgress = 0;
+        for (uint64_t i = 0; i < nTotal; i++) {
+            CTransaction tx;
+            int64_t nTime;
+            int64_t nFeeDelta;
+            filein >> tx;
+            filein >> nTime;
+            filein >> nFeeDelta;
+
+            uint256 hash = tx.GetHash();
+            if (nFeeDelta != 0)
+                mempool.PrioritiseTransaction(hash, hash.ToString(), 0, nFeeDelta);
+
+            CValidationState state;
+            bool fAccepted;
+            {
+                LOCK(cs_main);
+                fAccepted = AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime);
+            }
+            if (fAccepted)
+                nCount++;
+            else if (mempool.exists(hash))
+                nSkipped++;
+            else
+                nFailed++;
+
+            int nProgress = (int)((i + 1) * 10 / nTotal);
+            if (nProgress > nLastProgress) {
+                LogPrintf("Loading mempool... %d%%\n", nProgress * 10);
+                nLastProgress = nProgress;
+            }
+
+            if (ShutdownRequested())
+                return false;
+        }
+
+        // Prioritisations of transactions that were not in the pool
+        std::map<uint256, std::pair<double, int64_t> > mapDeltas;
+        filein >> mapDeltas;
+        for (std::map<uint256, std::pair<double, int64_t> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+    } catch (std::exception &e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %d successes, %d failed, %d already in pool  %dms\n",
+              nCount, nFailed, nSkipped, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::map<uint256, std::pair<double, int64_t> > mapDeltas;
+    std::vector<CTxMemPoolEntry> vEntries;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vEntries.reserve(mempool.mapTx.size());
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(it->second);
+    }
+
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : failed to open file %s", pathTmp.string());
+
+    try {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vEntries.size();
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, vEntries) {
+            const CTransaction& tx = entry.GetTx();
+            int64_t nFeeDelta = 0;
+            std::map<uint256, std::pair<double, int64_t> >::iterator it = mapDeltas.find(tx.GetHash());
+            if (it != mapDeltas.end()) {
+                // The fee delta travels with the transaction; keep only what is left
+                nFeeDelta = it->second.second;
+                it->second.second = 0;
+                if (it->second.first == 0)
+                    mapDeltas.erase(it);
+            }
+            fileout << tx;
+            fileout << entry.GetTime();
+            fileout << nFeeDelta;
+        }
+        fileout << mapDeltas;
+        FileCommit(fileout);
+        fileout.fclose();
+        RenameOver(pathTmp, GetDataDir() / "mempool.dat");
+    } catch (std::exception &e) {
+        return error("DumpMempool() : serialize or I/O error - %s", e.what());
+    }
+
+    LogPrintf("Dumped mempool: %u transactions  %dms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
 int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
 {
     if (hashBlock == 0 || nIndex == -1)
@@ -2411,6 +2592,13 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+
+    // Wake up long-polling getblocktemplate callers
+    {
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+        hashBestBlock = pindexNew->GetBlockHash();
+        cvBlockChange.notify_all();
+    }
     LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -2469,6 +2657,10 @@ bool static DisconnectTip(CValidationState &state) {
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    // Masternode collaterals spent by the block and not again by the mempool are back
+    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        mnodeman.UnspendCollaterals(tx);
+    }
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
@@ -2503,16 +2695,27 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
     // Write the chain state to disk, if necessary.
     if (!WriteChainState(state))
         return false;
+    // In blocks only mode, any transaction not already in the mempool (only our
+    // own are) would have been relayed to us separately before. While syncing
+    // the chain we would not have been sent them either, so nothing is saved.
+    if (fBlocksOnly && !IsInitialBlockDownload() && !fImporting && !fReindex) {
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            if (!tx.IsCoinBase() && !mempool.exists(tx.GetHash()))
+                CNode::RecordTxSkipped(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+    }
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        list<CTransaction> unused;
-        mempool.remove(tx, unused);
-        mempool.removeConflicts(tx, txConflicted);
-    }
+    mempool.removeForBlock(block.vtx, txConflicted);
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    // Keep the masternode collateral watch set in step with the chain
+    BOOST_FOREACH(const CTransaction &tx, txConflicted) {
+        mnodeman.UnspendCollaterals(tx);
+    }
+    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        mnodeman.SpendCollaterals(tx);
+    }
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH(const CTransaction &tx, txConflicted) {
@@ -3581,6 +3784,10 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    {
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+        hashBestBlock = it->second->GetBlockHash();
+    }
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -3668,6 +3875,10 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
     chainActive.SetTip(NULL);
+    {
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+        hashBestBlock = 0;
+    }
     pindexBestInvalid = NULL;
 }
 
@@ -3966,6 +4177,11 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+// The most recently served block, serialized once for all peers that request it
+static uint256 hashLastBlockMsg;
+static CSerializeDataRef msgLastBlock;
+
+// requires LOCK(cs_main)
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4009,11 +4225,20 @@ void static ProcessGetData(CNode* pfrom)
                 {
                     // Send block from disk
                     CBlock block;
-                    ReadBlockFromDisk(block, (*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        // Every peer fetching a new block gets the same buffer
+                        if (inv.hash != hashLastBlockMsg)
+                        {
+                            ReadBlockFromDisk(block, (*mi).second);
+                            msgLastBlock = SerializeMessage("block", block);
+                            hashLastBlockMsg = inv.hash;
+                        }
+                        pfrom->PushSerializedMessage(msgLastBlock);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        ReadBlockFromDisk(block, (*mi).second);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -4027,7 +4252,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -4049,18 +4274,18 @@ void static ProcessGetData(CNode* pfrom)
             }
             else if (inv.IsKnownType())
             {
-                // Send stream from relay memory
+                // Send message from relay memory
                 bool pushed = false;
-                map<CInv, CDataStream>::iterator mi;
+                CSerializeDataRef msgRelay;
                 {
                     LOCK(cs_mapRelay);
-                    mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pushed = true;
-                    }
+                    map<CInv, CSerializeDataRef>::iterator mi = mapRelay.find(inv);
+                    if (mi != mapRelay.end())
+                        msgRelay = mi->second;
                 }
-                if (pushed) {
-                    pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                if (msgRelay) {
+                    pfrom->PushSerializedMessage(msgRelay);
+                    pushed = true;
                 }
 
                 if (!pushed && inv.type == MSG_TX) {
@@ -4077,12 +4302,9 @@ void static ProcessGetData(CNode* pfrom)
                         pfrom->PushMessage("dstx", ss);
                         pushed = true;
                     } else {
-                        CTransaction tx;
-                        if (mempool.lookup(inv.hash, tx)) {
-                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                            ss.reserve(1000);
-                            ss << tx;
-                            pfrom->PushMessage("tx", ss);
+                        CTransactionRef ptx = mempool.get(inv.hash);
+                        if (ptx) {
+                            pfrom->PushMessage("tx", *ptx);
                             pushed = true;
                         }
                     }
@@ -4098,10 +4320,7 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
                     if(mapTxLockReq.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
-                        pfrom->PushMessage("txlreq", ss);
+                        pfrom->PushMessage("txlreq", *mapTxLockReq[inv.hash]);
                         pushed = true;
                     }
                 }
@@ -4160,6 +4379,226 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Hand tx to the mempool and deal with relay, orphans and rejects. If state is
+ *  already invalid (from pre-validation), only the reject is sent. */
+void static ProcessTransaction(CNode* pfrom, const CTransaction& tx, const string& strCommand, bool allowFree,
+                               bool fScriptsChecked, CValidationState& state)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    LOCK(cs_main);
+
+    bool fMissingInputs = false;
+    if (state.IsValid() && AcceptToMemoryPoolWithTime(mempool, state, tx, true, &fMissingInputs, GetTime(), allowFree, false, fScriptsChecked))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx, inv.hash);
+        mapAlreadyAskedFor.erase(inv);
+        vWorkQueue.push_back(inv.hash);
+        vEraseQueue.push_back(inv.hash);
+
+
+        LogPrint("mempool", "AcceptToMemoryPool: %s %s : accepted %s (poolsz %u)\n",
+            pfrom->addr.ToString(), pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const uint256& orphanHash = *mi;
+                const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+                vEraseQueue.push_back(orphanHash);
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx, orphanHash);
+                    mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
+                    vWorkQueue.push_back(orphanHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // too-little-fee orphan
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                }
+                mempool.check(pcoinsTip);
+            }
+        }
+
+        BOOST_FOREACH(uint256 hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    else if (fMissingInputs)
+    {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from %s %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->addr.ToString(), pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason(), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+struct CTxPrevalidationJob
+{
+    CNode* pfrom;
+    CTransaction tx;
+};
+
+static boost::mutex csTxPrevalidation;
+static boost::condition_variable condTxPrevalidation;
+static std::deque<CTxPrevalidationJob> queueTxPrevalidation;
+
+/**
+ * Context-free checks and script verification of a loose transaction.
+ * cs_main is only held while the spent coins are copied out; the signature
+ * checks then run against that snapshot. Scripts only depend on the spent
+ * outputs, which cannot change for as long as the outpoints exist, so the
+ * result stays valid for the final AcceptToMemoryPool under cs_main.
+ * Returns true if all scripts were verified. Returns false with an invalid
+ * state to reject tx, or with a valid state to leave everything to AcceptToMemoryPool.
+ */
+bool static PrevalidateTransaction(const CTransaction& tx, CValidationState& state)
+{
+    if (!CheckTransaction(tx, state))
+        return error("PrevalidateTransaction() : CheckTransaction failed");
+
+    if (tx.IsCoinBase())
+        return state.DoS(100, error("PrevalidateTransaction() : coinbase as individual tx"),
+                         REJECT_INVALID, "coinbase");
+
+    string reason;
+    if (Params().NetworkID() == CChainParams::MAIN && !IsStandardTx(tx, reason))
+        return state.DoS(0,
+                         error("PrevalidateTransaction() : nonstandard transaction: %s", reason),
+                         REJECT_NONSTANDARD, reason);
+
+    std::vector<CScriptCheck> vChecks;
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (mempool.exists(tx.GetHash()))
+            return false;
+
+        CCoinsView dummy;
+        CCoinsViewCache view(dummy);
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+        view.SetBackend(viewMemPool);
+
+        // Missing or spent inputs are sorted out by AcceptToMemoryPool
+        if (!view.HaveInputs(tx))
+            return false;
+
+        vChecks.reserve(tx.vin.size());
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            CScriptCheck check(view.GetCoins(tx.vin[i].prevout.hash), tx, i, MEMPOOL_SCRIPT_VERIFY_FLAGS, 0);
+            vChecks.push_back(CScriptCheck());
+            check.swap(vChecks.back());
+        }
+        view.SetBackend(dummy);
+    }
+
+    BOOST_FOREACH(const CScriptCheck& check, vChecks) {
+        if (!check()) {
+            // Same treatment of non-canonical encodings as CheckInputs
+            if (check.GetFlags() & SCRIPT_VERIFY_STRICTENC) {
+                CScriptCheck checkLax(check);
+                checkLax.SetFlags(check.GetFlags() & ~SCRIPT_VERIFY_STRICTENC);
+                if (checkLax())
+                    return state.Invalid(false, REJECT_NONSTANDARD, "non-canonical");
+            }
+            return state.DoS(100, false, REJECT_NONSTANDARD, "non-canonical");
+        }
+    }
+    return true;
+}
+
+/** Queue tx from pfrom for the pre-validation workers; false if they are disabled or backed up. */
+bool static QueueTxPrevalidation(CNode* pfrom, const CTransaction& tx)
+{
+    if (nTxPrevalidationThreads <= 0)
+        return false;
+
+    CTxPrevalidationJob job;
+    job.pfrom = pfrom;
+    job.tx = tx;
+    {
+        boost::unique_lock<boost::mutex> lock(csTxPrevalidation);
+        if (queueTxPrevalidation.size() >= MAX_TXPREVALIDATION_QUEUE)
+            return false;
+        pfrom->AddRef();
+        queueTxPrevalidation.push_back(job);
+    }
+    condTxPrevalidation.notify_one();
+    return true;
+}
+
+void ThreadTxPrevalidation()
+{
+    RenameThread("chaincoin-txval");
+    while (true)
+    {
+        CTxPrevalidationJob job;
+        {
+            boost::unique_lock<boost::mutex> lock(csTxPrevalidation);
+            while (queueTxPrevalidation.empty())
+                condTxPrevalidation.wait(lock);
+            job = queueTxPrevalidation.front();
+            queueTxPrevalidation.pop_front();
+        }
+
+        if (!job.pfrom->fDisconnect) {
+            CValidationState state;
+            bool fScriptsChecked = PrevalidateTransaction(job.tx, state);
+            ProcessTransaction(job.pfrom, job.tx, "tx", false, fScriptsChecked, state);
+        }
+
+        {
+            LOCK(cs_vNodes);
+            job.pfrom->Release();
+        }
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -4170,13 +4609,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         return true;
     }
 
-    {
-        LOCK(cs_main);
-        State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
-    }
-
-
-
     if (strCommand == "version")
     {
         // Each connection can only send one version message
@@ -4393,6 +4825,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 if (!fImporting && !fReindex) {
                     if (inv.type == MSG_BLOCK)
                         AddBlockToQueue(pfrom->GetId(), inv.hash);
+                    else if (fBlocksOnly && inv.type == MSG_TX) {
+                        // we sent fRelay=false, the peer should not have announced it
+                        LogPrint("net", "transaction (%s) inv sent in violation of protocol peer=%d\n", inv.hash.ToString(), pfrom->id);
+                        CNode::RecordInvIgnored();
+                    }
                     else
                         pfrom->AskFor(inv);
                 }
@@ -4510,8 +4947,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "tx"|| strCommand == "dstx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
+        // Nothing asks for loose transactions in blocks only mode. Masternode
+        // broadcast transactions (dstx) are part of masternode gossip and still accepted.
+        if (fBlocksOnly && strCommand == "tx")
+        {
+            LogPrint("net", "transaction sent in violation of protocol peer=%d\n", pfrom->id);
+            CNode::RecordTxRejected(CMessageHeader::HEADER_SIZE + vRecv.size());
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 10);
+            return true;
+        }
+
         CTransaction tx;
 
         //masternode signed transaction
@@ -4564,96 +5010,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
+        // Plain transactions are verified on the pre-validation workers, the
+        // message handler only queues them
+        if (strCommand == "tx" && QueueTxPrevalidation(pfrom, tx))
+            return true;
 
-        bool fMissingInputs = false;
         CValidationState state;
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, allowFree))
-        {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
-
-
-            LogPrint("mempool", "AcceptToMemoryPool: %s %s : accepted %s (poolsz %u)\n",
-                pfrom->addr.ToString(), pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    vEraseQueue.push_back(orphanHash);
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, orphanHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
-                        vWorkQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // too-little-fee orphan
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from %s %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->addr.ToString(), pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason(), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-        }
+        ProcessTransaction(pfrom, tx, strCommand, allowFree, false, state);
     }
 
 
@@ -4917,6 +5280,96 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+/**
+ * Hand the signature of a masternode gossip message to the verification threads. Returns true if
+ * the message has to wait for the recovery, false if it can be processed right away.
+ */
+// A deferred message normally finds its signer cached when replayed; should the entry
+// have been evicted in the meantime, it is only parked again this many times
+static const unsigned int MAX_SIG_DEFERRALS = 2;
+
+bool static DeferSignedMessage(CNode* pfrom, const string& strCommand, const CDataStream& vRecvIn, uint256& hashEntry)
+{
+    if (fLiteMode || nSigVerifyThreads <= 0)
+        return false;
+
+    // Signed strings as built by the handlers that end up in CDarkSendSigner::VerifyMessage
+    std::string strMessage;
+    vector<unsigned char> vchSig;
+    try
+    {
+        CDataStream vRecv(vRecvIn);
+        if (strCommand == "dsee") {
+            CTxIn vin;
+            CService addr;
+            CPubKey pubkey;
+            CPubKey pubkey2;
+            int64_t sigTime;
+            int count;
+            int current;
+            int64_t lastUpdated;
+            int protocolVersion;
+            CScript donationAddress;
+            int donationPercentage;
+            vRecv >> vin >> addr >> vchSig >> sigTime >> pubkey >> pubkey2 >> count >> current >> lastUpdated >> protocolVersion >> donationAddress >> donationPercentage;
+
+            std::string vchPubKey(pubkey.begin(), pubkey.end());
+            std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
+            strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion)  + donationAddress.ToString() + boost::lexical_cast<std::string>(donationPercentage);
+        } else if (strCommand == "dseep") {
+            CTxIn vin;
+            int64_t sigTime;
+            bool stop;
+            vRecv >> vin >> vchSig >> sigTime >> stop;
+
+            CMasternode* pmn = mnodeman.Find(vin);
+            if (pmn == NULL)
+                return false;
+            strMessage = pmn->addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop);
+        } else if (strCommand == "mnw") {
+            CMasternodePaymentWinner winner;
+            vRecv >> winner;
+            strMessage = winner.vin.ToString().c_str() + boost::lexical_cast<std::string>(winner.nBlockHeight) + winner.payee.ToString();
+            vchSig = winner.vchSig;
+        } else if (strCommand == "dsq") {
+            CDarksendQueue dsq;
+            vRecv >> dsq;
+            strMessage = dsq.vin.ToString() + boost::lexical_cast<std::string>(dsq.nDenom) + boost::lexical_cast<std::string>(dsq.time) + boost::lexical_cast<std::string>(dsq.ready);
+            vchSig = dsq.vchSig;
+        } else if (strCommand == "txlvote") {
+            CConsensusVote ctx;
+            vRecv >> ctx;
+            strMessage = ctx.txHash.ToString().c_str() + boost::lexical_cast<std::string>(ctx.nBlockHeight);
+            vchSig = ctx.vchMasterNodeSignature;
+        } else if (strCommand == "spork") {
+            CSporkMessage spork;
+            vRecv >> spork;
+            strMessage = boost::lexical_cast<std::string>(spork.nSporkID) + boost::lexical_cast<std::string>(spork.nValue) + boost::lexical_cast<std::string>(spork.nTimeSigned);
+            vchSig = spork.vchSig;
+        } else {
+            return false;
+        }
+    }
+    catch (std::exception&) {
+        // Malformed, let the handler deal with it
+        return false;
+    }
+
+    return darkSendSigner.QueueVerify(strMessage, vchSig, hashEntry, pfrom->GetId());
+}
+
+// Messages whose handlers only use pfrom's own state (and its own locks)
+bool static IsPeerLocalMessage(const string& strCommand)
+{
+    return strCommand == "verack" || strCommand == "ping" || strCommand == "pong" ||
+        strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear" ||
+        strCommand == "reject";
+}
+
+// Serializes the masternode, darksend, spork and InstantX message handlers, which take
+// cs_main themselves where they need it. Taken before cs_main, never while holding it.
+static CCriticalSection cs_gossipHandlers;
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -4936,29 +5389,25 @@ bool ProcessMessages(CNode* pfrom)
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
-    // this maintains the order of responses
-    if (!pfrom->vRecvGetData.empty()) return fOk;
-
-    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
-    while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
+    // Gossip whose signature has been recovered in the meantime goes ahead, it's a cache hit now
+    unsigned int nReady = 0;
+    while (nReady < pfrom->vRecvDeferred.size() && !darkSendSigner.IsVerifyPending(pfrom->vRecvDeferred[nReady].first))
+        nReady++;
+    if (nReady > 0)
+        pfrom->RequeueDeferredRecvMessages(nReady);
+
+    // Blocks go before transactions and those before gossip, within the
+    // peer's budget for this tick; this also maintains the order of getdata responses
+    int nClass = pfrom->GetNextRecvClass();
+    while (!pfrom->fDisconnect && nClass >= 0) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
-        // get next message
-        CNetMessage& msg = *it;
-
-        //if (fDebug)
-        //    LogPrintf("ProcessMessages(message %u msgsz, %u bytes, complete:%s)\n",
-        //            msg.hdr.nMessageSize, msg.vRecv.size(),
-        //            msg.complete() ? "Y" : "N");
-
-        // end, if an incomplete message is found
-        if (!msg.complete())
-            break;
-
-        // at this point, any failure means we can delete the current message
-        it++;
+        // get next message, it is gone from the queue whatever happens to it
+        std::list<CNetMessage> vMsg;
+        bool fReplayed = pfrom->PopRecvMessage(nClass, vMsg);
+        CNetMessage& msg = vMsg.front();
 
         // Scan for message start
         if (memcmp(msg.hdr.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0) {
@@ -4972,7 +5421,7 @@ bool ProcessMessages(CNode* pfrom)
         if (!hdr.IsValid())
         {
             LogPrintf("PROCESSMESSAGE: ERRORS IN HEADER %s\n", SanitizeString(hdr.GetCommand()));
-            continue;
+            break;
         }
         string strCommand = hdr.GetCommand();
 
@@ -4988,14 +5437,51 @@ bool ProcessMessages(CNode* pfrom)
         {
             LogPrintf("ProcessMessages(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
                SanitizeString(strCommand), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
+            break;
+        }
+
+        // Don't block on ECDSA key recovery here, park the message until the signature is known.
+        // Gossip keeps the peer's order: while a message waits, newer gossip waits behind it,
+        // so a dseep can't overtake the dsee it refers to.
+        // Past MAX_SIG_DEFERRALS the handler verifies the signature itself.
+        uint256 hashSigEntry;
+        bool fDefer = msg.nDeferrals < MAX_SIG_DEFERRALS && DeferSignedMessage(pfrom, strCommand, vRecv, hashSigEntry);
+        if (fDefer || (nClass == MSG_CLASS_GOSSIP && !fReplayed && !pfrom->vRecvDeferred.empty())) {
+            if (fDefer)
+                msg.nDeferrals++;
+            pfrom->DeferRecvMessage(fDefer ? hashSigEntry : uint256(0), msg, fReplayed);
+            break;
         }
 
+        pfrom->RecordRecvQueueDelay(nClass, GetTimeMicros() - msg.nTime);
+
         // Process message
         bool fRet = false;
+        int64_t nHandlerStart = 0;
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            // Peers are handled in parallel: messages touching nothing but the peer's own
+            // state take no lock, chain, mempool and transaction messages are serialized on
+            // cs_main and gossip on its own lock. Waiting for a lock is not charged to the message.
+            if (IsPeerLocalMessage(strCommand)) {
+                nHandlerStart = GetTimeMicros();
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            } else if (GetMessageClass(strCommand) != MSG_CLASS_GOSSIP) {
+                LOCK(cs_main);
+                State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
+                nHandlerStart = GetTimeMicros();
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            } else if (strCommand == "dstx" || strCommand == "txlreq") {
+                // gossip that enters the mempool needs both
+                LOCK2(cs_gossipHandlers, cs_main);
+                State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
+                nHandlerStart = GetTimeMicros();
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            } else {
+                LOCK(cs_gossipHandlers);
+                nHandlerStart = GetTimeMicros();
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            }
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -5024,6 +5510,8 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        if (nHandlerStart)
+            pfrom->RecordMsgHandlerTime(strCommand, GetTimeMicros() - nHandlerStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", SanitizeString(strCommand), nMessageSize);
@@ -5031,10 +5519,6 @@ bool ProcessMessages(CNode* pfrom)
         break;
     }
 
-    // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
-
     return fOk;
 }
 
@@ -5170,7 +5654,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -5191,15 +5675,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // later duplicates in vInventoryToSend are skipped above
+                pto->filterInventoryKnown.insert(inv);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -30,6 +30,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/thread/condition_variable.hpp>
+
 // Define difficulty retarget algorithms
 enum DiffMode {
     DIFF_DEFAULT = 0, // Default to invalid 0
@@ -55,6 +57,18 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, max number of in-mempool ancestors of a transaction, itself included */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of a transaction with its in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants of a transaction, itself included */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of a transaction with its in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -71,6 +85,10 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -txprevalidation default (number of loose transaction pre-validation threads) */
+static const int DEFAULT_TXPREVALIDATION_THREADS = 2;
+/** Maximum number of transactions waiting for pre-validation before tx messages are validated inline */
+static const unsigned int MAX_TXPREVALIDATION_QUEUE = 5000;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
 /** Timeout in seconds before considering a block download peer unresponsive. */
@@ -107,9 +125,15 @@ extern bool fImporting;
 extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
+extern int nTxPrevalidationThreads;
 extern bool fTxIndex;
 extern unsigned int nCoinCacheSize;
 
+extern CWaitableCriticalSection csBestBlock;
+extern boost::condition_variable cvBlockChange;
+/** Hash of the active chain's tip, guarded by csBestBlock so waiters on cvBlockChange can't miss a change */
+extern uint256 hashBestBlock;
+
 extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
 
@@ -170,6 +194,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the loose transaction pre-validation worker */
+void ThreadTxPrevalidation();
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
@@ -204,6 +230,15 @@ void Misbehaving(NodeId nodeid, int howmuch);
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectInsaneFee=false, bool ignoreFees=false);
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee=false, bool ignoreFees=false,
+                                bool fScriptsChecked=false);
+
+/** Dump the mempool to disk. */
+bool DumpMempool();
+/** Load the mempool from disk. */
+bool LoadMempool();
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool ignoreFees=true);
 
@@ -427,6 +462,9 @@ public:
 
     bool operator()() const;
 
+    unsigned int GetFlags() const { return nFlags; }
+    void SetFlags(unsigned int nFlagsIn) { nFlags = nFlagsIn; }
+
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
         std::swap(ptxTo, check.ptxTo);
@@ -19,8 +19,6 @@ CMasternodePayments masternodePayments;
 map<uint256, CMasternodePaymentWinner> mapSeenMasternodeVotes;
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
@@ -95,42 +93,35 @@ struct CompareValueOnly
     }
 };
 
-//Get the last hash that matches the modulus given. Processed in reverse order
+// Get the hash of the block before nBlockHeight on the active chain (nBlockHeight 0 meaning the
+// current tip height). chainActive is indexed by height and rewritten on reorg, so nothing is cached.
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return false;
+    // chainActive may only be indexed under cs_main. The gossip handlers run without it, and
+    // can't wait for it under mnodeman.cs, so they walk back from the tip instead.
+    TRY_LOCK(cs_main, lockMain);
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL || pindexTip->nHeight == 0) return false;
 
     if(nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
+        nBlockHeight = pindexTip->nHeight;
 
-    if(mapCacheBlockHashes.count(nBlockHeight)){
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex *BlockLastSolved = chainActive.Tip();
-    const CBlockIndex *BlockReading = chainActive.Tip();
+    if (pindexTip->nHeight+1 < nBlockHeight) return false;
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight+1 < nBlockHeight) return false;
-
-    int nBlocksAgo = 0;
-    if(nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight+1)-nBlockHeight;
-    assert(nBlocksAgo >= 0);
-
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nBlocksAgo){
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexTip->nHeight;
+    if (nHeight <= 0) return false;
 
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
+    const CBlockIndex* pindex = pindexTip;
+    if (lockMain) {
+        pindex = chainActive[nHeight];
+    } else {
+        while (pindex != NULL && pindex->nHeight > nHeight)
+            pindex = pindex->pprev;
     }
+    if (pindex == NULL) return false;
 
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 CMasternode::CMasternode()
@@ -233,12 +224,9 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
     return r;
 }
 
+// Collateral spends are pushed in by CMasternodeMan::SpendCollaterals, so this only looks at local state
 void CMasternode::Check()
 {
-    //TODO: Random segfault with this line removed
-    TRY_LOCK(cs_main, lockRecv);
-    if(!lockRecv) return;
-
     if(nScanningErrorCount >= MASTERNODE_SCANNING_ERROR_THESHOLD)
     {
         activeState = MASTERNODE_POS_ERROR;
@@ -259,19 +247,6 @@ void CMasternode::Check()
         return;
     }
 
-    if(!unitTest){
-        CValidationState state;
-        CTransaction tx = CTransaction();
-        CTxOut vout = CTxOut(999.99*COIN, darkSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-        if(!AcceptableInputs(mempool, state, tx)){
-            activeState = MASTERNODE_VIN_SPENT;
-            return;
-        }
-    }
-
     activeState = MASTERNODE_ENABLED; // OK
 }
 
@@ -319,9 +294,19 @@ bool CMasternodePayments::Sign(CMasternodePaymentWinner& winner)
 
 uint64_t CMasternodePayments::CalculateScore(uint256 blockHash, CTxIn& vin)
 {
-    uint256 n1 = blockHash;
-    uint256 n2 = HashC11(BEGIN(n1), END(n1));
-    uint256 n3 = HashC11(BEGIN(vin.prevout.hash), END(vin.prevout.hash));
+    LOCK(cs_masternodepayments);
+
+    // only the block hash part changes between elections, so both digests are cached
+    if(blockHash != hashLastScoreBlock || hashLastScoreBlockDigest == 0){
+        hashLastScoreBlock = blockHash;
+        hashLastScoreBlockDigest = HashC11(BEGIN(blockHash), END(blockHash));
+    }
+    uint256 n2 = hashLastScoreBlockDigest;
+
+    std::map<uint256, uint256>::iterator it = mapCollateralDigests.find(vin.prevout.hash);
+    if(it == mapCollateralDigests.end())
+        it = mapCollateralDigests.insert(make_pair(vin.prevout.hash, HashC11(BEGIN(vin.prevout.hash), END(vin.prevout.hash)))).first;
+    uint256 n3 = (*it).second;
     uint256 n4 = n3 > n2 ? (n3 - n2) : (n2 - n3);
 
     //printf(" -- CMasternodePayments CalculateScore() n2 = %d \n", n2.Get64());
@@ -333,26 +318,24 @@ uint64_t CMasternodePayments::CalculateScore(uint256 blockHash, CTxIn& vin)
 
 bool CMasternodePayments::GetBlockPayee(int nBlockHeight, CScript& payee)
 {
-    BOOST_FOREACH(CMasternodePaymentWinner& winner, vWinning){
-        if(winner.nBlockHeight == nBlockHeight) {
-            payee = winner.payee;
-            return true;
-        }
-    }
+    LOCK(cs_masternodepayments);
 
-    return false;
+    std::map<int, CMasternodePaymentWinner>::iterator it = mapWinning.find(nBlockHeight);
+    if(it == mapWinning.end()) return false;
+
+    payee = (*it).second.payee;
+    return true;
 }
 
 bool CMasternodePayments::GetWinningMasternode(int nBlockHeight, CTxIn& vinOut)
 {
-    BOOST_FOREACH(CMasternodePaymentWinner& winner, vWinning){
-        if(winner.nBlockHeight == nBlockHeight) {
-            vinOut = winner.vin;
-            return true;
-        }
-    }
+    LOCK(cs_masternodepayments);
 
-    return false;
+    std::map<int, CMasternodePaymentWinner>::iterator it = mapWinning.find(nBlockHeight);
+    if(it == mapWinning.end()) return false;
+
+    vinOut = (*it).second.vin;
+    return true;
 }
 
 bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerIn)
@@ -364,32 +347,30 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
 
     winnerIn.score = CalculateScore(blockHash, winnerIn.vin);
 
-    bool foundBlock = false;
-    BOOST_FOREACH(CMasternodePaymentWinner& winner, vWinning){
-        if(winner.nBlockHeight == winnerIn.nBlockHeight) {
-            foundBlock = true;
-            if(winner.score < winnerIn.score){
-                winner.score = winnerIn.score;
-                winner.vin = winnerIn.vin;
-                winner.payee = winnerIn.payee;
-                winner.vchSig = winnerIn.vchSig;
+    LOCK(cs_masternodepayments);
 
-                mapSeenMasternodeVotes.insert(make_pair(winnerIn.GetHash(), winnerIn));
+    std::map<int, CMasternodePaymentWinner>::iterator it = mapWinning.find(winnerIn.nBlockHeight);
+    if(it != mapWinning.end()){
+        CMasternodePaymentWinner& winner = (*it).second;
+        if(winner.score < winnerIn.score){
+            winner.score = winnerIn.score;
+            winner.vin = winnerIn.vin;
+            winner.payee = winnerIn.payee;
+            winner.vchSig = winnerIn.vchSig;
 
-                return true;
-            }
-        }
-    }
+            mapSeenMasternodeVotes.insert(make_pair(winnerIn.GetHash(), winnerIn));
 
-    // if it's not in the vector
-    if(!foundBlock){
-        vWinning.push_back(winnerIn);
-        mapSeenMasternodeVotes.insert(make_pair(winnerIn.GetHash(), winnerIn));
+            return true;
+        }
 
-        return true;
+        return false;
     }
 
-    return false;
+    // if it's not in the map
+    mapWinning.insert(make_pair(winnerIn.nBlockHeight, winnerIn));
+    mapSeenMasternodeVotes.insert(make_pair(winnerIn.GetHash(), winnerIn));
+
+    return true;
 }
 
 void CMasternodePayments::CleanPaymentList()
@@ -400,14 +381,15 @@ void CMasternodePayments::CleanPaymentList()
 
     int nLimit = std::max(((int)mnodeman.size())*2, 1000);
 
-    vector<CMasternodePaymentWinner>::iterator it;
-    for(it=vWinning.begin();it<vWinning.end();it++){
-        if(chainActive.Tip()->nHeight - (*it).nBlockHeight > nLimit){
-            if(fDebug) LogPrintf("CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", (*it).nBlockHeight);
-            vWinning.erase(it);
-            break;
-        }
-    }
+    // winners are ordered by height, so everything before the cutoff goes at once
+    std::map<int, CMasternodePaymentWinner>::iterator itEnd = mapWinning.lower_bound(chainActive.Tip()->nHeight - nLimit);
+    if(fDebug && itEnd != mapWinning.begin())
+        LogPrintf("CMasternodePayments::CleanPaymentList - Removing old Masternode payments - blocks %d to %d\n", (*mapWinning.begin()).first, chainActive.Tip()->nHeight - nLimit - 1);
+    mapWinning.erase(mapWinning.begin(), itEnd);
+
+    // the collateral digests are cheap to recompute, just keep them bounded
+    if((int)mapCollateralDigests.size() > nLimit)
+        mapCollateralDigests.clear();
 }
 
 bool CMasternodePayments::ProcessBlock(int nBlockHeight)
@@ -428,11 +410,11 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
     LogPrintf(" ProcessBlock Start nHeight %d. \n", nBlockHeight);
 
     std::vector<CTxIn> vecLastPayments;
-    BOOST_REVERSE_FOREACH(CMasternodePaymentWinner& winner, vWinning)
+    BOOST_REVERSE_FOREACH(PAIRTYPE(const int, CMasternodePaymentWinner)& item, mapWinning)
     {
         //if we already have the same vin - we have one full payment cycle, break
         if(vecLastPayments.size() > nMinimumAge) break;
-        vecLastPayments.push_back(winner.vin);
+        vecLastPayments.push_back(item.second.vin);
     }
 
     // pay to the oldest MN that still had no payment but its input is old enough and it was active long enough
@@ -526,9 +508,10 @@ void CMasternodePayments::Sync(CNode* node)
 {
     LOCK(cs_masternodepayments);
 
-    BOOST_FOREACH(CMasternodePaymentWinner& winner, vWinning)
-        if(winner.nBlockHeight >= chainActive.Tip()->nHeight-10 && winner.nBlockHeight <= chainActive.Tip()->nHeight + 20)
-            node->PushMessage("mnw", winner);
+    std::map<int, CMasternodePaymentWinner>::iterator it = mapWinning.lower_bound(chainActive.Tip()->nHeight-10);
+    std::map<int, CMasternodePaymentWinner>::iterator itEnd = mapWinning.upper_bound(chainActive.Tip()->nHeight+20);
+    for(; it != itEnd; ++it)
+        node->PushMessage("mnw", (*it).second);
 }
 
 
@@ -16,6 +16,9 @@
 #include "main.h"
 #include "masternode-pos.h"
 
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
 #define MASTERNODE_NOT_PROCESSED               0 // initial state
 #define MASTERNODE_IS_CAPABLE                  1
 #define MASTERNODE_NOT_CAPABLE                 2
@@ -41,11 +44,37 @@ class CMasternodePaymentWinner;
 
 extern CMasternodePayments masternodePayments;
 extern map<uint256, CMasternodePaymentWinner> mapSeenMasternodeVotes;
-extern map<int64_t, uint256> mapCacheBlockHashes;
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
+/** Hash functor for keying unordered containers by masternode collateral */
+struct COutPointHasher
+{
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return (size_t)(outpoint.hash.GetLow64() ^ ((uint64_t)outpoint.n << 32));
+    }
+};
+
+/** Hash functor for indexing masternodes by pubkey */
+struct CPubKeyHasher
+{
+    size_t operator()(const CPubKey& pubkey) const
+    {
+        return boost::hash_range(pubkey.begin(), pubkey.end());
+    }
+};
+
+/** Hash functor for indexing masternodes by service address */
+struct CServiceHasher
+{
+    size_t operator()(const CService& addr) const
+    {
+        return (size_t)(addr.GetHash() ^ addr.GetPort());
+    }
+};
+
 //
 // The Masternode Class. For managing the Darksend process. It contains the input of the 1000DRK, signature to prove
 // it's the one who own that ip address and code for calculating the payment election.
@@ -200,7 +229,7 @@ public:
         lastTimeSeen = 0;
     }
 
-    bool IsEnabled()
+    bool IsEnabled() const
     {
         return activeState == MASTERNODE_ENABLED;
     }
@@ -233,7 +262,7 @@ public:
         }
     }
 
-    std::string Status(){
+    std::string Status() const {
         std::string strStatus = "ACTIVE";
 
         if(activeState == CMasternode::MASTERNODE_ENABLED) strStatus   = "ENABLED";
@@ -288,7 +317,13 @@ public:
 class CMasternodePayments
 {
 private:
-    std::vector<CMasternodePaymentWinner> vWinning;
+    // best winner seen for each block height
+    std::map<int, CMasternodePaymentWinner> mapWinning;
+    // HashC11 of collateral txids, which never change, for CalculateScore
+    std::map<uint256, uint256> mapCollateralDigests;
+    // HashC11 of the last block hash scored against
+    uint256 hashLastScoreBlock;
+    uint256 hashLastScoreBlockDigest;
     int nSyncedFromPeer;
     std::string strMasterPrivKey;
     std::string strTestPubKey;
@@ -302,6 +337,8 @@ public:
         strMainPubKey = "044963f49ea0d59166067c690710d1b8c8f132b799f1789fd02159dac851c5046adfbde4adce8533b6e240b75c8cdb7887cc158c9a492852adcb5df1e64829a19a";
         strTestPubKey = "043a36231e775b5293f1f241352c591f2589d67b7db79890d16bd4c0bac21b49f38ffed5ffced6017fa7386710a6f55858b75b035d5567e47f0de78aa9b8d27ca2";
         enabled = false;
+        hashLastScoreBlock = 0;
+        hashLastScoreBlockDigest = 0;
     }
 
     bool SetPrivKey(std::string strPrivKey);
@@ -322,7 +359,6 @@ public:
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
-    //slow
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
 };
 
@@ -189,8 +189,285 @@ void DumpMasternodes()
     LogPrintf("Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
+CMasternodeListEntry::CMasternodeListEntry()
+{
+    sigTime = 0;
+    lastUpdated = 0;
+    protocolVersion = 0;
+    donationPercentage = 0;
+}
+
+CMasternodeListEntry::CMasternodeListEntry(const CMasternode& mn)
+{
+    vin = mn.vin;
+    addr = mn.addr;
+    vchSig = mn.sig;
+    sigTime = mn.sigTime;
+    pubkey = mn.pubkey;
+    pubkey2 = mn.pubkey2;
+    lastUpdated = mn.lastTimeSeen;
+    protocolVersion = mn.protocolVersion;
+    donationAddress = mn.donationAddress;
+    donationPercentage = mn.donationPercentage;
+}
+
+std::string CMasternodeListEntry::GetSignedMessage() const
+{
+    std::string vchPubKey(pubkey.begin(), pubkey.end());
+    std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
+    return addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion)  + donationAddress.ToString() + boost::lexical_cast<std::string>(donationPercentage);
+}
+
+bool CMasternodeListEntry::IsValid(int nHeight, int& nDoS) const
+{
+    nDoS = 0;
+
+    // make sure signature isn't in the future (past is OK)
+    if(sigTime > GetAdjustedTime() + 60 * 60) return false;
+    if(donationPercentage < 0 || donationPercentage > 100) return false;
+    if(protocolVersion < nMasternodeMinProtocol) return false;
+    if(!vin.scriptSig.empty()) return false;
+
+    CScript pubkeyScript;
+    pubkeyScript.SetDestination(pubkey.GetID());
+    CScript pubkeyScript2;
+    pubkeyScript2.SetDestination(pubkey2.GetID());
+    if(pubkeyScript.size() != 25 || pubkeyScript2.size() != 25) {
+        nDoS = 100;
+        return false;
+    }
+
+    if(nHeight >= Params().MasternodePortForkHeight()) {
+        if((Params().NetworkID() == CChainParams::MAIN) != (addr.GetPort() == 11994)) {
+            nDoS = 100;
+            return false;
+        }
+    }
+
+    std::vector<unsigned char> vchSigCheck(vchSig);
+    std::string errorMessage = "";
+    if(!darkSendSigner.VerifyMessage(pubkey, vchSigCheck, GetSignedMessage(), errorMessage)) {
+        nDoS = 100;
+        return false;
+    }
+
+    return true;
+}
+
+// Signature checks dominate list sync, so the signers are recovered on the signature
+// verification threads first; the checks below are then mostly cache hits
+static void VerifyListEntries(const std::vector<CMasternodeListEntry>& vEntries, std::vector<char>& vValid, std::vector<int>& vDoS)
+{
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = chainActive.Height();
+    }
+
+    // entries that can't be queued are simply checked here
+    std::vector<uint256> vQueued;
+    BOOST_FOREACH(const CMasternodeListEntry& entry, vEntries) {
+        uint256 hashEntry;
+        if(darkSendSigner.QueueVerify(entry.GetSignedMessage(), entry.vchSig, hashEntry))
+            vQueued.push_back(hashEntry);
+    }
+    darkSendSigner.WaitVerified(vQueued);
+
+    vValid.assign(vEntries.size(), 0);
+    vDoS.assign(vEntries.size(), 0);
+    for(size_t i = 0; i < vEntries.size(); i++)
+        vValid[i] = vEntries[i].IsValid(nHeight, vDoS[i]);
+}
+
 CMasternodeMan::CMasternodeMan() {
     nDsqCount = 0;
+    nListVersion = 0;
+    hashRankCacheTip = 0;
+    nRankCacheListVersion = 0;
+    nSnapshotListVersion = 0;
+    nSnapshotTime = 0;
+    hashList = 0;
+    nListJournalStart = 0;
+}
+
+void CMasternodeMan::UpdateListHash(const CMasternode& mn)
+{
+    AssertLockHeld(cs);
+
+    mapListJournalPos[hashList] = nListJournalStart + dequeListJournal.size();
+    dequeListJournal.push_back(make_pair(hashList, mn.vin.prevout));
+    hashList ^= SerializeHash(make_pair(mn.vin.prevout, mn.sigTime));
+
+    if(dequeListJournal.size() > MASTERNODES_LIST_JOURNAL_SIZE) {
+        std::map<uint256, uint64_t>::iterator it = mapListJournalPos.find(dequeListJournal.front().first);
+        if(it != mapListJournalPos.end() && (*it).second == nListJournalStart)
+            mapListJournalPos.erase(it);
+        dequeListJournal.pop_front();
+        nListJournalStart++;
+    }
+}
+
+bool CMasternodeMan::GetListDiff(const uint256& hashBase, std::vector<CMasternodeListEntry>& vEntries, std::vector<COutPoint>& vRemoved)
+{
+    LOCK(cs);
+
+    bool fDiff = false;
+    std::set<COutPoint> setChanged;
+    if(hashBase != 0 && hashBase == hashList) {
+        fDiff = true;
+    } else if(hashBase != 0) {
+        std::map<uint256, uint64_t>::iterator it = mapListJournalPos.find(hashBase);
+        if(it != mapListJournalPos.end() && (*it).second >= nListJournalStart) {
+            fDiff = true;
+            for(size_t i = (*it).second - nListJournalStart; i < dequeListJournal.size(); i++)
+                setChanged.insert(dequeListJournal[i].second);
+        }
+    }
+
+    if(!fDiff) {
+        BOOST_FOREACH(PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes)
+            setChanged.insert(p.first);
+    }
+
+    BOOST_FOREACH(const COutPoint& outpoint, setChanged) {
+        MasternodeMap::iterator mi = mapMasternodes.find(outpoint);
+        if(mi == mapMasternodes.end()) {
+            vRemoved.push_back(outpoint);
+            continue;
+        }
+
+        CMasternode& mn = (*mi).second;
+        if(mn.addr.IsRFC1918() || mn.addr.IsLocal()) continue; //local network
+        if(mn.IsEnabled()) vEntries.push_back(CMasternodeListEntry(mn));
+    }
+
+    return fDiff;
+}
+
+void CMasternodeMan::ApplyListEntry(CNode* pfrom, const CMasternodeListEntry& entry)
+{
+    CMasternode* pmn = Find(entry.vin);
+    if(pmn != NULL) {
+        // same rules as an updated dsee broadcast, without refreshing lastTimeSeen
+        if(pmn->pubkey != entry.pubkey || pmn->sigTime >= entry.sigTime) return;
+
+        LOCK(cs);
+        UpdateListHash(*pmn);
+        RemoveFromIndexes(*pmn);
+        pmn->pubkey2 = entry.pubkey2;
+        pmn->addr = entry.addr;
+        pmn->sigTime = entry.sigTime;
+        pmn->sig = entry.vchSig;
+        pmn->protocolVersion = entry.protocolVersion;
+        pmn->donationAddress = entry.donationAddress;
+        pmn->donationPercentage = entry.donationPercentage;
+        AddToIndexes(*pmn);
+        UpdateListHash(*pmn);
+        pmn->Check();
+        nListVersion++;
+        return;
+    }
+
+    // make sure the vout that was signed is related to the transaction that spawned the Masternode
+    CTxIn vin = entry.vin;
+    CPubKey pubkey = entry.pubkey;
+    if(!darkSendSigner.IsVinAssociatedWithPubkey(vin, pubkey)) {
+        LogPrintf("mnlist - Got mismatched pubkey and vin\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
+
+    {
+        LOCK(cs_main);
+
+        if(!IsCollateralUnspent(entry.vin.prevout)) return;
+        if(GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) return;
+
+        // verify that sig time is legit in past, as for dsee
+        CTransaction tx;
+        uint256 hashBlock = 0;
+        GetTransaction(entry.vin.prevout.hash, tx, hashBlock, true);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end() && (*mi).second)
+        {
+            CBlockIndex* pConfIndex = chainActive[(*mi).second->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1];
+            if(pConfIndex == NULL || pConfIndex->GetBlockTime() > entry.sigTime) return;
+        }
+    }
+
+    // use this as a peer
+    addrman.Add(CAddress(entry.addr), pfrom->addr, 2*60*60);
+
+    CScript donationAddress = entry.donationAddress;
+    int donationPercentage = entry.donationPercentage;
+    //doesn't support multisig addresses
+    if(donationAddress.IsPayToScriptHash()){
+        donationAddress = CScript();
+        donationPercentage = 0;
+    }
+
+    CMasternode mn(entry.addr, entry.vin, entry.pubkey, entry.vchSig, entry.sigTime, entry.pubkey2, entry.protocolVersion, donationAddress, donationPercentage);
+    mn.UpdateLastSeen(entry.lastUpdated);
+    Add(mn);
+
+    // if it matches our Masternode privkey, then we've been remotely activated
+    if(entry.pubkey2 == activeMasternode.pubKeyMasternode && entry.protocolVersion >= MIN_MN_PROTO_VERSION){
+        CService addr = entry.addr;
+        activeMasternode.EnableHotColdMasterNode(vin, addr);
+    }
+}
+
+void CMasternodeMan::AddToIndexes(const CMasternode& mn)
+{
+    mapByPubKey.insert(make_pair(mn.pubkey2, mn.vin.prevout));
+    mapByAddr.insert(make_pair(mn.addr, mn.vin.prevout));
+}
+
+void CMasternodeMan::RemoveFromIndexes(const CMasternode& mn)
+{
+    typedef boost::unordered_multimap<CPubKey, COutPoint, CPubKeyHasher>::iterator PubKeyIt;
+    std::pair<PubKeyIt, PubKeyIt> rangePubKey = mapByPubKey.equal_range(mn.pubkey2);
+    for (PubKeyIt it = rangePubKey.first; it != rangePubKey.second; ++it) {
+        if((*it).second == mn.vin.prevout) {
+            mapByPubKey.erase(it);
+            break;
+        }
+    }
+
+    typedef boost::unordered_multimap<CService, COutPoint, CServiceHasher>::iterator AddrIt;
+    std::pair<AddrIt, AddrIt> rangeAddr = mapByAddr.equal_range(mn.addr);
+    for (AddrIt it = rangeAddr.first; it != rangeAddr.second; ++it) {
+        if((*it).second == mn.vin.prevout) {
+            mapByAddr.erase(it);
+            break;
+        }
+    }
+}
+
+std::vector<CMasternode> CMasternodeMan::GetVector() const
+{
+    std::vector<CMasternode> vMasternodes;
+    vMasternodes.reserve(mapMasternodes.size());
+    BOOST_FOREACH(const PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes)
+        vMasternodes.push_back(p.second);
+    return vMasternodes;
+}
+
+void CMasternodeMan::SetVector(const std::vector<CMasternode>& vMasternodes)
+{
+    mapMasternodes.clear();
+    mapByPubKey.clear();
+    mapByAddr.clear();
+    hashList = 0;
+    dequeListJournal.clear();
+    mapListJournalPos.clear();
+    BOOST_FOREACH(const CMasternode& mn, vMasternodes) {
+        if(mapMasternodes.insert(make_pair(mn.vin.prevout, mn)).second) {
+            AddToIndexes(mn);
+            hashList ^= SerializeHash(make_pair(mn.vin.prevout, mn.sigTime));
+        }
+    }
+    nListVersion++;
 }
 
 bool CMasternodeMan::Add(CMasternode &mn)
@@ -205,7 +482,10 @@ bool CMasternodeMan::Add(CMasternode &mn)
     if (pmn == NULL)
     {
         if(fDebug) LogPrintf("CMasternodeMan: Adding new Masternode %s - %i now\n", mn.addr.ToString().c_str(), size() + 1);
-        vMasternodes.push_back(mn);
+        mapMasternodes.insert(make_pair(mn.vin.prevout, mn));
+        AddToIndexes(mn);
+        UpdateListHash(mn);
+        nListVersion++;
         return true;
     }
 
@@ -216,8 +496,12 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+    BOOST_FOREACH(PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes) {
+        CMasternode& mn = p.second;
+        int prevState = mn.activeState;
         mn.Check();
+        if(mn.activeState != prevState) nListVersion++;
+    }
 }
 
 void CMasternodeMan::CheckAndRemove()
@@ -227,11 +511,15 @@ void CMasternodeMan::CheckAndRemove()
     Check();
 
     //remove inactive
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while(it != vMasternodes.end()){
-        if((*it).activeState == CMasternode::MASTERNODE_REMOVE || (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT){
-            if(fDebug) LogPrintf("CMasternodeMan: Removing inactive Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
-            it = vMasternodes.erase(it);
+    MasternodeMap::iterator it = mapMasternodes.begin();
+    while(it != mapMasternodes.end()){
+        CMasternode& mn = (*it).second;
+        if(mn.activeState == CMasternode::MASTERNODE_REMOVE || mn.activeState == CMasternode::MASTERNODE_VIN_SPENT){
+            if(fDebug) LogPrintf("CMasternodeMan: Removing inactive Masternode %s - %i now\n", mn.addr.ToString().c_str(), size() - 1);
+            RemoveFromIndexes(mn);
+            UpdateListHash(mn);
+            it = mapMasternodes.erase(it);
+            nListVersion++;
         } else {
             ++it;
         }
@@ -272,11 +560,78 @@ void CMasternodeMan::CheckAndRemove()
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    mapMasternodes.clear();
+    mapByPubKey.clear();
+    mapByAddr.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     nDsqCount = 0;
+    hashList = 0;
+    dequeListJournal.clear();
+    mapListJournalPos.clear();
+    mapSyncedLists.clear();
+    nListVersion++;
+}
+
+bool CMasternodeMan::IsCollateralUnspent(const COutPoint& outpoint)
+{
+    AssertLockHeld(cs_main);
+
+    CCoins coins;
+    if(!pcoinsTip->GetCoins(outpoint.hash, coins) || !coins.IsAvailable(outpoint.n)) return false;
+
+    LOCK(mempool.cs);
+    return !mempool.mapNextTx.count(outpoint);
+}
+
+void CMasternodeMan::CheckCollaterals()
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs);
+
+    BOOST_FOREACH(PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes) {
+        CMasternode& mn = p.second;
+        if(mn.activeState != CMasternode::MASTERNODE_VIN_SPENT && !IsCollateralUnspent(mn.vin.prevout)) {
+            mn.activeState = CMasternode::MASTERNODE_VIN_SPENT;
+            nListVersion++;
+        }
+    }
+}
+
+void CMasternodeMan::SpendCollaterals(const CTransaction& tx)
+{
+    LOCK(cs);
+
+    if(mapMasternodes.empty() || tx.IsCoinBase()) return;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        CMasternode* pmn = Find(txin);
+        if(pmn == NULL || pmn->activeState == CMasternode::MASTERNODE_VIN_SPENT) continue;
+
+        LogPrint("masternode", "CMasternodeMan::SpendCollaterals - Masternode %s collateral spent by %s\n", pmn->addr.ToString(), tx.GetHash().ToString());
+        pmn->activeState = CMasternode::MASTERNODE_VIN_SPENT;
+        nListVersion++;
+    }
+}
+
+void CMasternodeMan::UnspendCollaterals(const CTransaction& tx)
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs);
+
+    if(mapMasternodes.empty() || tx.IsCoinBase()) return;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        CMasternode* pmn = Find(txin);
+        if(pmn == NULL || pmn->activeState != CMasternode::MASTERNODE_VIN_SPENT) continue;
+        if(!IsCollateralUnspent(txin.prevout)) continue;
+
+        LogPrint("masternode", "CMasternodeMan::UnspendCollaterals - Masternode %s collateral unspent again\n", pmn->addr.ToString());
+        pmn->activeState = CMasternode::MASTERNODE_ENABLED;
+        pmn->Check();
+        nListVersion++;
+    }
 }
 
 unsigned int CMasternodeMan::CountEnabled()
@@ -284,8 +639,8 @@ unsigned int CMasternodeMan::CountEnabled()
     LOCK(cs);
     unsigned int i = 0;
     
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-        if(mn.IsEnabled()) i++;
+    BOOST_FOREACH(PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes) {
+        if(p.second.IsEnabled()) i++;
     }
 
     return i;
@@ -296,7 +651,8 @@ int CMasternodeMan::CountMasternodesAboveProtocol(int protocolVersion)
     LOCK(cs);
     int i = 0;
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH(PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes) {
+        CMasternode& mn = p.second;
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
     }
@@ -316,7 +672,13 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
             return;
         }
     }
-    pnode->PushMessage("dseg", CTxIn());
+    // peers that know the list sync message send the changes since our last sync, if they still can
+    if(pnode->nVersion >= MNLIST_VERSION) {
+        std::map<CNetAddr, uint256>::iterator itSynced = mapSyncedLists.find(pnode->addr);
+        pnode->PushMessage("mnlistget", itSynced != mapSyncedLists.end() ? (*itSynced).second : uint256(0));
+    }
+    else
+        pnode->PushMessage("dseg", CTxIn());
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
@@ -325,12 +687,10 @@ CMasternode *CMasternodeMan::Find(const CTxIn &vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        if(mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    MasternodeMap::iterator it = mapMasternodes.find(vin.prevout);
+    if(it == mapMasternodes.end()) return NULL;
+
+    return &(*it).second;
 }
 
 
@@ -338,12 +698,20 @@ CMasternode *CMasternodeMan::Find(const CPubKey &pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        if(mn.pubkey2 == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_multimap<CPubKey, COutPoint, CPubKeyHasher>::iterator it = mapByPubKey.find(pubKeyMasternode);
+    if(it == mapByPubKey.end()) return NULL;
+
+    return &mapMasternodes[(*it).second];
+}
+
+CMasternode *CMasternodeMan::Find(const CService& addr)
+{
+    LOCK(cs);
+
+    boost::unordered_multimap<CService, COutPoint, CServiceHasher>::iterator it = mapByAddr.find(addr);
+    if(it == mapByAddr.end()) return NULL;
+
+    return &mapMasternodes[(*it).second];
 }
 
 
@@ -353,8 +721,8 @@ CMasternode* CMasternodeMan::FindOldestNotInVec(const std::vector<CTxIn> &vVins,
 
     CMasternode *pOldestMasternode = NULL;
 
-    BOOST_FOREACH(CMasternode &mn, vMasternodes)
-    {
+    BOOST_FOREACH(PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes) {
+        CMasternode& mn = p.second;
         mn.Check();
         if(!mn.IsEnabled()) continue;
 
@@ -386,44 +754,55 @@ CMasternode *CMasternodeMan::FindRandom()
 
     if(size() == 0) return NULL;
 
-    return &vMasternodes[GetRandInt(vMasternodes.size())];
+    MasternodeMap::iterator it = mapMasternodes.begin();
+    std::advance(it, GetRandInt(mapMasternodes.size()));
+    return &(*it).second;
 }
 
-CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+MasternodeSnapshot CMasternodeMan::GetMasternodeSnapshot()
 {
-    unsigned int score = 0;
-    CMasternode* winner = NULL;
-
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-        mn.Check();
-        if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+    LOCK(cs);
 
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    Check();
 
-        // determine the winner
-        if(n2 > score){
-            score = n2;
-            winner = &mn;
-        }
+    // lastTimeSeen changes without bumping the list version, so snapshots also age out
+    if(!snapshot || nSnapshotListVersion != nListVersion || GetTime() - nSnapshotTime >= MASTERNODES_SNAPSHOT_SECONDS) {
+        snapshot.reset(new std::vector<CMasternode>(GetVector()));
+        nSnapshotListVersion = nListVersion;
+        nSnapshotTime = GetTime();
     }
 
-    return winner;
+    return snapshot;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const CMasternodeMan::CRankTable* CMasternodeMan::GetRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    AssertLockHeld(cs);
+
+    if(chainActive.Tip() == NULL) return NULL;
+
+    // scores only change with the chain and the list, so every table
+    // computed since the last tip or list change is still good
+    uint256 hashTip = chainActive.Tip()->GetBlockHash();
+    if(hashTip != hashRankCacheTip || nListVersion != nRankCacheListVersion) {
+        mapRankCache.clear();
+        hashRankCacheTip = hashTip;
+        nRankCacheListVersion = nListVersion;
+    }
+
+    RankKey key = make_pair(nBlockHeight, make_pair(minProtocol, fOnlyActive));
+    std::map<RankKey, CRankTable>::const_iterator it = mapRankCache.find(key);
+    if(it != mapRankCache.end()) return &(*it).second;
 
     //make sure we know about this block
     uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return -1;
+    if(!GetBlockHash(hash, nBlockHeight)) return NULL;
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    vecMasternodeScores.reserve(mapMasternodes.size());
+
+    BOOST_FOREACH(PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes) {
+        CMasternode& mn = p.second;
 
         if(mn.protocolVersion < minProtocol) continue;
         if(fOnlyActive) {
@@ -440,49 +819,59 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
     sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
 
-    int rank = 0;
+    if(mapRankCache.size() >= MASTERNODES_RANK_CACHE_SIZE)
+        mapRankCache.erase(mapRankCache.begin());
+
+    CRankTable& table = mapRankCache[key];
+    table.vRanked.reserve(vecMasternodeScores.size());
     BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(s.second == vin) {
-            return rank;
-        }
+        table.vRanked.push_back(s.second);
+        table.mapRanks[s.second.prevout] = table.vRanked.size();
     }
 
-    return -1;
+    return &table;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<unsigned int, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    LOCK(cs);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    if(nBlockHeight == 0 && chainActive.Tip() != NULL) nBlockHeight = chainActive.Tip()->nHeight;
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    const CRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, true);
+    if(pTable == NULL || pTable->vRanked.empty()) return NULL;
 
-        mn.Check();
+    return Find(pTable->vRanked[0]);
+}
 
-        if(mn.protocolVersion < minProtocol) continue;
-        if(!mn.IsEnabled()) {
-            continue;
-        }
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    const CRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, fOnlyActive);
+    if(pTable == NULL) return -1;
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+    boost::unordered_map<COutPoint, int, COutPointHasher>::const_iterator it = pTable->mapRanks.find(vin.prevout);
+    if(it == pTable->mapRanks.end()) return -1;
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnlyMN());
+    return (*it).second;
+}
 
+std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs);
+
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+
+    const CRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, true);
+    if(pTable == NULL) return vecMasternodeRanks;
+
+    vecMasternodeRanks.reserve(pTable->vRanked.size());
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CMasternode)& s, vecMasternodeScores){
+    BOOST_FOREACH (const CTxIn& vin, pTable->vRanked){
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        CMasternode* pmn = Find(vin);
+        if(pmn != NULL) vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -490,32 +879,23 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
-
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    LOCK(cs);
 
-        if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive && !mn.IsEnabled()) continue;
+    const CRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, fOnlyActive);
+    if(pTable == NULL || nRank < 1 || nRank > (int)pTable->vRanked.size()) return NULL;
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    return Find(pTable->vRanked[nRank - 1]);
+}
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
+std::vector<CTxIn> CMasternodeMan::GetTopMasternodes(int64_t nBlockHeight, int nCount, int minProtocol)
+{
+    LOCK(cs);
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    const CRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, true);
+    if(pTable == NULL) return std::vector<CTxIn>();
 
-    return NULL;
+    int nSize = std::min(nCount, (int)pTable->vRanked.size());
+    return std::vector<CTxIn>(pTable->vRanked.begin(), pTable->vRanked.begin() + nSize);
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -655,14 +1035,22 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
                 if(pmn->sigTime < sigTime){ //take the newest entry
                     LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
-                    pmn->pubkey2 = pubkey2;
-                    pmn->sigTime = sigTime;
-                    pmn->sig = vchSig;
-                    pmn->protocolVersion = protocolVersion;
-                    pmn->addr = addr;
-                    pmn->donationAddress = donationAddress;
-                    pmn->donationPercentage = donationPercentage;
-                    pmn->Check();
+                    {
+                        LOCK(cs);
+                        UpdateListHash(*pmn);
+                        RemoveFromIndexes(*pmn);
+                        pmn->pubkey2 = pubkey2;
+                        pmn->addr = addr;
+                        pmn->sigTime = sigTime;
+                        pmn->sig = vchSig;
+                        pmn->protocolVersion = protocolVersion;
+                        pmn->donationAddress = donationAddress;
+                        pmn->donationPercentage = donationPercentage;
+                        AddToIndexes(*pmn);
+                        UpdateListHash(*pmn);
+                        pmn->Check();
+                        nListVersion++;
+                    }
                     if(pmn->IsEnabled())
                         mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
                 }
@@ -731,7 +1119,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             this->Add(mn);
 
             // if it matches our Masternode privkey, then we've been remotely activated
-            if(pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION){
+            if(pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion >= MIN_MN_PROTO_VERSION){
                 activeMasternode.EnableHotColdMasterNode(vin, addr);
             }
 
@@ -794,13 +1182,15 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
                 if(!pmn->UpdatedWithin(MASTERNODE_MIN_DSEEP_SECONDS))
                 {
+                    int prevState = pmn->activeState;
                     if(stop) pmn->Disable();
                     else
                     {
                         pmn->UpdateLastSeen();
                         pmn->Check();
-                        if(!pmn->IsEnabled()) return;
                     }
+                    if(pmn->activeState != prevState) { LOCK(cs); nListVersion++; }
+                    if(!stop && !pmn->IsEnabled()) return;
                     mnodeman.RelayMasternodeEntryPing(vin, vchSig, sigTime, stop);
                 }
             }
@@ -884,7 +1274,8 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         int count = this->size();
         int i = 0;
 
-        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH(PAIRTYPE(const COutPoint, CMasternode)& p, mapMasternodes) {
+            CMasternode& mn = p.second;
 
             if(mn.addr.IsRFC1918() || mn.addr.IsLocal()) continue; //local network
 
@@ -903,35 +1294,129 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
         LogPrintf("dseg - Sent %d Masternode entries to %s\n", i, pfrom->addr.ToString().c_str());
+
+    } else if (strCommand == "mnlistget") { //Get the Masternode list, or the changes since a known list
+
+        uint256 hashBase;
+        vRecv >> hashBase;
+
+        std::vector<CMasternodeListEntry> vEntries;
+        std::vector<COutPoint> vRemoved;
+        bool fDiff = GetListDiff(hashBase, vEntries, vRemoved);
+
+        // the full list is as expensive as dseg, so it's throttled the same way
+        if(!fDiff && !pfrom->addr.IsRFC1918() && Params().NetworkID() == CChainParams::MAIN)
+        {
+            LOCK(cs);
+            std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
+            if (i != mAskedUsForMasternodeList.end() && GetTime() < (*i).second)
+            {
+                Misbehaving(pfrom->GetId(), 34);
+                LogPrintf("mnlistget - peer already asked me for the list\n");
+                return;
+            }
+            mAskedUsForMasternodeList[pfrom->addr] = GetTime() + MASTERNODES_DSEG_SECONDS;
+        }
+
+        uint256 hashListNow;
+        {
+            LOCK(cs);
+            hashListNow = hashList;
+        }
+        pfrom->PushMessage("mnlist", fDiff ? hashBase : uint256(0), hashListNow, vEntries, vRemoved);
+        LogPrintf("mnlistget - Sent %s with %d entries and %d removals to %s\n", fDiff ? "diff" : "full list", vEntries.size(), vRemoved.size(), pfrom->addr.ToString());
+
+    } else if (strCommand == "mnlist") { //Masternode list or list diff, answering mnlistget
+
+        uint256 hashBase;
+        uint256 hashListIn;
+        std::vector<CMasternodeListEntry> vEntries;
+        std::vector<COutPoint> vRemoved;
+        vRecv >> hashBase >> hashListIn >> vEntries >> vRemoved;
+
+        {
+            LOCK(cs);
+            if(!mWeAskedForMasternodeList.count(pfrom->addr)) {
+                LogPrintf("mnlist - unsolicited list from %s\n", pfrom->addr.ToString());
+                Misbehaving(pfrom->GetId(), 20);
+                return;
+            }
+            // one reply per request, a repeated list is unsolicited
+            mWeAskedForMasternodeList.erase(pfrom->addr);
+        }
+
+        int64_t nStart = GetTimeMillis();
+        std::vector<char> vValid;
+        std::vector<int> vDoS;
+        VerifyListEntries(vEntries, vValid, vDoS);
+
+        int nDoS = 0;
+        int nAccepted = 0;
+        for(unsigned int i = 0; i < vEntries.size(); i++) {
+            if(!vValid[i]) {
+                nDoS = std::max(nDoS, vDoS[i]);
+                continue;
+            }
+            ApplyListEntry(pfrom, vEntries[i]);
+            nAccepted++;
+        }
+        if(nDoS > 0) {
+            LogPrintf("mnlist - Got invalid Masternode entries from %s\n", pfrom->addr.ToString());
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+
+        // a peer's removal only drops entries that have been quiet for a while here too
+        BOOST_FOREACH(const COutPoint& outpoint, vRemoved) {
+            CMasternode* pmn = Find(CTxIn(outpoint));
+            if(pmn != NULL && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEEP_SECONDS))
+                Remove(pmn->vin);
+        }
+
+        {
+            LOCK(cs);
+            mapSyncedLists[pfrom->addr] = hashListIn;
+        }
+
+        LogPrintf("mnlist - Got %s from %s, %d of %d entries valid, %d removals, %dms\n", hashBase == 0 ? "full list" : "diff",
+            pfrom->addr.ToString(), nAccepted, vEntries.size(), vRemoved.size(), GetTimeMillis() - nStart);
     }
 
 }
 
 void CMasternodeMan::RelayMasternodeEntry(const CTxIn vin, const CService addr, const std::vector<unsigned char> vchSig, const int64_t nNow, const CPubKey pubkey, const CPubKey pubkey2, const int count, const int current, const int64_t lastUpdated, const int protocolVersion, CScript donationAddress, int donationPercentage)
 {
+    // Serialized once, every peer's send queue shares the buffer
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("dsee", 0) << vin << addr << vchSig << nNow << pubkey << pubkey2 << count << current << lastUpdated << protocolVersion << donationAddress << donationPercentage;
+    CSerializeDataRef msg = FinalizeMessage(ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
-        pnode->PushMessage("dsee", vin, addr, vchSig, nNow, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+        pnode->PushSerializedMessage(msg);
 }
 
 void CMasternodeMan::RelayMasternodeEntryPing(const CTxIn vin, const std::vector<unsigned char> vchSig, const int64_t nNow, const bool stop)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("dseep", 0) << vin << vchSig << nNow << stop;
+    CSerializeDataRef msg = FinalizeMessage(ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
-        pnode->PushMessage("dseep", vin, vchSig, nNow, stop);
+        pnode->PushSerializedMessage(msg);
 }
 
 void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while(it != vMasternodes.end()){
-        if((*it).vin == vin){
-            if(fDebug) LogPrintf("CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
+    MasternodeMap::iterator it = mapMasternodes.find(vin.prevout);
+    if(it != mapMasternodes.end()){
+        if(fDebug) LogPrintf("CMasternodeMan: Removing Masternode %s - %i now\n", (*it).second.addr.ToString().c_str(), size() - 1);
+        RemoveFromIndexes((*it).second);
+        UpdateListHash((*it).second);
+        mapMasternodes.erase(it);
+        nListVersion++;
     }
 }
 
@@ -939,7 +1424,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() <<
+    info << "Masternodes: " << (int)mapMasternodes.size() <<
             ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() <<
             ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() <<
             ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() <<
@@ -16,13 +16,23 @@
 #include "main.h"
 #include "masternode.h"
 
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+
 #define MASTERNODES_DUMP_SECONDS               (15*60)
 #define MASTERNODES_DSEG_SECONDS               (3*60*60)
+#define MASTERNODES_RANK_CACHE_SIZE            64
+#define MASTERNODES_SNAPSHOT_SECONDS           5
+#define MASTERNODES_LIST_JOURNAL_SIZE          10000
 
 using namespace std;
 
 class CMasternodeMan;
 
+/** Immutable copy of the Masternode list, shared between readers */
+typedef boost::shared_ptr<const std::vector<CMasternode> > MasternodeSnapshot;
+
 extern CMasternodeMan mnodeman;
 void DumpMasternodes();
 
@@ -49,14 +59,59 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad);
 };
 
+/** A signed Masternode announcement as carried in bulk by "mnlist", the same fields as "dsee"
+ */
+class CMasternodeListEntry
+{
+public:
+    CTxIn vin;
+    CService addr;
+    std::vector<unsigned char> vchSig;
+    int64_t sigTime;
+    CPubKey pubkey;
+    CPubKey pubkey2;
+    int64_t lastUpdated;
+    int protocolVersion;
+    CScript donationAddress;
+    int donationPercentage;
+
+    CMasternodeListEntry();
+    CMasternodeListEntry(const CMasternode& mn);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vin);
+        READWRITE(addr);
+        READWRITE(vchSig);
+        READWRITE(sigTime);
+        READWRITE(pubkey);
+        READWRITE(pubkey2);
+        READWRITE(lastUpdated);
+        READWRITE(protocolVersion);
+        READWRITE(donationAddress);
+        READWRITE(donationPercentage);
+    )
+
+    /// The message signed by vchSig, as in "dsee"
+    std::string GetSignedMessage() const;
+    /// Checks that need no chain state other than nHeight, the chain height read by the caller
+    /// under cs_main, including the signature, so they can run on any thread
+    bool IsValid(int nHeight, int& nDoS) const;
+};
+
 class CMasternodeMan
 {
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    typedef boost::unordered_map<COutPoint, CMasternode, COutPointHasher> MasternodeMap;
+
+    // map to hold all MNs by collateral; node based, so entries stay put while listed
+    MasternodeMap mapMasternodes;
+    // secondary indexes into mapMasternodes
+    boost::unordered_multimap<CPubKey, COutPoint, CPubKeyHasher> mapByPubKey;
+    boost::unordered_multimap<CService, COutPoint, CServiceHasher> mapByAddr;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -64,6 +119,58 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    /** Masternodes ordered by score for one block, best first */
+    struct CRankTable
+    {
+        std::vector<CTxIn> vRanked;
+        // collateral -> 1-based rank
+        boost::unordered_map<COutPoint, int, COutPointHasher> mapRanks;
+    };
+    typedef std::pair<int64_t, std::pair<int, bool> > RankKey;
+
+    // bumped whenever an entry is added, removed or changes state, to invalidate the rank tables
+    unsigned int nListVersion;
+    // rank tables computed for the tip hashRankCacheTip and list version nRankCacheListVersion
+    std::map<RankKey, CRankTable> mapRankCache;
+    uint256 hashRankCacheTip;
+    unsigned int nRankCacheListVersion;
+
+    /// Get (computing it when needed) the ranking for a block, NULL if the block is unknown
+    const CRankTable* GetRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive);
+
+    // last snapshot handed out, and the list version and time it was taken at
+    MasternodeSnapshot snapshot;
+    unsigned int nSnapshotListVersion;
+    int64_t nSnapshotTime;
+
+    /// Add or drop the pubkey and address index entries of a listed Masternode
+    void AddToIndexes(const CMasternode& mn);
+    void RemoveFromIndexes(const CMasternode& mn);
+
+    /// Serialization helpers, the list is stored as a vector
+    std::vector<CMasternode> GetVector() const;
+    void SetVector(const std::vector<CMasternode>& vMasternodes);
+
+    /// Whether the outpoint is unspent both on the active chain and in the mempool
+    bool IsCollateralUnspent(const COutPoint& outpoint);
+
+    // XOR of the hashes of all listed (collateral, sigTime) pairs, identifying the list contents
+    uint256 hashList;
+    // the list hash before each of the latest changes and the collateral that changed, for serving diffs
+    std::deque<std::pair<uint256, COutPoint> > dequeListJournal;
+    // list hash -> sequence number of the first journal entry after it
+    std::map<uint256, uint64_t> mapListJournalPos;
+    // sequence number of dequeListJournal.front()
+    uint64_t nListJournalStart;
+    // per peer, the hash of its list we last synced with, asked for as the base of the next diff from it
+    std::map<CNetAddr, uint256> mapSyncedLists;
+
+    /// Toggle an entry in or out of the list hash, journaling the change
+    void UpdateListHash(const CMasternode& mn);
+
+    /// Add or update a Masternode from an "mnlist" entry that passed IsValid()
+    void ApplyListEntry(CNode* pfrom, const CMasternodeListEntry& entry);
+
 public:
     // keep track of dsq count to prevent masternodes from gaming darksend queue
     int64_t nDsqCount;
@@ -71,17 +178,25 @@ public:
     IMPLEMENT_SERIALIZE
     (
         // serialized format:
-        // * version byte (currently 0)
+        // * version byte (currently 1)
         // * masternodes vector
+        // * version 1 and up: hash of the last synced list of each peer
         {
                 LOCK(cs);
-                unsigned char nVersion = 0;
-                READWRITE(nVersion);
+                unsigned char nFormatVersion = 1;
+                READWRITE(nFormatVersion);
+                std::vector<CMasternode> vMasternodes;
+                if (!fRead)
+                    vMasternodes = GetVector();
                 READWRITE(vMasternodes);
+                if (fRead)
+                    const_cast<CMasternodeMan*>(this)->SetVector(vMasternodes);
                 READWRITE(mAskedUsForMasternodeList);
                 READWRITE(mWeAskedForMasternodeList);
                 READWRITE(mWeAskedForMasternodeListEntry);
                 READWRITE(nDsqCount);
+                if (nFormatVersion >= 1)
+                    READWRITE(mapSyncedLists);
         }
     )
 
@@ -100,15 +215,35 @@ public:
     /// Clear Masternode vector
     void Clear();
 
+    /// Check every collateral against the chain state once, after loading the list from disk
+    void CheckCollaterals();
+
+    /// Mark the Masternodes whose collateral tx spends, as tx enters the mempool or the active chain
+    void SpendCollaterals(const CTransaction& tx);
+
+    /// Re-enable the Masternodes whose collateral tx spent, if still unspent after tx left the mempool or the active chain
+    void UnspendCollaterals(const CTransaction& tx);
+
     unsigned int CountEnabled();
 
     int CountMasternodesAboveProtocol(int protocolVersion);
 
     void DsegUpdate(CNode* pnode);
 
+    /// Counter bumped whenever an entry is added, removed or changes state
+    unsigned int GetListVersion() { LOCK(cs); return nListVersion; }
+
+    /// Hash identifying the current list contents
+    uint256 GetListHash() { LOCK(cs); return hashList; }
+
+    /// Collect the entries that changed since the list had hash hashBase, or all of them.
+    /// Returns false when a diff from hashBase can't be served and the full list was collected.
+    bool GetListDiff(const uint256& hashBase, std::vector<CMasternodeListEntry>& vEntries, std::vector<COutPoint>& vRemoved);
+
     /// Find an entry
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
+    CMasternode* Find(const CService& addr);
 
     /// Find an entry thta do not match every entry provided vector
     CMasternode* FindOldestNotInVec(const std::vector<CTxIn> &vVins, int nMinimumAge, int nMinimumActiveSeconds);
@@ -119,18 +254,21 @@ public:
     /// Get the current winner for this block
     CMasternode* GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=0);
 
-    std::vector<CMasternode> GetFullMasternodeVector() { Check(); return vMasternodes; }
+    /// Get a recent copy of the whole list, shared with other readers and safe to use without any lock
+    MasternodeSnapshot GetMasternodeSnapshot();
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol=0);
     int GetMasternodeRank(const CTxIn &vin, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
+    /// Get the collaterals of the nCount best ranked active Masternodes for a block, best first
+    std::vector<CTxIn> GetTopMasternodes(int64_t nBlockHeight, int nCount, int minProtocol=0);
 
     void ProcessMasternodeConnections();
 
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return mapMasternodes.size(); }
 
     std::string ToString() const;
 
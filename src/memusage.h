@@ -0,0 +1,74 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+/** Approximate accounting of heap memory held by STL containers. */
+namespace memusage
+{
+
+/** Compute the memory used by a malloc() of alloc bytes, including allocator overhead. */
+static inline size_t MallocUsage(size_t alloc)
+{
+    // Measured on libc6 2.19 on Linux.
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    assert(sizeof(void*) == 4);
+    return ((alloc + 15) >> 3) << 3;
+}
+
+// STL data structures
+
+struct stl_tree_node_base
+{
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+};
+
+template<typename X>
+struct stl_tree_node : public stl_tree_node_base
+{
+    X x;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+/** Memory used by one additional element of a std::map, for callers that account incrementally. */
+template<typename X, typename Y, typename Z>
+static inline size_t IncrementalDynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >));
+}
+
+}
+
+#endif // BITCOIN_MEMUSAGE_H
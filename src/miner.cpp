@@ -14,6 +14,11 @@
 #endif
 #include "masternodeman.h"
 
+#include <atomic>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // ChaincoinMiner
@@ -256,10 +261,16 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
             dPriority = tx.ComputePriority(dPriority, nTxSize);
 
+            uint256 hash = tx.GetHash();
+            double dPriorityDelta = 0;
+            int64_t nFeeDelta = 0;
+            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+            dPriority += dPriorityDelta;
+
             // This is a more accurate fee-per-kilobyte than is used by the client code, because the
             // client code rounds up the size to the nearest 1K. That's good, because it gives an
             // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()+nFeeDelta) / (double(nTxSize)/1000.0);
 
             if (porphan)
             {
@@ -398,6 +409,16 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     return pblocktemplate.release();
 }
 
+/** Put nExtraNonce into the coinbase and recompute the merkle root. */
+static void SetExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int nExtraNonce)
+{
+    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -408,11 +429,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
         hashPrevBlock = pblock->hashPrevBlock;
     }
     ++nExtraNonce;
-    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
-
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
 }
 
 
@@ -517,134 +534,245 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static BitcoinMiner(CWallet *pwallet)
+/** Work shared by the threads of one miner session */
+struct CMinerThreadStats
 {
-    LogPrintf("ChaincoinMiner started\n");
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-    RenameThread("chaincoin-miner");
+    std::atomic<uint64_t> nHashes;
+    double dHashesPerSec;
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    CMinerThreadStats() : nHashes(0), dHashesPerSec(0.0) {}
+};
 
-    try { while (true) {
-        if (Params().NetworkID() != CChainParams::REGTEST) {
-            // Busy-wait for the network to come online so we don't waste time mining
-            // on an obsolete chain. In regtest mode we expect to fly solo.
-            while (vNodes.empty())
-                MilliSleep(1000);
-        }
+class CMinerContext
+{
+public:
+    CWallet* pwallet;
+    CReserveKey reservekey;
+
+    // Serializes the users of reservekey (template creation and block submission) and
+    // protects nBlocksLeft. Taken before cs_main.
+    boost::mutex csSubmit;
+    int nBlocksLeft;
+
+    // Protects everything below except nWorkId and the hash counters. Never held while
+    // taking cs_main, so callers that already hold cs_main may take it.
+    boost::mutex cs;
+    boost::condition_variable cvWork;
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    CBlockIndex* pindexPrev;
+
+    /** Bumped whenever ptemplate is replaced, polled by the workers between nonces */
+    std::atomic<unsigned int> nWorkId;
+    std::vector<boost::shared_ptr<CMinerThreadStats> > vStats;
+
+    CMinerContext(CWallet* pwalletIn, int nThreads, int nBlocks) : pwallet(pwalletIn), reservekey(pwalletIn), nBlocksLeft(nBlocks), pindexPrev(NULL), nWorkId(0)
+    {
+        for (int i = 0; i < nThreads; i++)
+            vStats.push_back(boost::shared_ptr<CMinerThreadStats>(new CMinerThreadStats()));
+    }
+};
 
-        //
-        // Create new block
-        //
-        unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        if(!pindexPrev) break;
+/** Nonces scanned per extranonce before the worker refreshes nTime and moves to its next extranonce */
+static const unsigned int MINER_NONCES_PER_EXTRANONCE = 0x100000;
+/** Seconds a changed mempool waits before the template is rebuilt */
+static const int64_t MINER_TEMPLATE_REFRESH_INTERVAL = 60;
+/** Milliseconds between hash meter updates */
+static const int64_t MINER_HASHMETER_INTERVAL = 4000;
 
-        unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-        if (!pblocktemplate.get())
-            return;
-        CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+static boost::mutex csMinerContext;
+static boost::shared_ptr<CMinerContext> pMinerContext;
 
+// Owns the block template of a miner session: rebuilds it as soon as the tip changes (woken
+// through cvBlockChange) or after the mempool has changed for a while, and meters the hash rate.
+void static MinerCoordinator(boost::shared_ptr<CMinerContext> ctx)
+{
+    RenameThread("chaincoin-miner-work");
 
-        LogPrintf("Running ChaincoinMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+    CBlockIndex* pindexWork = NULL;
+    unsigned int nTransactionsUpdatedLast = 0;
+    int64_t nWorkTime = 0;
+    int64_t nMeterStart = GetTimeMillis();
+    std::vector<uint64_t> vHashesLast(ctx->vStats.size(), 0);
 
-        //
-        // Pre-build hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
+    try { while (true) {
+        boost::this_thread::interruption_point();
 
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+        // The tip this pass works from; the wait below returns as soon as it has changed
+        uint256 hashTipSeen;
+        {
+            boost::lock_guard<boost::mutex> lock(csBestBlock);
+            hashTipSeen = hashBestBlock;
+        }
 
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
+        // Busy-wait for the network to come online so we don't waste time mining
+        // on an obsolete chain. In regtest mode we expect to fly solo.
+        bool fOnline = Params().NetworkID() == CChainParams::REGTEST || !vNodes.empty();
+        bool fActive;
+        {
+            boost::lock_guard<boost::mutex> lock(ctx->csSubmit);
+            fActive = fOnline && ctx->nBlocksLeft != 0;
+        }
 
-        //
-        // Search
-        //
-        int64_t nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-        while (true)
+        if (!fActive)
         {
-            unsigned int nHashesDone = 0;
+            boost::lock_guard<boost::mutex> lock(ctx->cs);
+            if (ctx->ptemplate)
+            {
+                ctx->ptemplate.reset();
+                ++ctx->nWorkId;
+            }
+            pindexWork = NULL;
+        }
+        else
+        {
+            // Build the template under cs_main first and only then take ctx->cs to publish it
+            boost::shared_ptr<CBlockTemplate> ptemplate;
+            {
+                boost::lock_guard<boost::mutex> lockSubmit(ctx->csSubmit);
+                LOCK(cs_main);
+                if (chainActive.Tip() != pindexWork ||
+                    (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nWorkTime > MINER_TEMPLATE_REFRESH_INTERVAL))
+                {
+                    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+                    ptemplate.reset(CreateNewBlockWithKey(ctx->reservekey));
+                    if (!ptemplate)
+                    {
+                        LogPrintf("ChaincoinMiner: keypool ran out, please call keypoolrefill before restarting the mining thread\n");
+                        return;
+                    }
+                    pindexWork = chainActive.Tip();
+                    nWorkTime = GetTime();
+                }
+            }
 
-            uint256 hash;
-            while (true)
+            if (ptemplate)
             {
-                hash = pblock->GetHash();
-                if (hash <= hashTarget)
                 {
-                    // Found a solution
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                    boost::lock_guard<boost::mutex> lock(ctx->cs);
+                    ctx->ptemplate = ptemplate;
+                    ctx->pindexPrev = pindexWork;
+                    ++ctx->nWorkId;
+                    ctx->cvWork.notify_all();
+                }
 
-                    // In regression test mode, stop mining after a block is found. This
-                    // allows developers to controllably generate a block on demand.
-                    if (Params().NetworkID() == CChainParams::REGTEST)
-                        throw boost::thread_interrupted();
+                LogPrintf("Running ChaincoinMiner with %u transactions in block (%u bytes)\n", ptemplate->block.vtx.size(),
+                       ::GetSerializeSize(ptemplate->block, SER_NETWORK, PROTOCOL_VERSION));
+            }
+        }
 
+        // Meter hashes/sec
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nMeterStart > MINER_HASHMETER_INTERVAL)
+        {
+            boost::lock_guard<boost::mutex> lock(ctx->cs);
+            double dTotal = 0.0;
+            for (unsigned int i = 0; i < ctx->vStats.size(); i++)
+            {
+                uint64_t nHashes = ctx->vStats[i]->nHashes.load(std::memory_order_relaxed);
+                ctx->vStats[i]->dHashesPerSec = 1000.0 * (nHashes - vHashesLast[i]) / (nNow - nMeterStart);
+                dTotal += ctx->vStats[i]->dHashesPerSec;
+                vHashesLast[i] = nHashes;
+            }
+            dHashesPerSec = dTotal;
+            nHPSTimerStart = nNow;
+            nMeterStart = nNow;
+            static int64_t nLogTime;
+            if (GetTime() - nLogTime > 30 * 60)
+            {
+                nLogTime = GetTime();
+                LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+            }
+        }
+
+        // Sleep until the tip changes or the hash meter is due; the tip is compared
+        // under csBestBlock, so a change since the start of this pass is not missed
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(std::max<int64_t>(nMeterStart + MINER_HASHMETER_INTERVAL - GetTimeMillis(), 1));
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        while (hashBestBlock == hashTipSeen)
+        {
+            if (!cvBlockChange.timed_wait(lock, timeout))
+                break;
+        }
+    } }
+    catch (boost::thread_interrupted)
+    {
+        LogPrintf("ChaincoinMiner work coordinator terminated\n");
+        throw;
+    }
+}
+
+// Hashes the shared template. Worker n of N only uses extranonces n+1, n+1+N, n+1+2N, ...
+// so workers never overlap, and scans the nonces on a private copy of the 80 byte header.
+void static MinerWorker(boost::shared_ptr<CMinerContext> ctx, int nThread)
+{
+    LogPrintf("ChaincoinMiner started\n");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("chaincoin-miner");
+
+    CMinerThreadStats& stats = *ctx->vStats[nThread];
+    const unsigned int nThreads = ctx->vStats.size();
+    unsigned int nWorkIdSolved = 0;
+
+    try { while (true) {
+        boost::shared_ptr<CBlockTemplate> ptemplate;
+        CBlockIndex* pindexPrev;
+        unsigned int nWorkId;
+        {
+            boost::unique_lock<boost::mutex> lock(ctx->cs);
+            while (!ctx->ptemplate || ctx->nWorkId == nWorkIdSolved)
+                ctx->cvWork.wait(lock);
+            ptemplate = ctx->ptemplate;
+            pindexPrev = ctx->pindexPrev;
+            nWorkId = ctx->nWorkId;
+        }
+
+        CBlock block = ptemplate->block;
+        for (unsigned int nExtraNonce = nThread + 1; ctx->nWorkId.load(std::memory_order_relaxed) == nWorkId; nExtraNonce += nThreads)
+        {
+            UpdateTime(block, pindexPrev);
+            SetExtraNonce(&block, pindexPrev, nExtraNonce);
+            uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+
+            //
+            // Search
+            //
+            CBlockHeader header = block.GetBlockHeader();
+            bool fFound = false;
+            unsigned int nHashesDone = 0;
+            for (header.nNonce = 0; header.nNonce < MINER_NONCES_PER_EXTRANONCE; header.nNonce++)
+            {
+                if (HashC11(BEGIN(header.nVersion), END(header.nNonce)) <= hashTarget)
+                {
+                    fFound = true;
                     break;
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
+                if (++nHashesDone == 0x100)
+                {
+                    stats.nHashes.fetch_add(nHashesDone, std::memory_order_relaxed);
+                    nHashesDone = 0;
+                    boost::this_thread::interruption_point();
+                }
+                if (ctx->nWorkId.load(std::memory_order_relaxed) != nWorkId)
                     break;
             }
+            stats.nHashes.fetch_add(nHashesDone, std::memory_order_relaxed);
 
-            // Meter hashes/sec
-            static int64_t nHashCounter;
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
+            if (fFound)
             {
-                static CCriticalSection cs;
+                // Found a solution
+                block.nNonce = header.nNonce;
+                SetThreadPriority(THREAD_PRIORITY_NORMAL);
                 {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
-                    {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64_t nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                        }
-                    }
+                    boost::lock_guard<boost::mutex> lock(ctx->csSubmit);
+                    if (ctx->nWorkId == nWorkId && ctx->nBlocksLeft != 0 &&
+                        CheckWork(&block, *ctx->pwallet, ctx->reservekey) && ctx->nBlocksLeft > 0)
+                        ctx->nBlocksLeft--;
                 }
-            }
+                SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
-            // Check for stop or if block needs to be rebuilt
-            boost::this_thread::interruption_point();
-            if (vNodes.empty() && Params().NetworkID() != CChainParams::REGTEST)
-                break;
-            if (pblock->nNonce >= 0xffff0000)
-                break;
-            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+                // Nothing left to find on this template, wait for the next one
+                nWorkIdSolved = nWorkId;
                 break;
-            if (pindexPrev != chainActive.Tip())
-                break;
-
-            // Update nTime every few seconds
-            UpdateTime(*pblock, pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
-            if (TestNet())
-            {
-                // Changing pblock->nTime can change work required on testnet:
-                nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
             }
         }
     } }
@@ -655,7 +783,7 @@ void static BitcoinMiner(CWallet *pwallet)
     }
 }
 
-void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
+void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads, int nBlocks)
 {
     static boost::thread_group* minerThreads = NULL;
 
@@ -672,13 +800,43 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
         delete minerThreads;
         minerThreads = NULL;
     }
+    {
+        boost::lock_guard<boost::mutex> lock(csMinerContext);
+        pMinerContext.reset();
+    }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
+    boost::shared_ptr<CMinerContext> ctx(new CMinerContext(pwallet, nThreads, nBlocks));
     minerThreads = new boost::thread_group();
+    minerThreads->create_thread(boost::bind(&MinerCoordinator, ctx));
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&MinerWorker, ctx, i));
+
+    boost::lock_guard<boost::mutex> lock(csMinerContext);
+    pMinerContext = ctx;
+}
+
+void GetMinerThreadStats(std::vector<uint64_t>& vHashes, std::vector<double>& vHashesPerSec)
+{
+    vHashes.clear();
+    vHashesPerSec.clear();
+
+    boost::shared_ptr<CMinerContext> ctx;
+    {
+        boost::lock_guard<boost::mutex> lock(csMinerContext);
+        ctx = pMinerContext;
+    }
+    if (!ctx)
+        return;
+
+    boost::lock_guard<boost::mutex> lock(ctx->cs);
+    BOOST_FOREACH(const boost::shared_ptr<CMinerThreadStats>& stats, ctx->vStats)
+    {
+        vHashes.push_back(stats->nHashes.load(std::memory_order_relaxed));
+        vHashesPerSec.push_back(stats->dHashesPerSec);
+    }
 }
 
 #endif
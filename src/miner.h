@@ -7,6 +7,7 @@
 #define BITCOIN_MINER_H
 
 #include <stdint.h>
+#include <vector>
 
 class CBlock;
 class CBlockIndex;
@@ -15,8 +16,10 @@ class CReserveKey;
 class CScript;
 class CWallet;
 
-/** Run the miner threads */
-void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
+/** Run the miner threads, stopping after nBlocks blocks have been found if nBlocks >= 0 */
+void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads, int nBlocks = -1);
+/** Total hashes and recent hash rate of each miner thread */
+void GetMinerThreadStats(std::vector<uint64_t>& vHashes, std::vector<double>& vHashesPerSec);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
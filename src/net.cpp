@@ -13,6 +13,7 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "core.h"
+#include "socketevents.h"
 #include "ui_interface.h"
 #include "darksend.h"
 #include "wallet.h"
@@ -21,6 +22,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -45,12 +47,14 @@ using namespace boost;
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+CNode* StartConnectNode(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, bool fOneShot = false);
 
 
 //
 // Global state variables
 //
 bool fDiscover = true;
+bool fBlocksOnly = DEFAULT_BLOCKSONLY;
 uint64_t nLocalServices = NODE_NETWORK;
 CCriticalSection cs_mapLocalHost;
 map<CNetAddr, LocalServiceInfo> mapLocalHost;
@@ -60,12 +64,14 @@ static CNode* pnodeLocalHost = NULL;
 static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
+static CSocketEvents* pSocketEvents = NULL;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMsgHandlerThreads = DEFAULT_MSGHAND_THREADS;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializeDataRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -420,6 +426,12 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_totalRecvQueueStats;
+CRecvQueueStats CNode::totalRecvQueueStats[MSG_CLASS_MAX];
+CCriticalSection CNode::cs_totalMsgStats;
+msgstats_t CNode::mapTotalMsgStats;
+CCriticalSection CNode::cs_totalBlocksOnlyStats;
+CBlocksOnlyStats CNode::totalBlocksOnlyStats;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -466,6 +478,43 @@ CNode* FindNode(const NodeId nodeid)
     return NULL;
 }
 
+bool InitSocketEvents(const std::string& strMode)
+{
+    pSocketEvents = CreateSocketEvents(strMode);
+    if (pSocketEvents)
+        LogPrintf("Using %s for socket events\n", pSocketEvents->GetName());
+    return pSocketEvents != NULL;
+}
+
+// Watch a new connection's socket; sockets are registered once and only
+// their interest changes afterwards
+static void RegisterSocketEvents(CNode* pnode)
+{
+    LOCK(pnode->cs_vSend);
+    if (pnode->hSocket == INVALID_SOCKET || pnode->fSocketRegistered)
+        return;
+    pnode->fPollRecv = true;
+    // a connecting socket reports completion as writable
+    pnode->fPollSend = pnode->fConnecting || !pnode->vSendMsg.empty();
+    pnode->fSocketRegistered = pSocketEvents->Add(pnode->hSocket, pnode, pnode->fPollRecv, pnode->fPollSend);
+    if (!pnode->fSocketRegistered)
+    {
+        LogPrintf("%s can not watch socket of peer=%d, disconnecting\n", pSocketEvents->GetName(), pnode->id);
+        pnode->fDisconnect = true;
+    }
+}
+
+// requires LOCK(cs_vSend)
+static void SetSocketInterest(CNode* pnode, bool fRecv, bool fSend)
+{
+    if (pnode->fPollRecv == fRecv && pnode->fPollSend == fSend)
+        return;
+    pnode->fPollRecv = fRecv;
+    pnode->fPollSend = fSend;
+    if (pnode->fSocketRegistered)
+        pSocketEvents->Modify(pnode->hSocket, pnode, fRecv, fSend);
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaster)
 {
     if (pszDest == NULL) {
@@ -518,6 +567,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaste
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         // }
+        RegisterSocketEvents(pnode);
 
         pnode->nTimeConnected = GetTime();
         pnode->AddRef();
@@ -530,20 +580,89 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaste
     }
 }
 
+// Start a non-blocking outbound connect and return the node right away;
+// ThreadSocketHandler finishes it, or drops the node if it fails or times out.
+// The node may be gone as soon as it is in vNodes, so it is complete before that.
+CNode* StartConnectNode(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, bool fOneShot)
+{
+    LogPrint("net", "trying connection %s lastseen=%.1fhrs\n",
+        addrConnect.ToString(), (double)(GetAdjustedTime() - addrConnect.nTime)/3600.0);
+
+    SOCKET hSocket;
+    bool fInProgress;
+    if (!StartConnectSocket(addrConnect, hSocket, fInProgress))
+        return NULL;
+    // Count the attempt now so an address that never answers is not picked again right away
+    addrman.Attempt(addrConnect);
+
+    CNode* pnode = new CNode(hSocket, addrConnect, "", false, fInProgress);
+    if (grantOutbound)
+        grantOutbound->MoveTo(pnode->grantOutbound);
+    pnode->fNetworkNode = true;
+    pnode->fOneShot = fOneShot;
+    pnode->AddRef();
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+    RegisterSocketEvents(pnode);
+    return pnode;
+}
+
+// Called by ThreadSocketHandler for every event on a connecting socket;
+// returns true once the connection is established
+static bool FinishConnectNode(CNode* pnode)
+{
+    LOCK(pnode->cs_vSend);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+    int nErr;
+    if (!CheckConnectSocket(pnode->hSocket, nErr))
+        return false;
+    if (nErr != 0)
+    {
+        LogPrint("net", "connect() to %s failed: %s\n", pnode->addrName, NetworkErrorString(nErr));
+        pnode->fDisconnect = true;
+        return false;
+    }
+    LogPrint("net", "connected %s\n", pnode->addrName);
+    pnode->fConnecting = false;
+    pnode->nTimeConnected = GetTime();
+    // flush the queued version message
+    SocketSendData(pnode);
+    return true;
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
-    if (hSocket != INVALID_SOCKET)
     {
-        LogPrint("net", "disconnecting node %s\n", addrName);
-        closesocket(hSocket);
-        hSocket = INVALID_SOCKET;
+        LOCK(cs_vSend);
+        if (hSocket != INVALID_SOCKET)
+        {
+            LogPrint("net", "disconnecting node %s\n", addrName);
+            if (fSocketRegistered)
+            {
+                pSocketEvents->Remove(hSocket, this);
+                fSocketRegistered = false;
+            }
+            closesocket(hSocket);
+            hSocket = INVALID_SOCKET;
+        }
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
     TRY_LOCK(cs_vRecvMsg, lockRecv);
-    if (lockRecv)
+    if (lockRecv) {
         vRecvMsg.clear();
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+            vRecvQueue[nClass].clear();
+        vRecvDeferred.clear();
+        nRecvReplayed = 0;
+        LOCK(cs_recvQueueStats);
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+            vRecvQueued[nClass] = 0;
+    }
 
     // if this was the sync node, we'll need a new one
     if (this == pnodeSync)
@@ -565,8 +684,9 @@ void CNode::PushVersion()
     CAddress addrMe = GetLocalAddress(&addr);
     RAND_bytes((unsigned char*)&nLocalHostNonce, sizeof(nLocalHostNonce));
     LogPrint("net", "send version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", PROTOCOL_VERSION, nBestHeight, addrMe.ToString(), addrYou.ToString(), addr.ToString());
+    // fRelay: in blocks only mode peers should not announce transactions to us
     PushMessage("version", PROTOCOL_VERSION, nLocalServices, nTime, addrYou, addrMe,
-                nLocalHostNonce, FormatSubVersion(CLIENT_NAME, CLIENT_VERSION, std::vector<string>()), nBestHeight, true);
+                nLocalHostNonce, FormatSubVersion(CLIENT_NAME, CLIENT_VERSION, std::vector<string>()), nBestHeight, !fBlocksOnly);
 }
 
 
@@ -652,17 +772,29 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_recvQueueStats);
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+        {
+            stats.vRecvQueued[nClass] = vRecvQueued[nClass];
+            stats.vRecvQueueStats[nClass] = vRecvQueueStats[nClass];
+        }
+    }
+
+    LOCK(cs_msgStats);
+    stats.mapMsgStats = mapMsgStats;
 }
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
-        if (vRecvMsg.empty() ||
-            vRecvMsg.back().complete())
+        if (vRecvMsg.empty())
             vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
 
         CNetMessage& msg = vRecvMsg.back();
@@ -677,13 +809,268 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         if (handled < 0)
                 return false;
 
+        if (msg.complete())
+        {
+            msg.nTime = GetTimeMicros();
+            RecordMsgRecv(msg.hdr.GetCommand(), CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize);
+            int nClass = GetMessageClass(msg.hdr.GetCommand());
+            vRecvQueue[nClass].splice(vRecvQueue[nClass].end(), vRecvMsg, vRecvMsg.begin());
+            {
+                LOCK(cs_recvQueueStats);
+                vRecvQueued[nClass]++;
+            }
+            fComplete = true;
+        }
+
         pch += handled;
         nBytes -= handled;
     }
 
+    if (fComplete)
+        WakeMessageHandler(this);
+
     return true;
 }
 
+int GetMessageClass(const std::string& strCommand)
+{
+    // Chain progress, and what must not be overtaken by the getdata it precedes
+    if (strCommand == "block" || strCommand == "headers" || strCommand == "getheaders" ||
+        strCommand == "getblocks" || strCommand == "getdata" ||
+        strCommand == "version" || strCommand == "verack" ||
+        strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear")
+        return MSG_CLASS_BLOCK;
+
+    // Masternode list, darksend, spork and InstantX traffic, mostly signature checks
+    if (strCommand == "dsee" || strCommand == "dseep" || strCommand == "dseg" || strCommand == "mnw" ||
+        strCommand == "mnget" || strCommand == "mnlist" || strCommand == "mnlistget" || strCommand == "mnse" ||
+        strCommand == "mvote" || strCommand == "dsq" || strCommand == "dsa" || strCommand == "dsi" ||
+        strCommand == "dsf" || strCommand == "dss" || strCommand == "dssu" || strCommand == "dsc" ||
+        strCommand == "dstx" || strCommand == "spork" || strCommand == "getsporks" ||
+        strCommand == "txlreq" || strCommand == "txlvote")
+        return MSG_CLASS_GOSSIP;
+
+    return MSG_CLASS_NORMAL;
+}
+
+const char* GetMessageClassName(int nClass)
+{
+    switch (nClass)
+    {
+    case MSG_CLASS_BLOCK: return "block";
+    case MSG_CLASS_NORMAL: return "normal";
+    case MSG_CLASS_GOSSIP: return "gossip";
+    }
+    return "unknown";
+}
+
+unsigned int GetMessageClassBudget(int nClass)
+{
+    switch (nClass)
+    {
+    case MSG_CLASS_NORMAL: return 200;
+    case MSG_CLASS_GOSSIP: return 50;
+    }
+    return 0;
+}
+
+// Messages that neither reply nor change the filter the getdata responses are built with
+static bool CanOvertakeGetData(const std::string& strCommand)
+{
+    return strCommand == "block" || strCommand == "headers";
+}
+
+int CNode::GetNextRecvClass()
+{
+    int64_t nTick = GetTimeMillis() / MSG_HANDLER_TICK;
+    if (nTick != nRecvBudgetTick)
+    {
+        nRecvBudgetTick = nTick;
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+            vRecvBudgetUsed[nClass] = 0;
+    }
+
+    for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+    {
+        if (vRecvQueue[nClass].empty())
+            continue;
+        // Responses to getdata keep their order: while some are outstanding only
+        // blocks and headers may go ahead; getdata, getblocks, getheaders, version and
+        // the filter messages wait behind them, and so does the rest of their queue
+        if (!vRecvGetData.empty() && !(nClass == MSG_CLASS_BLOCK && CanOvertakeGetData(vRecvQueue[nClass].front().hdr.GetCommand())))
+            return -1;
+        unsigned int nBudget = GetMessageClassBudget(nClass);
+        if (nBudget != 0 && vRecvBudgetUsed[nClass] >= nBudget)
+            continue;
+        return nClass;
+    }
+    return -1;
+}
+
+bool CNode::PopRecvMessage(int nClass, std::list<CNetMessage>& vMsg)
+{
+    vMsg.splice(vMsg.end(), vRecvQueue[nClass], vRecvQueue[nClass].begin());
+    vRecvBudgetUsed[nClass]++;
+    bool fReplayed = nClass == MSG_CLASS_GOSSIP && nRecvReplayed > 0;
+    if (fReplayed)
+        nRecvReplayed--;
+    LOCK(cs_recvQueueStats);
+    vRecvQueued[nClass]--;
+    return fReplayed;
+}
+
+void CNode::DeferRecvMessage(const uint256& hashEntry, const CNetMessage& msg, bool fReplayed)
+{
+    if (!fReplayed)
+    {
+        vRecvDeferred.push_back(make_pair(hashEntry, msg));
+        return;
+    }
+
+    // Older than everything still deferred, and so are the replayed messages queued behind it
+    std::deque<std::pair<uint256, CNetMessage> > vBack;
+    vBack.push_back(make_pair(hashEntry, msg));
+    std::list<CNetMessage>& queue = vRecvQueue[MSG_CLASS_GOSSIP];
+    for (unsigned int i = 0; i < nRecvReplayed; i++)
+    {
+        vBack.push_back(make_pair(uint256(0), queue.front()));
+        queue.pop_front();
+    }
+    vRecvDeferred.insert(vRecvDeferred.begin(), vBack.begin(), vBack.end());
+    LOCK(cs_recvQueueStats);
+    vRecvQueued[MSG_CLASS_GOSSIP] -= nRecvReplayed;
+    nRecvReplayed = 0;
+}
+
+void CNode::RequeueDeferredRecvMessages(unsigned int nCount)
+{
+    std::list<CNetMessage> vMsg;
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        vMsg.push_back(vRecvDeferred.front().second);
+        vRecvDeferred.pop_front();
+    }
+
+    // Behind the messages replayed earlier, which arrived before these
+    std::list<CNetMessage>& queue = vRecvQueue[MSG_CLASS_GOSSIP];
+    std::list<CNetMessage>::iterator it = queue.begin();
+    std::advance(it, nRecvReplayed);
+    queue.splice(it, vMsg);
+    nRecvReplayed += nCount;
+    LOCK(cs_recvQueueStats);
+    vRecvQueued[MSG_CLASS_GOSSIP] += nCount;
+}
+
+void CNode::RecordRecvQueueDelay(int nClass, int64_t nDelay)
+{
+    {
+        LOCK(cs_recvQueueStats);
+        vRecvQueueStats[nClass].Add(nDelay);
+    }
+    LOCK(cs_totalRecvQueueStats);
+    totalRecvQueueStats[nClass].Add(nDelay);
+}
+
+void CNode::GetTotalRecvQueueStats(std::vector<CRecvQueueStats>& vStats)
+{
+    LOCK(cs_totalRecvQueueStats);
+    vStats.assign(totalRecvQueueStats, totalRecvQueueStats + MSG_CLASS_MAX);
+}
+
+static bool IsKnownMsgCommand(const std::string& strCommand)
+{
+    if (GetMessageClass(strCommand) != MSG_CLASS_NORMAL)
+        return true;
+    return strCommand == "addr" || strCommand == "inv" || strCommand == "merkleblock" ||
+        strCommand == "tx" || strCommand == "getaddr" || strCommand == "mempool" ||
+        strCommand == "ping" || strCommand == "pong" || strCommand == "alert" ||
+        strCommand == "notfound" || strCommand == "reject" || strCommand == "dsr";
+}
+
+// Commands a peer makes up all share MSG_STATS_OTHER, so they can not grow the stats
+static CMsgCommandStats& GetMsgStatsEntry(msgstats_t& mapStats, const std::string& strCommand)
+{
+    if (!IsKnownMsgCommand(strCommand))
+        return mapStats[MSG_STATS_OTHER];
+    return mapStats[strCommand];
+}
+
+void CNode::RecordMsgRecv(const std::string& strCommand, uint64_t nBytes)
+{
+    {
+        LOCK(cs_msgStats);
+        CMsgCommandStats& stats = GetMsgStatsEntry(mapMsgStats, strCommand);
+        stats.nRecvMessages++;
+        stats.nRecvBytes += nBytes;
+    }
+    LOCK(cs_totalMsgStats);
+    CMsgCommandStats& stats = GetMsgStatsEntry(mapTotalMsgStats, strCommand);
+    stats.nRecvMessages++;
+    stats.nRecvBytes += nBytes;
+}
+
+void CNode::RecordMsgSent(const CSerializeData& msg)
+{
+    // the command is NUL padded in the header
+    const char* pszCommand = &msg[MESSAGE_START_SIZE];
+    std::string strCommand(pszCommand, std::find(pszCommand, pszCommand + CMessageHeader::COMMAND_SIZE, '\0'));
+    {
+        LOCK(cs_msgStats);
+        CMsgCommandStats& stats = GetMsgStatsEntry(mapMsgStats, strCommand);
+        stats.nSendMessages++;
+        stats.nSendBytes += msg.size();
+    }
+    LOCK(cs_totalMsgStats);
+    CMsgCommandStats& stats = GetMsgStatsEntry(mapTotalMsgStats, strCommand);
+    stats.nSendMessages++;
+    stats.nSendBytes += msg.size();
+}
+
+void CNode::RecordMsgHandlerTime(const std::string& strCommand, int64_t nTime)
+{
+    {
+        LOCK(cs_msgStats);
+        GetMsgStatsEntry(mapMsgStats, strCommand).nHandlerTime += nTime;
+    }
+    LOCK(cs_totalMsgStats);
+    GetMsgStatsEntry(mapTotalMsgStats, strCommand).nHandlerTime += nTime;
+}
+
+void CNode::GetTotalMsgStats(msgstats_t& mapStats)
+{
+    LOCK(cs_totalMsgStats);
+    mapStats = mapTotalMsgStats;
+}
+
+void CNode::RecordInvIgnored()
+{
+    LOCK(cs_totalBlocksOnlyStats);
+    totalBlocksOnlyStats.nInvIgnored++;
+}
+
+void CNode::RecordTxRejected(uint64_t nBytes)
+{
+    LOCK(cs_totalBlocksOnlyStats);
+    totalBlocksOnlyStats.nTxRejected++;
+    totalBlocksOnlyStats.nTxRejectedBytes += nBytes;
+}
+
+void CNode::RecordTxSkipped(uint64_t nBytes)
+{
+    LOCK(cs_totalBlocksOnlyStats);
+    totalBlocksOnlyStats.nTxSkipped++;
+    totalBlocksOnlyStats.nTxSkippedBytes += nBytes;
+}
+
+CBlocksOnlyStats CNode::GetBlocksOnlyStats()
+{
+    LOCK(cs_totalBlocksOnlyStats);
+    return totalBlocksOnlyStats;
+}
+
+// Messages up to this size get their whole buffer when the header arrives
+static const unsigned int RECV_INITIAL_RESERVE = 256 * 1024;
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -709,9 +1096,10 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
-    // switch state to reading message data
+    // switch state to reading message data; the buffer grows as the data
+    // arrives, so a peer can not make us allocate MAX_SIZE with a header
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    vRecv.reserve(std::min(hdr.nMessageSize, RECV_INITIAL_RESERVE));
 
     return nCopy;
 }
@@ -721,7 +1109,9 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    if (vRecv.size() + nCopy > vRecv.capacity())
+        vRecv.reserve(std::min((size_t)hdr.nMessageSize, std::max(2 * vRecv.capacity(), vRecv.size() + nCopy)));
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -735,25 +1125,78 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+CSerializeDataRef FinalizeMessage(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ss.GetAndClear(*pdata);
+    return pdata;
+}
+
+// Number of queued buffers handed to the kernel per send call
+static const unsigned int MAX_SEND_BUFFERS = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    if (pnode->hSocket == INVALID_SOCKET || pnode->fConnecting)
+        return;
+
+    std::deque<CSerializeDataRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        // Flush as many queued messages as fit in one call
+#ifdef WIN32
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_BUFFERS];
+        size_t nBuffers = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSerializeDataRef>::iterator itBuf = it; itBuf != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; ++itBuf) {
+            const CSerializeData &data = **itBuf;
+            assert(data.size() > nOffset);
+            iov[nBuffers].iov_base = (void*)&data[nOffset];
+            iov[nBuffers].iov_len = data.size() - nOffset;
+            nBuffers++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nBuffers;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            size_t nSent = nBytes;
+            bool fPartial = false;
+            while (nSent > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    fPartial = true;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
+            }
+            if (fPartial) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -777,13 +1220,94 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    // only ask for send readiness while the optimistic write left something behind
+    SetSocketInterest(pnode, pnode->fPollRecv, !pnode->vSendMsg.empty());
 }
 
 static list<CNode*> vNodesDisconnected;
 
+// requires LOCK(pnode->cs_vRecvMsg)
+static bool IsRecvBufferFull(CNode* pnode)
+{
+    return pnode->HasQueuedMessages() && pnode->GetTotalRecvSize() > ReceiveFloodSize();
+}
+
+static void AcceptConnections(SOCKET hListenSocket)
+{
+    int nInbound = 0;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    // Listening sockets are edge-triggered too, so take everything queued
+    while (true)
+    {
+        struct sockaddr_storage sockaddr;
+        socklen_t len = sizeof(sockaddr);
+        SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+        CAddress addr;
+
+        if (hSocket == INVALID_SOCKET)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr == WSAEINTR)
+                continue;
+            if (nErr != WSAEWOULDBLOCK)
+                LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+            break;
+        }
+
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+        if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+        {
+            closesocket(hSocket);
+        }
+        else if (CNode::IsBanned(addr))
+        {
+            LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+            closesocket(hSocket);
+        }
+        else
+        {
+            LogPrint("net", "accepted connection %s\n", addr.ToString());
+            CNode* pnode = new CNode(hSocket, addr, "", true);
+            pnode->AddRef();
+            {
+                LOCK(cs_vNodes);
+                vNodes.push_back(pnode);
+            }
+            RegisterSocketEvents(pnode);
+            nInbound++;
+        }
+    }
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+
+    // Edge-triggered readiness is only reported once, so remember sockets
+    // that were not read or written until they would block
+    set<CNode*> setRecvPending;
+    set<CNode*> setSendPending;
+    // Sockets not watched for receiving until the message handler drains their receive buffer
+    set<CNode*> setRecvPaused;
+    // Whether a pending socket was serviced last round and may have more right away, rather
+    // than only being skipped because a handler thread held its lock
+    bool fPendingReady = false;
+    vector<CSocketEvents::Event> vEvents;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && !pSocketEvents->Add(hListenSocket, NULL, true, false))
+            LogPrintf("%s can not watch listening socket\n", pSocketEvents->GetName());
+
     while (true)
     {
         //
@@ -796,7 +1320,7 @@ void ThreadSocketHandler()
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && !pnode->HasQueuedMessages() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
                 {
 
                     LogPrintf("removing node: peer=%d addr=%s nRefCount=%d fNetworkNode=%d fInbound=%d fDarkSendMaster=%d\n",
@@ -804,6 +1328,9 @@ void ThreadSocketHandler()
 
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    setRecvPending.erase(pnode);
+                    setSendPending.erase(pnode);
+                    setRecvPaused.erase(pnode);
 
                     // release outbound grant (if any)
                     pnode->grantOutbound.Release();
@@ -859,213 +1386,174 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
-
         //
-        // Find which sockets have data to receive
+        // Resume receiving on sockets whose receive buffer has room again
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        // If there is no (complete) message in the receive buffer, or there is
+        // space left in it, we receive; otherwise there is certainly a message
+        // ready for the message handler thread, so we can't deadlock.
+        //
+        vector<CNode*> vPaused(setRecvPaused.begin(), setRecvPaused.end());
+        BOOST_FOREACH(CNode* pnode, vPaused)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (!lockRecv || IsRecvBufferFull(pnode))
+                continue;
+            setRecvPaused.erase(pnode);
+            setRecvPending.insert(pnode);
+            fPendingReady = true;
+            LOCK(pnode->cs_vSend);
+            SetSocketInterest(pnode, true, pnode->fPollSend);
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        //
+        // Wait for sockets to become ready
+        //
+        vEvents.clear();
+        // frequency to poll the receive buffers; sockets only waiting for a lock get a short nap
+        // instead of a busy loop
+        int nTimeout = 50;
+        if (fPendingReady)
+            nTimeout = 0;
+        else if (!setRecvPending.empty() || !setSendPending.empty())
+            nTimeout = 5;
+        fPendingReady = false;
+        if (!pSocketEvents->Wait(nTimeout, vEvents))
+            MilliSleep(50);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
+        BOOST_FOREACH(const CSocketEvents::Event& event, vEvents)
         {
-            if (have_fds)
+            if (event.pContext == NULL)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                AcceptConnections(event.hSocket);
+                continue;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            // Only this thread removes nodes from vNodes, and a node is
+            // unregistered before it is, so the context is still valid
+            CNode* pnode = (CNode*)event.pContext;
+            if (pnode->fConnecting)
+            {
+                if (!FinishConnectNode(pnode))
+                    continue;
+                // whatever arrived with the handshake is only reported once
+                setRecvPending.insert(pnode);
+            }
+            if (event.nEvents & (CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_ERROR))
+                setRecvPending.insert(pnode);
+            if (event.nEvents & CSocketEvents::EVENT_SEND)
+                setSendPending.insert(pnode);
         }
 
-
         //
-        // Accept new connections
+        // Receive
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        vector<CNode*> vRecv(setRecvPending.begin(), setRecvPending.end());
+        BOOST_FOREACH(CNode* pnode, vRecv)
         {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
+            boost::this_thread::interruption_point();
 
+            if (pnode->hSocket == INVALID_SOCKET)
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
+                setRecvPending.erase(pnode);
+                continue;
             }
-
-            if (hSocket == INVALID_SOCKET)
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (!lockRecv)
+                continue;
+            if (IsRecvBufferFull(pnode))
             {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+                setRecvPending.erase(pnode);
+                setRecvPaused.insert(pnode);
+                LOCK(pnode->cs_vSend);
+                SetSocketInterest(pnode, false, pnode->fPollSend);
+                continue;
             }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+
+            // typical socket buffer is 8K-64K
+            char pchBuf[0x10000];
+            int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+            if (nBytes > 0)
             {
-                closesocket(hSocket);
+                if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                    pnode->CloseSocketDisconnect();
+                pnode->nLastRecv = GetTime();
+                pnode->nRecvBytes += nBytes;
+                pnode->RecordBytesRecv(nBytes);
+                // A short read emptied the socket buffer; data arriving
+                // after it is reported as a new edge
+                if (nBytes < (int)sizeof(pchBuf))
+                    setRecvPending.erase(pnode);
+                else
+                    fPendingReady = true;
             }
-            else if (CNode::IsBanned(addr))
+            else if (nBytes == 0)
             {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
+                // socket closed gracefully
+                if (!pnode->fDisconnect)
+                    LogPrint("net", "socket closed\n");
+                pnode->CloseSocketDisconnect();
+                setRecvPending.erase(pnode);
             }
-            else
+            else if (nBytes < 0)
             {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr == WSAEWOULDBLOCK)
+                {
+                    setRecvPending.erase(pnode);
+                }
+                else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                 {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
+                    if (!pnode->fDisconnect)
+                        LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                    pnode->CloseSocketDisconnect();
+                    setRecvPending.erase(pnode);
                 }
+                else
+                    fPendingReady = true;
             }
         }
 
-
         //
-        // Service each socket
+        // Send
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        vector<CNode*> vSend(setSendPending.begin(), setSendPending.end());
+        BOOST_FOREACH(CNode* pnode, vSend)
         {
             boost::this_thread::interruption_point();
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->hSocket != INVALID_SOCKET)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend)
+                    continue;
+                // a write that would block re-arms the send interest
+                SocketSendData(pnode);
             }
+            setSendPending.erase(pnode);
+        }
 
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+        //
+        // Inactivity checking
+        //
+        if (GetTime() == nLastInactivityCheck)
+            continue;
+        nLastInactivityCheck = GetTime();
+
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->fConnecting)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                // frees the outbound slot for the next address
+                if ((GetTime() - pnode->nTimeConnected) * 1000 >= nConnectTimeout)
+                {
+                    LogPrint("net", "connection to %s timeout\n", pnode->addrName);
+                    pnode->fDisconnect = true;
+                }
+                continue;
             }
-
-            //
-            // Inactivity checking
-            //
             if (pnode->vSendMsg.empty())
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
@@ -1087,11 +1575,6 @@ void ThreadSocketHandler()
                 }
             }
         }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
-        }
     }
 }
 
@@ -1323,11 +1806,15 @@ void ThreadOpenConnections()
 
     // Initiate network connections
     int64_t nStart = GetTime();
+    bool fStarted = false;
     while (true)
     {
         ProcessOneShot();
 
-        MilliSleep(500);
+        // Connects run in the background, so keep filling free slots quickly
+        // while addresses are found
+        MilliSleep(fStarted ? 100 : 500);
+        fStarted = false;
 
         CSemaphoreGrant grant(*semOutbound);
         boost::this_thread::interruption_point();
@@ -1396,7 +1883,7 @@ void ThreadOpenConnections()
         }
 
         if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+            fStarted = OpenNetworkConnection(addrConnect, &grant);
     }
 }
 
@@ -1487,6 +1974,12 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
     if (strDest && FindNode(strDest))
         return false;
 
+    // Direct connects do not block this thread, so several can be in flight;
+    // named and proxied ones still need the blocking handshake
+    proxyType proxy;
+    if (!strDest && !GetProxy(addrConnect.GetNetwork(), proxy))
+        return StartConnectNode(addrConnect, grantOutbound, fOneShot) != NULL;
+
     CNode* pnode = ConnectNode(addrConnect, strDest);
     boost::this_thread::interruption_point();
 
@@ -1536,75 +2029,186 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+// Peers with messages to handle. A peer is handed to at most one message
+// handler thread at a time and holds a reference while it is queued.
+static boost::mutex csMsgHandler;
+static boost::condition_variable condMsgHandler;
+static std::deque<CNode*> queueMsgHandler;
+static int64_t nNextMsgHandlerTick = 0;
+static CCriticalSection cs_msgHandlerTick;
+
+void WakeMessageHandler(CNode* pnode)
 {
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
-    while (true)
     {
-        bool fHaveSyncNode = false;
-
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-                if (pnode == pnodeSync)
-                    fHaveSyncNode = true;
-            }
+        boost::unique_lock<boost::mutex> lock(csMsgHandler);
+        if (pnode->fHandlerActive) {
+            // the thread handling it looks again when it's done
+            pnode->fHandlerRerun = true;
+            return;
         }
+        if (pnode->fHandlerQueued)
+            return;
+        pnode->fHandlerQueued = true;
+        pnode->AddRef();
+        queueMsgHandler.push_back(pnode);
+    }
+    condMsgHandler.notify_one();
+}
+
+void WakeMessageHandler(NodeId id)
+{
+    LOCK(cs_vNodes);
+    CNode* pnode = FindNode(id);
+    if (pnode)
+        WakeMessageHandler(pnode);
+}
+
+// Every 100ms all peers get a SendMessages pass, one of them with trickling
+static void MessageHandlerTick()
+{
+    TRY_LOCK(cs_msgHandlerTick, lockTick);
+    if (!lockTick)
+        return;
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
+    bool fHaveSyncNode = false;
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            pnode->AddRef();
+            if (pnode == pnodeSync)
+                fHaveSyncNode = true;
+        }
+    }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+    // not under cs_vNodes, StartSync takes cs_main
+    if (!fHaveSyncNode)
+        StartSync(vNodesCopy);
 
-        bool fSleep = true;
+    if (!vNodesCopy.empty())
+    {
+        CNode* pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        boost::unique_lock<boost::mutex> lock(csMsgHandler);
+        pnodeTrickle->fHandlerTrickle = true;
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        WakeMessageHandler(pnode);
 
+    {
+        LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+
+// Returns whether the peer has more work right away
+static bool HandleMessages(CNode* pnode, bool fTrickle)
+{
+    if (pnode->fDisconnect)
+        return false;
+
+    bool fMoreWork = false;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
         {
-            if (pnode->fDisconnect)
-                continue;
+            if (!g_signals.ProcessMessages(pnode))
+                pnode->fDisconnect = true;
 
-            // Receive messages
+            if (pnode->nSendSize < SendBufferSize())
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                // a peer out of budget for what it has queued is woken by the next tick
+                if (!pnode->vRecvGetData.empty() || pnode->GetNextRecvClass() >= 0)
                 {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->fDisconnect = true;
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
+                    fMoreWork = true;
                 }
             }
-            boost::this_thread::interruption_point();
+        }
+        // otherwise the socket thread is appending to it: ReceiveMsgBytes wakes us again
+        // for what it completes, and the tick wakes every peer, so don't spin on the lock
+    }
+    boost::this_thread::interruption_point();
 
-            // Send messages
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            g_signals.SendMessages(pnode, fTrickle);
+    }
+    boost::this_thread::interruption_point();
+
+    return fMoreWork;
+}
+
+void ThreadMessageHandler()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode = NULL;
+        bool fTrickle = false;
+        {
+            boost::unique_lock<boost::mutex> lock(csMsgHandler);
+            while (queueMsgHandler.empty() && GetTimeMillis() < nNextMsgHandlerTick)
+                condMsgHandler.timed_wait(lock, boost::posix_time::milliseconds(nNextMsgHandlerTick - GetTimeMillis()));
+            if (GetTimeMillis() >= nNextMsgHandlerTick)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
+                nNextMsgHandlerTick = GetTimeMillis() + MSG_HANDLER_TICK;
+            }
+            else
+            {
+                pnode = queueMsgHandler.front();
+                queueMsgHandler.pop_front();
+                pnode->fHandlerQueued = false;
+                pnode->fHandlerActive = true;
+                pnode->fHandlerRerun = false;
+                fTrickle = pnode->fHandlerTrickle;
+                pnode->fHandlerTrickle = false;
             }
-            boost::this_thread::interruption_point();
         }
 
+        if (pnode == NULL)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            MessageHandlerTick();
+            continue;
+        }
+
+        bool fMoreWork = false;
+        try
+        {
+            fMoreWork = HandleMessages(pnode, fTrickle);
+        }
+        catch (...)
+        {
+            boost::unique_lock<boost::mutex> lock(csMsgHandler);
+            pnode->fHandlerActive = false;
+            throw;
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        bool fRequeue = false;
+        {
+            boost::unique_lock<boost::mutex> lock(csMsgHandler);
+            pnode->fHandlerActive = false;
+            if ((fMoreWork || pnode->fHandlerRerun) && !pnode->fDisconnect && !pnode->fHandlerQueued)
+            {
+                // keep the reference for the queue
+                pnode->fHandlerQueued = true;
+                queueMsgHandler.push_back(pnode);
+                fRequeue = true;
+            }
+        }
+        if (fRequeue)
+        {
+            condMsgHandler.notify_one();
+        }
+        else
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
     }
 }
 
@@ -1797,7 +2401,8 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1844,6 +2449,8 @@ public:
         semOutbound = NULL;
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
+        delete pSocketEvents;
+        pSocketEvents = NULL;
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -1861,13 +2468,10 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, hash, ss);
+    RelayTransaction(tx, hash, SerializeMessage("tx", tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const uint256& hash, const CSerializeDataRef& msg)
 {
     CInv inv(MSG_TX, hash);
     {
@@ -1879,8 +2483,8 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Keep the finished message, getdata for it is answered without serializing again
+        mapRelay.insert(std::make_pair(inv, msg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1904,13 +2508,14 @@ void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash, bool r
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
 
     //broadcast the new lock
+    CSerializeDataRef msg = SerializeMessage("txlreq", tx);
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
         if(!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("txlreq", tx);
+        pnode->PushSerializedMessage(msg);
     }
 
 }
@@ -20,6 +20,9 @@
 #include "core.h"
 
 #include <deque>
+#include <limits>
+#include <list>
+#include <map>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -27,6 +30,7 @@
 #endif
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -45,10 +49,36 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** -msghandthreads default (number of threads processing peer messages) */
+static const int DEFAULT_MSGHAND_THREADS = 4;
+/** Upper bound for -msghandthreads */
+static const int MAX_MSGHAND_THREADS = 16;
+/** Milliseconds between message handler ticks (trickle, sync checks and receive budgets) */
+static const int64_t MSG_HANDLER_TICK = 100;
+/** -blocksonly default: relay transactions from peers */
+static const bool DEFAULT_BLOCKSONLY = false;
+/** False positive rate of the per-peer known inventory filter; a false positive suppresses one announcement to that peer */
+static const double INVENTORY_KNOWN_FP_RATE = 0.000001;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+/** A complete serialized message, shared between the send queues of every peer it goes to */
+typedef boost::shared_ptr<const CSerializeData> CSerializeDataRef;
+
+/** Fill in the size and checksum of the message serialized into ss and move it into a shareable buffer */
+CSerializeDataRef FinalizeMessage(CDataStream& ss);
+
+/** Serialize a message once, to be queued to any number of peers with CNode::PushSerializedMessage */
+template<typename T1>
+CSerializeDataRef SerializeMessage(const char* pszCommand, const T1& a1, int nVersion = PROTOCOL_VERSION)
+{
+    CDataStream ss(SER_NETWORK, nVersion);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(a1, SER_NETWORK, nVersion));
+    ss << CMessageHeader(pszCommand, 0) << a1;
+    return FinalizeMessage(ss);
+}
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -62,6 +92,9 @@ typedef int NodeId;
 CNode* FindNode(const std::string& addrName);
 CNode* FindNode(const NodeId id); //TODO: Remove this
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
+bool InitSocketEvents(const std::string& strMode);
+void WakeMessageHandler(CNode* pnode);
+void WakeMessageHandler(NodeId id);
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
@@ -108,14 +141,16 @@ CAddress GetLocalAddress(const CNetAddr *paddrPeer = NULL);
 
 
 extern bool fDiscover;
+extern bool fBlocksOnly;
 extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMsgHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializeDataRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -134,6 +169,70 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/**
+ * Receive priority classes. Complete messages wait in one queue per class
+ * and the first class with a message goes first; within a class they keep
+ * their order.
+ */
+enum
+{
+    MSG_CLASS_BLOCK = 0, // blocks, chain sync, getdata, handshake and bloom filters
+    MSG_CLASS_NORMAL,    // transactions, addresses, pings and everything else
+    MSG_CLASS_GOSSIP,    // masternode, darksend, spork and InstantX messages
+    MSG_CLASS_MAX
+};
+
+int GetMessageClass(const std::string& strCommand);
+const char* GetMessageClassName(int nClass);
+/** Messages of a class one peer may have processed per message handler tick, 0 for no limit */
+unsigned int GetMessageClassBudget(int nClass);
+
+/** How long received messages of one class waited before being processed */
+struct CRecvQueueStats
+{
+    uint64_t nMessages;
+    int64_t nTotalDelay; // microseconds
+    int64_t nMaxDelay;
+
+    CRecvQueueStats() : nMessages(0), nTotalDelay(0), nMaxDelay(0) {}
+
+    void Add(int64_t nDelay)
+    {
+        nMessages++;
+        nTotalDelay += nDelay;
+        nMaxDelay = std::max(nMaxDelay, nDelay);
+    }
+};
+
+/** Traffic and message handler time of one message command */
+struct CMsgCommandStats
+{
+    uint64_t nRecvMessages;
+    uint64_t nRecvBytes;
+    uint64_t nSendMessages;
+    uint64_t nSendBytes;
+    int64_t nHandlerTime; // microseconds spent in ProcessMessage
+
+    CMsgCommandStats() : nRecvMessages(0), nRecvBytes(0), nSendMessages(0), nSendBytes(0), nHandlerTime(0) {}
+};
+
+typedef std::map<std::string, CMsgCommandStats> msgstats_t;
+
+/** Stats entry shared by all commands this node does not know */
+static const char MSG_STATS_OTHER[] = "*other*";
+
+/** Transaction traffic -blocksonly turned away or never asked for */
+struct CBlocksOnlyStats
+{
+    uint64_t nInvIgnored;     // transaction announcements not requested
+    uint64_t nTxRejected;     // unsolicited transactions dropped unprocessed
+    uint64_t nTxRejectedBytes;
+    uint64_t nTxSkipped;      // block transactions that were never relayed to us on their own
+    uint64_t nTxSkippedBytes;
+
+    CBlocksOnlyStats() : nInvIgnored(0), nTxRejected(0), nTxRejectedBytes(0), nTxSkipped(0), nTxSkippedBytes(0) {}
+};
+
 class CNodeStats
 {
 public:
@@ -153,6 +252,9 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    unsigned int vRecvQueued[MSG_CLASS_MAX];
+    CRecvQueueStats vRecvQueueStats[MSG_CLASS_MAX];
+    msgstats_t mapMsgStats;
 };
 
 
@@ -169,11 +271,19 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
+    int64_t nTime;                  // time the message was complete, in microseconds
+    unsigned int nDeferrals;        // times it was parked waiting for its signature
+
+    // Received data is not secret, so both buffers come from the pool and are not cleared
+    CNetMessage(int nTypeIn, int nVersionIn) :
+        hdrbuf(nTypeIn, nVersionIn, CDataStream::allocator_type(true)),
+        vRecv(nTypeIn, nVersionIn, CDataStream::allocator_type(true)) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        nTime = 0;
+        nDeferrals = 0;
     }
 
     bool complete() const
@@ -208,12 +318,41 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializeDataRef> vSendMsg;
     CCriticalSection cs_vSend;
+    // socket event registration and interest, guarded by cs_vSend
+    bool fSocketRegistered;
+    bool fPollRecv;
+    bool fPollSend;
+    // outbound connect still in progress; set before the socket is registered
+    // and only cleared by ThreadSocketHandler, under cs_vSend
+    bool fConnecting;
+    // message handler scheduling, guarded by the handler queue's mutex
+    bool fHandlerQueued;
+    bool fHandlerActive;
+    bool fHandlerRerun;
+    bool fHandlerTrickle;
 
     std::deque<CInv> vRecvGetData;
-    std::deque<CNetMessage> vRecvMsg;
+    // the message being received; once complete it moves to the queue of its class
+    std::list<CNetMessage> vRecvMsg;
+    std::list<CNetMessage> vRecvQueue[MSG_CLASS_MAX];
+    // gossip messages waiting for their signature to be recovered, keyed by signature cache entry
+    // (0 for those only waiting behind an earlier one), in the order they arrived
+    std::deque<std::pair<uint256, CNetMessage> > vRecvDeferred;
+    // gossip messages at the front of their queue that came back from vRecvDeferred, guarded by cs_vRecvMsg
+    unsigned int nRecvReplayed;
     CCriticalSection cs_vRecvMsg;
+    // messages of each class processed in the current tick, guarded by cs_vRecvMsg
+    int64_t nRecvBudgetTick;
+    unsigned int vRecvBudgetUsed[MSG_CLASS_MAX];
+    // queue lengths and delays for getpeerinfo, not taken with any other lock held
+    CCriticalSection cs_recvQueueStats;
+    unsigned int vRecvQueued[MSG_CLASS_MAX];
+    CRecvQueueStats vRecvQueueStats[MSG_CLASS_MAX];
+    // traffic and handler time by message command, not taken with any other lock held
+    CCriticalSection cs_msgStats;
+    msgstats_t mapMsgStats;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -272,8 +411,8 @@ public:
     bool fGetAddr;
     std::set<uint256> setKnown;
 
-    // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    // inventory based relay, sized like the send buffer (at least one entry, -maxsendbuffer may be 0)
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -284,7 +423,9 @@ public:
     int64_t nPingUsecTime;
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false, bool fConnectingIn=false) :
+        ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000),
+        filterInventoryKnown(std::max(SendBufferSize() / 1000, 1u), INVENTORY_KNOWN_FP_RATE, GetRand(std::numeric_limits<uint32_t>::max()))
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -308,6 +449,21 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fSocketRegistered = false;
+        fPollRecv = false;
+        fPollSend = false;
+        fConnecting = fConnectingIn;
+        fHandlerQueued = false;
+        fHandlerActive = false;
+        fHandlerRerun = false;
+        fHandlerTrickle = false;
+        nRecvBudgetTick = 0;
+        nRecvReplayed = 0;
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+        {
+            vRecvBudgetUsed[nClass] = 0;
+            vRecvQueued[nClass] = 0;
+        }
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -315,7 +471,6 @@ public:
         fStartSync = false;
         fGetAddr = false;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         pfilter = new CBloomFilter();
         nPingNonceSent = 0;
         nPingUsecStart = 0;
@@ -327,7 +482,8 @@ public:
             id = nLastNodeId++;
         }
 
-        // Be shy and don't send version until we hear
+        // Be shy and don't send version until we hear; while connecting
+        // it stays queued until the socket is writable
         if (hSocket != INVALID_SOCKET && !fInbound)
             PushVersion();
 
@@ -352,6 +508,12 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CCriticalSection cs_totalRecvQueueStats;
+    static CRecvQueueStats totalRecvQueueStats[MSG_CLASS_MAX];
+    static CCriticalSection cs_totalMsgStats;
+    static msgstats_t mapTotalMsgStats;
+    static CCriticalSection cs_totalBlocksOnlyStats;
+    static CBlocksOnlyStats totalBlocksOnlyStats;
 
     CCriticalSection cs_nRefCount;
 
@@ -377,6 +539,11 @@ public:
         unsigned int total = 0;
         BOOST_FOREACH(const CNetMessage &msg, vRecvMsg)
             total += msg.vRecv.size() + 24;
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+            BOOST_FOREACH(const CNetMessage &msg, vRecvQueue[nClass])
+                total += msg.vRecv.size() + 24;
+        for (std::deque<std::pair<uint256, CNetMessage> >::const_iterator it = vRecvDeferred.begin(); it != vRecvDeferred.end(); ++it)
+            total += it->second.vRecv.size() + 24;
         return total;
     }
 
@@ -389,8 +556,41 @@ public:
         nRecvVersion = nVersionIn;
         BOOST_FOREACH(CNetMessage &msg, vRecvMsg)
             msg.SetVersion(nVersionIn);
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+            BOOST_FOREACH(CNetMessage &msg, vRecvQueue[nClass])
+                msg.SetVersion(nVersionIn);
+    }
+
+    // requires LOCK(cs_vRecvMsg)
+    bool HasQueuedMessages() const
+    {
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+            if (!vRecvQueue[nClass].empty())
+                return true;
+        return false;
     }
 
+    // requires LOCK(cs_vRecvMsg)
+    /** Class of the next message to process, -1 if none may go before the next tick */
+    int GetNextRecvClass();
+    // requires LOCK(cs_vRecvMsg)
+    /** Move the next message of a class to vMsg and charge it to this tick's budget. Returns whether it came back from vRecvDeferred. */
+    bool PopRecvMessage(int nClass, std::list<CNetMessage>& vMsg);
+    // requires LOCK(cs_vRecvMsg)
+    /** Park a gossip message in vRecvDeferred; a replayed one goes back in front, with the replayed messages behind it */
+    void DeferRecvMessage(const uint256& hashEntry, const CNetMessage& msg, bool fReplayed);
+    // requires LOCK(cs_vRecvMsg)
+    /** Return the first nCount deferred messages to the gossip queue, ahead of everything not replayed, in arrival order */
+    void RequeueDeferredRecvMessages(unsigned int nCount);
+    /** Account for the time a message of this class spent queued */
+    void RecordRecvQueueDelay(int nClass, int64_t nDelay);
+    /** Account a complete received message, header included */
+    void RecordMsgRecv(const std::string& strCommand, uint64_t nBytes);
+    /** Account a message queued for sending */
+    void RecordMsgSent(const CSerializeData& msg);
+    /** Account the time ProcessMessage took for a message */
+    void RecordMsgHandlerTime(const std::string& strCommand, int64_t nTime);
+
     CNode* AddRef()
     {
         LOCK(cs_nRefCount);
@@ -430,7 +630,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
@@ -438,7 +638,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -476,6 +676,18 @@ public:
 
 
 
+    // requires LOCK(cs_vSend)
+    void QueueSendMsg(const CSerializeDataRef& msg)
+    {
+        RecordMsgSent(*msg);
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
+
+        // If write queue empty, attempt "optimistic write"
+        if (vSendMsg.size() == 1)
+            SocketSendData(this);
+    }
+
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
     void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
     {
@@ -513,30 +725,21 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        LogPrint("net", "(%d bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
 
-        LogPrint("net", "(%d bytes)\n", nSize);
-
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
-
-        // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
-            SocketSendData(this);
+        QueueSendMsg(FinalizeMessage(ssSend));
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queue a message built by SerializeMessage(); the buffer is shared, not copied
+    void PushSerializedMessage(const CSerializeDataRef& msg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: %s (%d bytes, shared)\n", SanitizeString(std::string(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE)), msg->size() - CMessageHeader::HEADER_SIZE);
+        QueueSendMsg(msg);
+    }
+
     void PushVersion();
 
 
@@ -795,13 +998,20 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+    static void GetTotalRecvQueueStats(std::vector<CRecvQueueStats>& vStats);
+    static void GetTotalMsgStats(msgstats_t& mapStats);
+    // -blocksonly savings
+    static void RecordInvIgnored();
+    static void RecordTxRejected(uint64_t nBytes);
+    static void RecordTxSkipped(uint64_t nBytes);
+    static CBlocksOnlyStats GetBlocksOnlyStats();
 };
 
 
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const uint256& hash, const CSerializeDataRef& msg);
 void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash, bool relayToAll=false);
 
 
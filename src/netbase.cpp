@@ -319,9 +319,10 @@ bool static Socks5(string strDest, int port, SOCKET& hSocket)
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+bool StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet, bool& fInProgressRet)
 {
     hSocketRet = INVALID_SOCKET;
+    fInProgressRet = false;
 
     struct sockaddr_storage sockaddr;
     socklen_t len = sizeof(sockaddr);
@@ -354,52 +355,87 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
     {
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
-        {
-            struct timeval timeout;
-            timeout.tv_sec  = nTimeout / 1000;
-            timeout.tv_usec = (nTimeout % 1000) * 1000;
-
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0)
-            {
-                LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR)
-            {
-                LogPrintf("select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
-                closesocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
+            fInProgressRet = true;
 #ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+        else if (WSAGetLastError() != WSAEISCONN)
 #else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+        else
 #endif
-            {
-                LogPrintf("getsockopt() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet != 0)
-            {
-                LogPrintf("connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
-                closesocket(hSocket);
-                return false;
-            }
+        {
+            LogPrintf("connect() to %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+            closesocket(hSocket);
+            return false;
         }
+    }
+
+    hSocketRet = hSocket;
+    return true;
+}
+
+bool CheckConnectSocket(SOCKET hSocket, int& nErrorRet)
+{
+    nErrorRet = 0;
+    socklen_t nErrorSize = sizeof(nErrorRet);
 #ifdef WIN32
-        else if (WSAGetLastError() != WSAEISCONN)
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nErrorRet), &nErrorSize) == SOCKET_ERROR)
 #else
-        else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nErrorRet, &nErrorSize) == SOCKET_ERROR)
 #endif
+    {
+        nErrorRet = WSAGetLastError();
+        return true;
+    }
+    if (nErrorRet != 0)
+        return true;
+
+    // No error yet: only a connected socket has a peer
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if (getpeername(hSocket, (struct sockaddr*)&sockaddr, &len) == SOCKET_ERROR)
+    {
+        if (WSAGetLastError() == WSAENOTCONN)
+            return false;
+        nErrorRet = WSAGetLastError();
+    }
+    return true;
+}
+
+bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    hSocketRet = INVALID_SOCKET;
+
+    SOCKET hSocket;
+    bool fInProgress;
+    if (!StartConnectSocket(addrConnect, hSocket, fInProgress))
+        return false;
+
+    if (fInProgress)
+    {
+        struct timeval timeout;
+        timeout.tv_sec  = nTimeout / 1000;
+        timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(hSocket, &fdset);
+        int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+        if (nRet == 0)
         {
-            LogPrintf("connect() to %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+            LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
+            closesocket(hSocket);
+            return false;
+        }
+        if (nRet == SOCKET_ERROR)
+        {
+            LogPrintf("select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+            closesocket(hSocket);
+            return false;
+        }
+        int nErr;
+        CheckConnectSocket(hSocket, nErr);
+        if (nErr != 0)
+        {
+            LogPrintf("connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nErr));
             closesocket(hSocket);
             return false;
         }
@@ -409,10 +445,10 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
     // CNode::ConnectNode immediately turns the socket back to non-blocking
     // but we'll turn it back to blocking just in case
 #ifdef WIN32
-    fNonblock = 0;
+    u_long fNonblock = 0;
     if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
 #else
-    fFlags = fcntl(hSocket, F_GETFL, 0);
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
     if (fcntl(hSocket, F_SETFL, fFlags & ~O_NONBLOCK) == SOCKET_ERROR)
 #endif
     {
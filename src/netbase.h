@@ -150,6 +150,14 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
+/**
+ * Open a non-blocking socket and start connecting it to addrConnect without
+ * waiting. fInProgressRet tells whether the connect is still pending; poll
+ * it with CheckConnectSocket once the socket reports writable or an error.
+ */
+bool StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet, bool& fInProgressRet);
+/** Returns false while a connect is still pending, otherwise nErrorRet is 0 if it succeeded */
+bool CheckConnectSocket(SOCKET hSocket, int& nErrorRet);
 /** Return readable error string for a network error code */
 std::string NetworkErrorString(int err);
 
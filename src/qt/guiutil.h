@@ -54,6 +54,8 @@ namespace GUIUtil
     QString formatDurationStr(int secs);
     /* Format a CNodeCombinedStats.dPingTime into a user-readable string or display N/A, if 0*/
     QString formatPingTime(double dPingTime);
+    /* Format a byte count with the largest unit it fills */
+    QString formatBytes(quint64 bytes);
     // Returns true if given address+amount meets "dust" definition
     QString getEntryData(QAbstractItemView *view, int column, int role);
     bool isDust(const QString& address, qint64 amount);
@@ -323,9 +323,9 @@ void MasternodeList::updateNodeList()
     ui->tableWidgetMasternodes->setSortingEnabled(false);
     ui->tableWidgetMasternodes->clearContents();
     ui->tableWidgetMasternodes->setRowCount(0);
-    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+    MasternodeSnapshot vMasternodes = mnodeman.GetMasternodeSnapshot();
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+    BOOST_FOREACH(const CMasternode& mn, *vMasternodes)
     {
         // populate list
         // Address, Protocol, Status, Active Seconds, Last Seen, Pub Key
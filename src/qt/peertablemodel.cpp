@@ -10,10 +10,65 @@
 
 #include "sync.h"
 
+#include <algorithm>
+#include <vector>
+
 #include <QDebug>
 #include <QList>
 #include <QTimer>
 
+/** Commands listed in the per-command tooltips */
+static const unsigned int TOOLTIP_MAX_COMMANDS = 10;
+
+static int64_t GetTotalHandlerTime(const CNodeStats& stats)
+{
+    int64_t nTime = 0;
+    for (msgstats_t::const_iterator it = stats.mapMsgStats.begin(); it != stats.mapMsgStats.end(); ++it)
+        nTime += it->second.nHandlerTime;
+    return nTime;
+}
+
+static uint64_t GetColumnValue(int column, const CMsgCommandStats& stats)
+{
+    switch(column)
+    {
+    case PeerTableModel::BytesSent:
+        return stats.nSendBytes;
+    case PeerTableModel::BytesRecv:
+        return stats.nRecvBytes;
+    case PeerTableModel::HandlerTime:
+        return stats.nHandlerTime;
+    }
+    return 0;
+}
+
+static bool CommandMoreThan(const std::pair<uint64_t, std::string>& left, const std::pair<uint64_t, std::string>& right)
+{
+    return left.first > right.first;
+}
+
+/* Biggest message commands of a peer by the traffic or time shown in a column */
+static QString FormatCommandBreakdown(int column, const CNodeStats& stats)
+{
+    std::vector<std::pair<uint64_t, std::string> > vCommands;
+    for (msgstats_t::const_iterator it = stats.mapMsgStats.begin(); it != stats.mapMsgStats.end(); ++it)
+    {
+        uint64_t nValue = GetColumnValue(column, it->second);
+        if (nValue > 0)
+            vCommands.push_back(std::make_pair(nValue, it->first));
+    }
+    std::sort(vCommands.begin(), vCommands.end(), CommandMoreThan);
+
+    QStringList lines;
+    for (unsigned int i = 0; i < vCommands.size() && i < TOOLTIP_MAX_COMMANDS; i++)
+    {
+        QString strValue = column == PeerTableModel::HandlerTime ?
+            QObject::tr("%1 ms").arg((quint64)(vCommands[i].first / 1000)) : GUIUtil::formatBytes(vCommands[i].first);
+        lines << QString("%1: %2").arg(QString::fromStdString(vCommands[i].second), strValue);
+    }
+    return lines.join("\n");
+}
+
 bool NodeLessThan::operator()(const CNodeCombinedStats &left, const CNodeCombinedStats &right) const
 {
     const CNodeStats *pLeft = &(left.nodeStats);
@@ -30,6 +85,12 @@ bool NodeLessThan::operator()(const CNodeCombinedStats &left, const CNodeCombine
         return pLeft->cleanSubVer.compare(pRight->cleanSubVer) < 0;
     case PeerTableModel::Ping:
         return pLeft->dPingTime < pRight->dPingTime;
+    case PeerTableModel::BytesSent:
+        return pLeft->nSendBytes < pRight->nSendBytes;
+    case PeerTableModel::BytesRecv:
+        return pLeft->nRecvBytes < pRight->nRecvBytes;
+    case PeerTableModel::HandlerTime:
+        return GetTotalHandlerTime(*pLeft) < GetTotalHandlerTime(*pRight);
     }
 
     return false;
@@ -114,7 +175,7 @@ PeerTableModel::PeerTableModel(ClientModel *parent) :
     clientModel(parent),
     timer(0)
 {
-    columns << tr("Node/Service") << tr("User Agent") << tr("Ping Time");
+    columns << tr("Node/Service") << tr("User Agent") << tr("Ping Time") << tr("Sent") << tr("Received") << tr("Handler Time");
     priv = new PeerTablePriv();
     // default to unsorted
     priv->sortColumn = -1;
@@ -166,9 +227,18 @@ QVariant PeerTableModel::data(const QModelIndex &index, int role) const
             return QString::fromStdString(rec->nodeStats.cleanSubVer);
         case Ping:
             return GUIUtil::formatPingTime(rec->nodeStats.dPingTime);
+        case BytesSent:
+            return GUIUtil::formatBytes(rec->nodeStats.nSendBytes);
+        case BytesRecv:
+            return GUIUtil::formatBytes(rec->nodeStats.nRecvBytes);
+        case HandlerTime:
+            return tr("%1 ms").arg((qint64)(GetTotalHandlerTime(rec->nodeStats) / 1000));
         }
+    } else if (role == Qt::ToolTipRole) {
+        if (index.column() == BytesSent || index.column() == BytesRecv || index.column() == HandlerTime)
+            return FormatCommandBreakdown(index.column(), rec->nodeStats);
     } else if (role == Qt::TextAlignmentRole) {
-        if (index.column() == Ping)
+        if (index.column() == Ping || index.column() == BytesSent || index.column() == BytesRecv || index.column() == HandlerTime)
             return (QVariant)(Qt::AlignRight | Qt::AlignVCenter);
     }
 
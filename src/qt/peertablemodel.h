@@ -54,7 +54,10 @@ public:
     enum ColumnIndex {
         Address = 0,
         Subversion = 1,
-        Ping = 2
+        Ping = 2,
+        BytesSent = 3,
+        BytesRecv = 4,
+        HandlerTime = 5
     };
 
     /** @name Methods overridden from QAbstractTableModel
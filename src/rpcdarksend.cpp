@@ -725,8 +725,8 @@ Value masternodelist(const Array& params, bool fHelp)
             obj.push_back(Pair(strAddr,       s.first));
         }
     } else {
-        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
-        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        MasternodeSnapshot vMasternodes = mnodeman.GetMasternodeSnapshot();
+        BOOST_FOREACH(const CMasternode& mn, *vMasternodes) {
             std::string strAddr = mn.addr.ToString();
             if (strMode == "activeseconds") {
                 if(strFilter !="" && strAddr.find(strFilter) == string::npos) continue;
@@ -178,30 +178,25 @@ Value setgenerate(const Array& params, bool fHelp)
     // -regtest mode: don't return until nGenProcLimit blocks are generated
     if (fGenerate && Params().NetworkID() == CChainParams::REGTEST)
     {
-        int nHeightStart = 0;
         int nHeightEnd = 0;
         int nHeight = 0;
         int nGenerate = (nGenProcLimit > 0 ? nGenProcLimit : 1);
         {   // Don't keep cs_main locked
             LOCK(cs_main);
-            nHeightStart = chainActive.Height();
-            nHeight = nHeightStart;
-            nHeightEnd = nHeightStart+nGenerate;
+            nHeight = chainActive.Height();
+            nHeightEnd = nHeight+nGenerate;
         }
-        int nHeightLast = -1;
+        // One miner session finds exactly nGenerate blocks, instead of restarting the miner for each
+        GenerateBitcoins(fGenerate, pwalletMain, 1, nGenerate);
         while (nHeight < nHeightEnd)
         {
-            if (nHeightLast != nHeight)
-            {
-                nHeightLast = nHeight;
-                GenerateBitcoins(fGenerate, pwalletMain, 1);
-            }
             MilliSleep(1);
             {   // Don't keep cs_main locked
                 LOCK(cs_main);
                 nHeight = chainActive.Height();
             }
         }
+        GenerateBitcoins(false, pwalletMain, 0);
     }
     else // Not -regtest: start generate thread, return immediately
     {
@@ -250,6 +245,13 @@ Value getmininginfo(const Array& params, bool fHelp)
             "  \"generate\": true|false     (boolean) If the generation is on or off (see getgenerate or setgenerate calls)\n"
             "  \"genproclimit\": n          (numeric) The processor limit for generation. -1 if no generation. (see getgenerate or setgenerate calls)\n"
             "  \"hashespersec\": n          (numeric) The hashes per second of the generation, or 0 if no generation.\n"
+            "  \"minerthreads\": [          (array) One entry per internal miner thread\n"
+            "    {\n"
+            "      \"hashes\": n,             (numeric) Hashes computed by this thread\n"
+            "      \"hashespersec\": n        (numeric) Recent hashes per second of this thread\n"
+            "    }\n"
+            "    ,...\n"
+            "  ],\n"
             "  \"pooledtx\": n              (numeric) The size of the mem pool\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
             "}\n"
@@ -271,6 +273,19 @@ Value getmininginfo(const Array& params, bool fHelp)
 #ifdef ENABLE_WALLET
     obj.push_back(Pair("generate",         getgenerate(params, false)));
     obj.push_back(Pair("hashespersec",     gethashespersec(params, false)));
+
+    std::vector<uint64_t> vHashes;
+    std::vector<double> vHashesPerSec;
+    GetMinerThreadStats(vHashes, vHashesPerSec);
+    Array threads;
+    for (unsigned int i = 0; i < vHashes.size(); i++)
+    {
+        Object thread;
+        thread.push_back(Pair("hashes",       vHashes[i]));
+        thread.push_back(Pair("hashespersec", (int64_t)vHashesPerSec[i]));
+        threads.push_back(thread);
+    }
+    obj.push_back(Pair("minerthreads",     threads));
 #endif
     return obj;
 }
@@ -402,6 +417,46 @@ Value getwork(const Array& params, bool fHelp)
 }
 #endif
 
+/** Seconds between mempool checks while a longpoll request is waiting for a better template */
+static const int LONGPOLL_CHECK_INTERVAL = 5;
+
+// Block template shared by all getblocktemplate callers, guarded by cs_main
+static unsigned int nTransactionsUpdatedLast;
+static CBlockIndex* pindexPrevCached;
+static int64_t nStart;
+static CBlockTemplate* pblocktemplateCached;
+
+/** Rebuild the cached template if the tip moved, or the mempool changed and it is more than a few seconds old. */
+static void UpdateCachedBlockTemplate()
+{
+    AssertLockHeld(cs_main);
+    if (pindexPrevCached != chainActive.Tip() ||
+        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    {
+        // Clear pindexPrevCached so future calls make a new block, despite any failures from here on
+        pindexPrevCached = NULL;
+
+        // Store the chainActive.Tip() used before CreateNewBlock, to avoid races
+        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        CBlockIndex* pindexPrevNew = chainActive.Tip();
+        nStart = GetTime();
+
+        // Create new block
+        if(pblocktemplateCached)
+        {
+            delete pblocktemplateCached;
+            pblocktemplateCached = NULL;
+        }
+        CScript scriptDummy = CScript() << OP_TRUE;
+        pblocktemplateCached = CreateNewBlock(scriptDummy);
+        if (!pblocktemplateCached)
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+
+        // Need to update only after we know CreateNewBlock succeeded
+        pindexPrevCached = pindexPrevNew;
+    }
+}
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -415,6 +470,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "1. \"jsonrequestobject\"       (string, optional) A json object in the following spec\n"
             "     {\n"
             "       \"mode\":\"template\"    (string, optional) This must be set to \"template\" or omitted\n"
+            "       \"longpollid\":\"xxxx\"  (string, optional) Delay the reply until the best block changes or the template improves, see BIP22\n"
             "       \"capabilities\":[       (array, optional) A list of strings\n"
             "           \"support\"           (string) client side supported feature, 'longpoll', 'coinbasetxn', 'coinbasevalue', 'proposal', 'serverlist', 'workid'\n"
             "           ,...\n"
@@ -444,6 +500,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "      \"flags\" : \"flags\"            (string) \n"
             "  },\n"
             "  \"coinbasevalue\" : n,               (numeric) maximum allowable input to coinbase transaction, including the generation award and transaction fees (in Satoshis)\n"
+            "  \"longpollid\" : \"xxxx\",           (string) id to pass back as \"longpollid\" to wait for a better template\n"
             "  \"coinbasetxn\" : { ... },           (json object) information for coinbase transaction\n"
             "  \"target\" : \"xxxx\",               (string) The hash target\n"
             "  \"mintime\" : xxx,                   (numeric) The minimum timestamp appropriate for next block time in seconds since epoch (Jan 1 1970 GMT)\n"
@@ -473,6 +530,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
          );
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -485,6 +543,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -496,36 +555,68 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Chaincoin is downloading blocks...");
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    if (lpval.type() != null_type)
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the chainActive.Tip() used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
+        // Wait to respond until either the best block changes, OR the template gets noticeably more valuable
+        uint256 hashWatchedChain;
+        unsigned int nTransactionsUpdatedLastLP;
+        int64_t nFeesWatched = 0;
+        {
+            LOCK(cs_main);
+            if (lpval.type() == str_type)
+            {
+                // Format: <hashBestChain><nTransactionsUpdatedLast>
+                std::string lpstr = lpval.get_str();
+                hashWatchedChain.SetHex(lpstr.substr(0, 64));
+                nTransactionsUpdatedLastLP = atoi64(lpstr.substr(64));
+            }
+            else
+            {
+                // NOTE: Spec does not specify behaviour for non-string longpollid, but this makes testing easier
+                hashWatchedChain = chainActive.Tip()->GetBlockHash();
+                nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
+            }
+            if (pblocktemplateCached && pindexPrevCached && pindexPrevCached->GetBlockHash() == hashWatchedChain)
+                nFeesWatched = -pblocktemplateCached->vTxFees[0];
+        }
 
-        // Create new block
-        if(pblocktemplate)
+        int64_t nWaitStart = GetTime();
+        while (!ShutdownRequested())
         {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
+            {
+                LOCK(cs_main);
+                if (chainActive.Tip()->GetBlockHash() != hashWatchedChain)
+                    break;
+                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
+                {
+                    // Only wake the miner when the refreshed template pays enough extra fees to be
+                    // worth switching work, or after a minute of mempool churn regardless
+                    UpdateCachedBlockTemplate();
+                    if (-pblocktemplateCached->vTxFees[0] >= nFeesWatched + CTransaction::nMinTxFee ||
+                        GetTime() - nWaitStart > 60)
+                        break;
+                }
+            }
+
+            // Wait with cs_main released; the tip is compared under csBestBlock, so a
+            // change between the check above and the wait is not missed
+            boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds(LONGPOLL_CHECK_INTERVAL);
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            while (hashBestBlock == hashWatchedChain)
+            {
+                if (!cvBlockChange.timed_wait(lock, timeout))
+                    break;
+            }
         }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
+        if (ShutdownRequested())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
     }
+
+    LOCK(cs_main);
+    UpdateCachedBlockTemplate();
+    CBlockTemplate* pblocktemplate = pblocktemplateCached;
+    CBlockIndex* pindexPrev = pindexPrevCached;
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
@@ -587,6 +678,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].GetValueOut()));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
@@ -625,6 +717,35 @@ Value getblocktemplate(const Array& params, bool fHelp)
     return result;
 }
 
+Value prioritisetransaction(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 3)
+        throw runtime_error(
+            "prioritisetransaction <txid> <priority delta> <fee delta>\n"
+            "Accepts the transaction into mined blocks at a higher (or lower) priority\n"
+            "\nArguments:\n"
+            "1. \"txid\"       (string, required) The transaction id.\n"
+            "2. priority delta (numeric, required) The priority to add or subtract.\n"
+            "                  The transaction selection algorithm considers the tx as it would have a higher priority.\n"
+            "                  (priority of a transaction is calculated: coinage * value_in_satoshis / txsize) \n"
+            "3. fee delta      (numeric, required) The fee value (in satoshis) to add (or subtract, if negative).\n"
+            "                  The fee is not actually paid, only the algorithm for selecting transactions into a block\n"
+            "                  considers the transaction as it would have paid a higher (or lower) fee.\n"
+            "\nResult\n"
+            "true              (boolean) Returns true\n"
+            "\nExamples:\n"
+            + HelpExampleCli("prioritisetransaction", "\"txid\" 0.0 10000")
+            + HelpExampleRpc("prioritisetransaction", "\"txid\", 0.0, 10000")
+        );
+
+    uint256 hash = ParseHashV(params[0], "txid");
+
+    int64_t nAmount = params[2].get_int64();
+
+    mempool.PrioritiseTransaction(hash, params[0].get_str(), params[1].get_real(), nAmount);
+    return true;
+}
+
 Value submitblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
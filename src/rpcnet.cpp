@@ -70,6 +70,34 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static Object RecvQueueStatsToJSON(const CRecvQueueStats& stats, const unsigned int* pnQueued)
+{
+    Object obj;
+    if (pnQueued)
+        obj.push_back(Pair("queued", (int)*pnQueued));
+    obj.push_back(Pair("processed", (uint64_t)stats.nMessages));
+    obj.push_back(Pair("avgdelay", stats.nMessages ? stats.nTotalDelay / 1000.0 / stats.nMessages : 0.0));
+    obj.push_back(Pair("maxdelay", stats.nMaxDelay / 1000.0));
+    return obj;
+}
+
+static Object MsgStatsToJSON(const msgstats_t& mapStats)
+{
+    Object obj;
+    for (msgstats_t::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CMsgCommandStats& stats = it->second;
+        Object cmd;
+        cmd.push_back(Pair("msgsrecv", stats.nRecvMessages));
+        cmd.push_back(Pair("bytesrecv", stats.nRecvBytes));
+        cmd.push_back(Pair("msgssent", stats.nSendMessages));
+        cmd.push_back(Pair("bytessent", stats.nSendBytes));
+        cmd.push_back(Pair("handlertime", stats.nHandlerTime / 1000.0));
+        obj.push_back(Pair(it->first, cmd));
+    }
+    return obj;
+}
+
 Value getpeerinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -95,6 +123,15 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"startingheight\": n,       (numeric) The starting height (block) of the peer\n"
             "    \"banscore\": n,              (numeric) The ban score (stats.nMisbehavior)\n"
             "    \"syncnode\" : true|false     (booleamn) if sync node\n"
+            "    \"recvqueue\": {             (json object) received messages by priority class (block, normal, gossip)\n"
+            "      \"block\": {\n"
+            "        \"queued\": n,             (numeric) Messages waiting to be processed\n"
+            "        \"processed\": n,          (numeric) Messages processed\n"
+            "        \"avgdelay\": n,           (numeric) Average time processed messages were queued, in milliseconds\n"
+            "        \"maxdelay\": n            (numeric) Longest time a processed message was queued, in milliseconds\n"
+            "      }, ...\n"
+            "    },\n"
+            "    \"msgstats\": { ... }        (json object) traffic and handler time by message command, as in getnetmsgstats\n"
             "  }\n"
             "  ,...\n"
             "}\n"
@@ -137,6 +174,12 @@ Value getpeerinfo(const Array& params, bool fHelp)
         }
         obj.push_back(Pair("syncnode", stats.fSyncNode));
 
+        Object recvqueue;
+        for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+            recvqueue.push_back(Pair(GetMessageClassName(nClass), RecvQueueStatsToJSON(stats.vRecvQueueStats[nClass], &stats.vRecvQueued[nClass])));
+        obj.push_back(Pair("recvqueue", recvqueue));
+        obj.push_back(Pair("msgstats", MsgStatsToJSON(stats.mapMsgStats)));
+
         ret.push_back(obj);
     }
 
@@ -321,7 +364,21 @@ Value getnettotals(const Array& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"recvqueue\": {         (json object) received messages of all peers by priority class\n"
+            "    \"block\": {\n"
+            "      \"processed\": n,    (numeric) Messages processed\n"
+            "      \"avgdelay\": n,     (numeric) Average time they were queued, in milliseconds\n"
+            "      \"maxdelay\": n      (numeric) Longest time one was queued, in milliseconds\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"blocksonly\": {        (json object) only with -blocksonly\n"
+            "    \"invsignored\": n,    (numeric) Transaction announcements not requested\n"
+            "    \"txsrejected\": n,    (numeric) Unsolicited transactions dropped\n"
+            "    \"bytesrejected\": n,  (numeric) Bytes of those transactions\n"
+            "    \"txsinblocks\": n,    (numeric) Block transactions never downloaded on their own\n"
+            "    \"bytessaved\": n      (numeric) Bytes of those transactions, an estimate of the relay traffic saved\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -332,9 +389,72 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    vector<CRecvQueueStats> vStats;
+    CNode::GetTotalRecvQueueStats(vStats);
+    Object recvqueue;
+    for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++)
+        recvqueue.push_back(Pair(GetMessageClassName(nClass), RecvQueueStatsToJSON(vStats[nClass], NULL)));
+    obj.push_back(Pair("recvqueue", recvqueue));
+
+    if (fBlocksOnly)
+    {
+        CBlocksOnlyStats stats = CNode::GetBlocksOnlyStats();
+        Object blocksonly;
+        blocksonly.push_back(Pair("invsignored", stats.nInvIgnored));
+        blocksonly.push_back(Pair("txsrejected", stats.nTxRejected));
+        blocksonly.push_back(Pair("bytesrejected", stats.nTxRejectedBytes));
+        blocksonly.push_back(Pair("txsinblocks", stats.nTxSkipped));
+        blocksonly.push_back(Pair("bytessaved", stats.nTxSkippedBytes));
+        obj.push_back(Pair("blocksonly", blocksonly));
+    }
     return obj;
 }
 
+Value getnetmsgstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getnetmsgstats ( nodeid )\n"
+            "\nReturns traffic and message handler time by message command, summed over all\n"
+            "peers since startup, or for one connected peer. Commands this node does not know\n"
+            "are summed under \"*other*\".\n"
+            "\nArguments:\n"
+            "1. nodeid      (numeric, optional) Only this peer, as in the id field of getpeerinfo\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"inv\": {             (json object) A message command\n"
+            "    \"msgsrecv\": n,     (numeric) Messages received\n"
+            "    \"bytesrecv\": n,    (numeric) Bytes received, headers included\n"
+            "    \"msgssent\": n,     (numeric) Messages sent\n"
+            "    \"bytessent\": n,    (numeric) Bytes sent, headers included\n"
+            "    \"handlertime\": n   (numeric) Wall-clock time spent processing received messages, in milliseconds.\n"
+            "                         Waits for locks the handler takes itself are included\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetmsgstats", "")
+            + HelpExampleCli("getnetmsgstats", "3")
+            + HelpExampleRpc("getnetmsgstats", "")
+       );
+
+    msgstats_t mapStats;
+    if (params.size() == 0)
+        CNode::GetTotalMsgStats(mapStats);
+    else
+    {
+        NodeId nodeid = params[0].get_int();
+        LOCK(cs_vNodes);
+        CNode* pnode = FindNode(nodeid);
+        if (!pnode)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Error: No connected peer with that id");
+        CNodeStats stats;
+        pnode->copyStats(stats);
+        mapStats = stats.mapMsgStats;
+    }
+    return MsgStatsToJSON(mapStats);
+}
+
 Value getnetworkinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
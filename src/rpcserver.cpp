@@ -236,6 +236,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
     { "getconnectioncount",     &getconnectioncount,     true,      false,      false },
     { "getnettotals",           &getnettotals,           true,      true,       false },
+    { "getnetmsgstats",         &getnetmsgstats,         true,      true,       false },
     { "getpeerinfo",            &getpeerinfo,            true,      false,      false },
     { "ping",                   &ping,                   true,      false,      false },
 
@@ -247,15 +248,17 @@ static const CRPCCommand vRPCCommands[] =
     { "getblockheader",         &getblockheader,         false,     false,      false },
     { "getblockhash",           &getblockhash,           false,     false,      false },
     { "getdifficulty",          &getdifficulty,          true,      false,      false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      true,       false },
     { "getrawmempool",          &getrawmempool,          true,      false,      false },
     { "gettxout",               &gettxout,               true,      false,      false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
     { "verifychain",            &verifychain,            true,      false,      false },
 
     /* Mining */
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,       false },
     { "getmininginfo",          &getmininginfo,          true,      false,      false },
     { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
+    { "prioritisetransaction",  &prioritisetransaction,  true,      false,      false },
     { "submitblock",            &submitblock,            false,     false,      false },
 
     /* Raw transactions */
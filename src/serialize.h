@@ -858,7 +858,7 @@ struct ser_streamplaceholder
 
 
 
-typedef std::vector<char, zero_after_free_allocator<char> > CSerializeData;
+typedef std::vector<char, serialize_allocator<char> > CSerializeData;
 
 /** Double ended buffer combining vector and stream-like interfaces.
  *
@@ -892,6 +892,11 @@ public:
         Init(nTypeIn, nVersionIn);
     }
 
+    CDataStream(int nTypeIn, int nVersionIn, const allocator_type& alloc) : vch(alloc)
+    {
+        Init(nTypeIn, nVersionIn);
+    }
+
     CDataStream(const_iterator pbegin, const_iterator pend, int nTypeIn, int nVersionIn) : vch(pbegin, pend)
     {
         Init(nTypeIn, nVersionIn);
@@ -958,6 +963,8 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity() - nReadPos; }
+    allocator_type get_allocator() const             { return vch.get_allocator(); }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
@@ -1151,6 +1158,12 @@ public:
     }
 
     void GetAndClear(CSerializeData &data) {
+        if (data.empty() && nReadPos == 0 && data.get_allocator() == vch.get_allocator()) {
+            // hand over the buffer instead of copying it
+            data.swap(vch);
+            clear();
+            return;
+        }
         data.insert(data.end(), begin(), end());
         clear();
     }
@@ -0,0 +1,267 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "sync.h"
+#include "util.h"
+
+#include <map>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+struct CSocketInterest
+{
+    void* pContext;
+    bool fRecv;
+    bool fSend;
+};
+
+/** Portable fallback: rebuilds the fd_sets from the registered sockets on every Wait(). */
+class CSelectSocketEvents : public CSocketEvents
+{
+private:
+    CCriticalSection cs;
+    std::map<SOCKET, CSocketInterest> mapSockets;
+
+public:
+    const char* GetName() const { return "select"; }
+
+    bool Add(SOCKET hSocket, void* pContext, bool fRecv, bool fSend)
+    {
+        LOCK(cs);
+#ifdef WIN32
+        if (mapSockets.size() >= FD_SETSIZE)
+            return false;
+#else
+        if (hSocket >= FD_SETSIZE)
+            return false;
+#endif
+        CSocketInterest& interest = mapSockets[hSocket];
+        interest.pContext = pContext;
+        interest.fRecv = fRecv;
+        interest.fSend = fSend;
+        return true;
+    }
+
+    void Modify(SOCKET hSocket, void* pContext, bool fRecv, bool fSend)
+    {
+        LOCK(cs);
+        std::map<SOCKET, CSocketInterest>::iterator it = mapSockets.find(hSocket);
+        if (it == mapSockets.end() || it->second.pContext != pContext)
+            return;
+        it->second.fRecv = fRecv;
+        it->second.fSend = fSend;
+    }
+
+    void Remove(SOCKET hSocket, void* pContext)
+    {
+        LOCK(cs);
+        std::map<SOCKET, CSocketInterest>::iterator it = mapSockets.find(hSocket);
+        if (it != mapSockets.end() && it->second.pContext == pContext)
+            mapSockets.erase(it);
+    }
+
+    bool Wait(int nTimeout, std::vector<Event>& vEvents)
+    {
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        std::vector<std::pair<SOCKET, void*> > vSockets;
+        {
+            LOCK(cs);
+            vSockets.reserve(mapSockets.size());
+            for (std::map<SOCKET, CSocketInterest>::const_iterator it = mapSockets.begin(); it != mapSockets.end(); ++it)
+            {
+                SOCKET hSocket = it->first;
+                FD_SET(hSocket, &fdsetError);
+                if (it->second.fRecv)
+                    FD_SET(hSocket, &fdsetRecv);
+                if (it->second.fSend)
+                    FD_SET(hSocket, &fdsetSend);
+                hSocketMax = max(hSocketMax, hSocket);
+                vSockets.push_back(make_pair(hSocket, it->second.pContext));
+            }
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec  = nTimeout / 1000;
+        timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+        if (vSockets.empty())
+        {
+            MilliSleep(nTimeout);
+            return true;
+        }
+
+        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        if (nSelect == SOCKET_ERROR)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i < vSockets.size(); i++)
+            {
+                Event event = { vSockets[i].first, vSockets[i].second, EVENT_RECV };
+                vEvents.push_back(event);
+            }
+            return false;
+        }
+
+        for (unsigned int i = 0; nSelect > 0 && i < vSockets.size(); i++)
+        {
+            SOCKET hSocket = vSockets[i].first;
+            int nEvents = 0;
+            if (FD_ISSET(hSocket, &fdsetRecv))
+                nEvents |= EVENT_RECV;
+            if (FD_ISSET(hSocket, &fdsetSend))
+                nEvents |= EVENT_SEND;
+            if (FD_ISSET(hSocket, &fdsetError))
+                nEvents |= EVENT_ERROR;
+            if (nEvents)
+            {
+                Event event = { hSocket, vSockets[i].second, nEvents };
+                vEvents.push_back(event);
+            }
+        }
+        return true;
+    }
+};
+
+#ifdef USE_EPOLL
+/** Edge-triggered epoll; the kernel keeps the interest set, so Wait() only costs per ready socket. */
+class CEpollSocketEvents : public CSocketEvents
+{
+private:
+    int fdEpoll;
+    CCriticalSection cs;
+    // epoll only hands back the descriptor, the context is looked up here
+    std::map<SOCKET, void*> mapContexts;
+    std::vector<struct epoll_event> vReady;
+
+    static uint32_t GetEpollEvents(bool fRecv, bool fSend)
+    {
+        return (uint32_t)EPOLLET | (fRecv ? (uint32_t)EPOLLIN : 0) | (fSend ? (uint32_t)EPOLLOUT : 0);
+    }
+
+public:
+    CEpollSocketEvents(int fdEpollIn) : fdEpoll(fdEpollIn), vReady(1024) {}
+
+    ~CEpollSocketEvents()
+    {
+        close(fdEpoll);
+    }
+
+    const char* GetName() const { return "epoll"; }
+
+    bool Add(SOCKET hSocket, void* pContext, bool fRecv, bool fSend)
+    {
+        LOCK(cs);
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = GetEpollEvents(fRecv, fSend);
+        event.data.fd = hSocket;
+        if (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0)
+        {
+            LogPrintf("epoll_ctl add failed: %s\n", NetworkErrorString(errno));
+            return false;
+        }
+        mapContexts[hSocket] = pContext;
+        return true;
+    }
+
+    void Modify(SOCKET hSocket, void* pContext, bool fRecv, bool fSend)
+    {
+        LOCK(cs);
+        std::map<SOCKET, void*>::iterator it = mapContexts.find(hSocket);
+        if (it == mapContexts.end() || it->second != pContext)
+            return;
+        // Re-arming also reports a socket that is already ready
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = GetEpollEvents(fRecv, fSend);
+        event.data.fd = hSocket;
+        if (epoll_ctl(fdEpoll, EPOLL_CTL_MOD, hSocket, &event) != 0)
+            LogPrint("net", "epoll_ctl modify failed: %s\n", NetworkErrorString(errno));
+    }
+
+    void Remove(SOCKET hSocket, void* pContext)
+    {
+        LOCK(cs);
+        std::map<SOCKET, void*>::iterator it = mapContexts.find(hSocket);
+        if (it == mapContexts.end() || it->second != pContext)
+            return;
+        mapContexts.erase(it);
+        epoll_ctl(fdEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+    }
+
+    bool Wait(int nTimeout, std::vector<Event>& vEvents)
+    {
+        int nReady = epoll_wait(fdEpoll, &vReady[0], vReady.size(), nTimeout);
+        if (nReady < 0)
+        {
+            if (errno == EINTR)
+                return true;
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(errno));
+            LOCK(cs);
+            for (std::map<SOCKET, void*>::const_iterator it = mapContexts.begin(); it != mapContexts.end(); ++it)
+            {
+                Event event = { it->first, it->second, EVENT_RECV };
+                vEvents.push_back(event);
+            }
+            return false;
+        }
+
+        LOCK(cs);
+        for (int i = 0; i < nReady; i++)
+        {
+            std::map<SOCKET, void*>::const_iterator it = mapContexts.find(vReady[i].data.fd);
+            if (it == mapContexts.end())
+                continue;
+            int nEvents = 0;
+            if (vReady[i].events & (EPOLLIN | EPOLLHUP))
+                nEvents |= EVENT_RECV;
+            if (vReady[i].events & EPOLLOUT)
+                nEvents |= EVENT_SEND;
+            if (vReady[i].events & EPOLLERR)
+                nEvents |= EVENT_ERROR;
+            Event event = { it->first, it->second, nEvents };
+            vEvents.push_back(event);
+        }
+        return true;
+    }
+};
+#endif
+
+}
+
+CSocketEvents* CreateSocketEvents(const std::string& strMode)
+{
+    if (strMode == "select")
+        return new CSelectSocketEvents();
+#ifdef USE_EPOLL
+    if (strMode == "epoll")
+    {
+        int fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (fdEpoll < 0)
+        {
+            LogPrintf("epoll_create1 failed: %s\n", NetworkErrorString(errno));
+            return NULL;
+        }
+        return new CEpollSocketEvents(fdEpoll);
+    }
+#endif
+    return NULL;
+}
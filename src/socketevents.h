@@ -0,0 +1,80 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#if defined(HAVE_CONFIG_H)
+#include "chaincoin-config.h"
+#endif
+
+#include "compat.h"
+
+#include <string>
+#include <vector>
+
+#if defined(HAVE_SYS_EPOLL_H) || (!defined(HAVE_CONFIG_H) && defined(__linux__))
+#define USE_EPOLL 1
+#endif
+
+/** Default for -socketevents */
+#ifdef USE_EPOLL
+static const char DEFAULT_SOCKETEVENTS[] = "epoll";
+#else
+static const char DEFAULT_SOCKETEVENTS[] = "select";
+#endif
+
+/**
+ * Readiness notification for the sockets serviced by ThreadSocketHandler.
+ *
+ * Sockets are registered once, with an opaque context the caller gets back
+ * with every event (the CNode, or NULL for listening sockets). Receive and
+ * send interest can be changed at any time from any thread.
+ *
+ * The epoll backend is edge-triggered: an event is only reported when a
+ * socket becomes ready, so the caller must keep track of sockets it has
+ * not read or written until they would block. The select backend is
+ * level-triggered but callers written for the edge-triggered case work
+ * with it unchanged.
+ */
+class CSocketEvents
+{
+public:
+    enum
+    {
+        EVENT_RECV = (1 << 0),
+        EVENT_SEND = (1 << 1),
+        EVENT_ERROR = (1 << 2),
+    };
+
+    struct Event
+    {
+        SOCKET hSocket;
+        void* pContext;
+        int nEvents;
+    };
+
+    virtual ~CSocketEvents() {}
+
+    virtual const char* GetName() const = 0;
+
+    /** Start watching hSocket. Returns false if this backend can not take it. */
+    virtual bool Add(SOCKET hSocket, void* pContext, bool fRecv, bool fSend) = 0;
+    /** Change the interest of a socket added with the same context. */
+    virtual void Modify(SOCKET hSocket, void* pContext, bool fRecv, bool fSend) = 0;
+    /** Stop watching a socket; must be called before it is closed. */
+    virtual void Remove(SOCKET hSocket, void* pContext) = 0;
+
+    /**
+     * Wait up to nTimeout milliseconds and append ready sockets to vEvents.
+     * Returns false on error, in which case every socket is reported as
+     * readable so the caller notices closed ones.
+     */
+    virtual bool Wait(int nTimeout, std::vector<Event>& vEvents) = 0;
+};
+
+/** Create the backend named by -socketevents ("epoll" or "select"), NULL if it is not available on this platform. */
+CSocketEvents* CreateSocketEvents(const std::string& strMode);
+
+#endif // BITCOIN_SOCKETEVENTS_H
@@ -0,0 +1,604 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "bignum.h"
+#include "hash.h"
+#include "main.h"
+#include "miner.h"
+#include "netbase.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <stdlib.h>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace json_spirit;
+using namespace std;
+
+/** Size in bytes of the per-connection extranonce prefix */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+/** Size in bytes of the extranonce part rolled by the miner */
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+/** Interval between checks for a new tip or mempool contents, in milliseconds */
+static const int64_t STRATUM_POLL_INTERVAL = 1000;
+/** Seconds before a changed mempool produces a new (non-clean) job */
+static const int64_t STRATUM_JOB_REFRESH_INTERVAL = 30;
+/** Number of jobs for the current tip still accepting shares */
+static const unsigned int MAX_STRATUM_JOBS = 16;
+/** Maximum length of a line received from a miner */
+static const size_t MAX_STRATUM_LINE_LENGTH = 16384;
+/** Seconds a share's nTime may be ahead of network-adjusted time, the same limit CheckBlock applies */
+static const int64_t STRATUM_MAX_FUTURE_TIME = 2 * 60 * 60;
+
+/** Stratum error codes, as used by existing pools */
+enum StratumErrorCode
+{
+    STRATUM_ERR_OTHER = 20,
+    STRATUM_ERR_JOB_NOT_FOUND = 21,
+    STRATUM_ERR_DUPLICATE_SHARE = 22,
+    STRATUM_ERR_LOW_DIFFICULTY = 23,
+    STRATUM_ERR_UNAUTHORIZED = 24,
+    STRATUM_ERR_NOT_SUBSCRIBED = 25,
+};
+
+/** A unit of work sent to miners: a block template with the coinbase split around the extranonce */
+struct CStratumJob
+{
+    CBlock block;
+    int nHeight;
+    int64_t nMinTime;
+    std::vector<unsigned char> vchCoinbase1;
+    std::vector<unsigned char> vchCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+    std::set<uint256> setSubmitted;
+};
+
+/** A connected miner */
+struct CStratumClient
+{
+    struct bufferevent *bev;
+    std::string strAddr;
+    std::vector<unsigned char> vchExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+    std::string strWorker;
+    uint64_t nSharesAccepted;
+    uint64_t nSharesRejected;
+
+    CStratumClient() : bev(NULL), fSubscribed(false), fAuthorized(false), nSharesAccepted(0), nSharesRejected(0) {}
+};
+
+// All state below is only touched from the stratum thread
+static struct event_base *stratumBase = NULL;
+static struct evconnlistener *stratumListener = NULL;
+static struct event *stratumTimer = NULL;
+static boost::thread stratumThread;
+
+static CScript scriptStratumPayout;
+static uint256 hashStratumShareTarget;
+static double dStratumDifficulty = DEFAULT_STRATUM_DIFFICULTY;
+static std::set<CStratumClient*> setStratumClients;
+static uint32_t nNextExtraNonce1 = 0;
+
+static std::map<unsigned int, CStratumJob> mapStratumJobs;
+static unsigned int nNextJobId = 1;
+static uint256 hashJobPrevBlock = 0;
+static unsigned int nJobTransactionsUpdated = 0;
+static int64_t nJobTime = 0;
+
+/** Thrown by request handlers, reported to the miner as [code, message, null] */
+class stratum_error : public std::runtime_error
+{
+public:
+    int nCode;
+
+    stratum_error(int nCodeIn, const std::string& strMessage) : std::runtime_error(strMessage), nCode(nCodeIn) {}
+};
+
+static Array StratumErrorArray(int nCode, const std::string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+static void SendStratumMessage(CStratumClient* client, const Object& message)
+{
+    std::string strMessage = write_string(Value(message), false) + "\n";
+    bufferevent_write(client->bev, strMessage.data(), strMessage.size());
+}
+
+static void SendStratumNotification(CStratumClient* client, const std::string& strMethod, const Array& params)
+{
+    Object notification;
+    notification.push_back(Pair("id", Value::null));
+    notification.push_back(Pair("method", strMethod));
+    notification.push_back(Pair("params", params));
+    SendStratumMessage(client, notification);
+}
+
+static void DisconnectStratumClient(CStratumClient* client)
+{
+    LogPrint("stratum", "stratum: disconnecting %s (%u shares accepted, %u rejected)\n",
+        client->strAddr, client->nSharesAccepted, client->nSharesRejected);
+    setStratumClients.erase(client);
+    bufferevent_free(client->bev);
+    delete client;
+}
+
+/** Stratum sends the previous block hash as eight byte-swapped 32-bit words */
+static std::string StratumPrevHash(const uint256& hash)
+{
+    std::vector<unsigned char> vch(hash.begin(), hash.end());
+    for (unsigned int i = 0; i < vch.size(); i += 4)
+        std::reverse(vch.begin() + i, vch.begin() + i + 4);
+    return HexStr(vch);
+}
+
+static std::string StratumHex32(uint32_t n)
+{
+    return strprintf("%08x", n);
+}
+
+static bool ParseStratumHex32(const Value& value, uint32_t& n)
+{
+    if (value.type() != str_type || value.get_str().size() != 8 || !IsHex(value.get_str()))
+        return false;
+    n = strtoul(value.get_str().c_str(), NULL, 16);
+    return true;
+}
+
+static Array StratumNotifyParams(unsigned int nJobId, const CStratumJob& job, bool fCleanJobs)
+{
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        branch.push_back(HexStr(hash.begin(), hash.end()));
+
+    Array params;
+    params.push_back(strprintf("%x", nJobId));
+    params.push_back(StratumPrevHash(job.block.hashPrevBlock));
+    params.push_back(HexStr(job.vchCoinbase1));
+    params.push_back(HexStr(job.vchCoinbase2));
+    params.push_back(branch);
+    params.push_back(StratumHex32(job.block.nVersion));
+    params.push_back(StratumHex32(job.block.nBits));
+    params.push_back(StratumHex32(job.block.nTime));
+    params.push_back(fCleanJobs);
+    return params;
+}
+
+/** Build a new job from a fresh block template and push it to every subscribed miner. */
+static bool UpdateStratumJob(bool fCleanJobs)
+{
+    CStratumJob job;
+    {
+        LOCK(cs_main);
+        unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        CBlockIndex* pindexPrev = chainActive.Tip();
+
+        unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptStratumPayout));
+        if (!pblocktemplate.get())
+            return false;
+        job.block = pblocktemplate->block;
+        job.nHeight = pindexPrev->nHeight + 1;
+        job.nMinTime = pindexPrev->GetMedianTimePast() + 1;
+
+        hashJobPrevBlock = pindexPrev->GetBlockHash();
+        nJobTransactionsUpdated = nTransactionsUpdated;
+        nJobTime = GetTime();
+    }
+
+    // Leave room in the coinbase for extranonce1 + extranonce2, then split the serialized
+    // transaction around it so the miner can splice in its own extranonce
+    CTransaction& txCoinbase = job.block.vtx[0];
+    CScript scriptHeight = CScript() << job.nHeight;
+    txCoinbase.vin[0].scriptSig = (CScript(scriptHeight) << std::vector<unsigned char>(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0)) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    CDataStream ssCoinbase(SER_NETWORK, PROTOCOL_VERSION);
+    ssCoinbase << txCoinbase;
+    std::vector<unsigned char> vchCoinbase(ssCoinbase.begin(), ssCoinbase.end());
+    // nVersion, vin count, prevout, scriptSig length, height push, extranonce push opcode
+    size_t nOffset = sizeof(txCoinbase.nVersion) + GetSizeOfCompactSize(1) + ::GetSerializeSize(txCoinbase.vin[0].prevout, SER_NETWORK, PROTOCOL_VERSION) +
+        GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + scriptHeight.size() + 1;
+    job.vchCoinbase1.assign(vchCoinbase.begin(), vchCoinbase.begin() + nOffset);
+    job.vchCoinbase2.assign(vchCoinbase.begin() + nOffset + STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, vchCoinbase.end());
+
+    job.block.BuildMerkleTree();
+    job.vMerkleBranch = job.block.GetMerkleBranch(0);
+
+    if (fCleanJobs)
+        mapStratumJobs.clear();
+    while (mapStratumJobs.size() >= MAX_STRATUM_JOBS)
+        mapStratumJobs.erase(mapStratumJobs.begin());
+    unsigned int nJobId = nNextJobId++;
+    const CStratumJob& jobNew = mapStratumJobs.insert(make_pair(nJobId, job)).first->second;
+
+    LogPrint("stratum", "stratum: new job %x height=%d txs=%u clean=%d\n", nJobId, jobNew.nHeight, jobNew.block.vtx.size(), fCleanJobs);
+    Array params = StratumNotifyParams(nJobId, jobNew, fCleanJobs);
+    BOOST_FOREACH(CStratumClient* client, setStratumClients)
+        if (client->fSubscribed)
+            SendStratumNotification(client, "mining.notify", params);
+    return true;
+}
+
+/** Rebuild the job when the tip moved, or periodically when the mempool changed. */
+static void CheckStratumJob()
+{
+    if (setStratumClients.empty() || IsInitialBlockDownload())
+        return;
+
+    bool fNewTip, fMempoolChanged;
+    {
+        LOCK(cs_main);
+        fNewTip = chainActive.Tip()->GetBlockHash() != hashJobPrevBlock;
+        fMempoolChanged = mempool.GetTransactionsUpdated() != nJobTransactionsUpdated;
+    }
+    if (fNewTip || mapStratumJobs.empty())
+        UpdateStratumJob(true);
+    else if (fMempoolChanged && GetTime() - nJobTime >= STRATUM_JOB_REFRESH_INTERVAL)
+        UpdateStratumJob(false);
+}
+
+static Value StratumSubmit(CStratumClient* client, const Array& params)
+{
+    if (!client->fSubscribed)
+        throw stratum_error(STRATUM_ERR_NOT_SUBSCRIBED, "Not subscribed");
+    if (!client->fAuthorized)
+        throw stratum_error(STRATUM_ERR_UNAUTHORIZED, "Unauthorized worker");
+    if (params.size() < 5 || params[1].type() != str_type || params[2].type() != str_type)
+        throw stratum_error(STRATUM_ERR_OTHER, "Invalid parameters");
+
+    std::map<unsigned int, CStratumJob>::iterator it = mapStratumJobs.find(strtoul(params[1].get_str().c_str(), NULL, 16));
+    if (it == mapStratumJobs.end())
+        throw stratum_error(STRATUM_ERR_JOB_NOT_FOUND, "Job not found");
+    CStratumJob& job = it->second;
+
+    std::vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+    uint32_t nTime, nNonce;
+    if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE || !ParseStratumHex32(params[3], nTime) || !ParseStratumHex32(params[4], nNonce))
+        throw stratum_error(STRATUM_ERR_OTHER, "Invalid parameters");
+    if ((int64_t)nTime < job.nMinTime || (int64_t)nTime > GetAdjustedTime() + STRATUM_MAX_FUTURE_TIME)
+    {
+        client->nSharesRejected++;
+        throw stratum_error(STRATUM_ERR_OTHER, "Time out of range");
+    }
+
+    // Reassemble the coinbase and the header; the full block is only built for solutions
+    std::vector<unsigned char> vchCoinbase(job.vchCoinbase1);
+    vchCoinbase.insert(vchCoinbase.end(), client->vchExtraNonce1.begin(), client->vchExtraNonce1.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    vchCoinbase.insert(vchCoinbase.end(), job.vchCoinbase2.begin(), job.vchCoinbase2.end());
+    CTransaction txCoinbase;
+    CDataStream ssCoinbase(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION);
+    ssCoinbase >> txCoinbase;
+
+    CBlockHeader header = job.block.GetBlockHeader();
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), job.vMerkleBranch, 0);
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+    uint256 hash = HashC11(BEGIN(header.nVersion), END(header.nNonce));
+
+    uint256 hashTarget = CBigNum().SetCompact(header.nBits).getuint256();
+    if (hash > hashTarget && hash > hashStratumShareTarget)
+    {
+        client->nSharesRejected++;
+        throw stratum_error(STRATUM_ERR_LOW_DIFFICULTY, "Low difficulty share");
+    }
+
+    // Only shares that meet the target are remembered, so the set grows no faster than real work
+    if (!job.setSubmitted.insert(hash).second)
+    {
+        client->nSharesRejected++;
+        throw stratum_error(STRATUM_ERR_DUPLICATE_SHARE, "Duplicate share");
+    }
+    client->nSharesAccepted++;
+
+    if (hash <= hashTarget)
+    {
+        CBlock block(job.block);
+        block.vtx[0] = txCoinbase;
+        block.hashMerkleRoot = header.hashMerkleRoot;
+        block.nTime = header.nTime;
+        block.nNonce = header.nNonce;
+
+        LogPrintf("stratum: block found by %s (%s)\n  hash: %s\ntarget: %s\n", client->strWorker, client->strAddr, hash.GetHex(), hashTarget.GetHex());
+        bool fAccepted;
+        {
+            LOCK(cs_main);
+            CValidationState state;
+            fAccepted = ProcessBlock(state, NULL, &block);
+        }
+        if (!fAccepted)
+        {
+            LogPrintf("stratum: ProcessBlock, block not accepted\n");
+            throw stratum_error(STRATUM_ERR_OTHER, "Block rejected");
+        }
+
+        // Move miners onto the new tip right away instead of waiting for the poll timer
+        CheckStratumJob();
+    }
+    return true;
+}
+
+static Value StratumSubscribe(CStratumClient* client, const Array& params)
+{
+    client->fSubscribed = true;
+
+    Array subscription1, subscription2, subscriptions;
+    std::string strSessionId = HexStr(client->vchExtraNonce1);
+    subscription1.push_back("mining.set_difficulty");
+    subscription1.push_back(strSessionId);
+    subscription2.push_back("mining.notify");
+    subscription2.push_back(strSessionId);
+    subscriptions.push_back(subscription1);
+    subscriptions.push_back(subscription2);
+
+    Array result;
+    result.push_back(subscriptions);
+    result.push_back(HexStr(client->vchExtraNonce1));
+    result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+    return result;
+}
+
+static Value StratumAuthorize(CStratumClient* client, const Array& params)
+{
+    if (params.size() < 1 || params[0].type() != str_type)
+        throw stratum_error(STRATUM_ERR_OTHER, "Invalid parameters");
+
+    // Blocks always pay -stratumaddress, the worker name is only used for logging
+    client->fAuthorized = true;
+    client->strWorker = params[0].get_str();
+    LogPrint("stratum", "stratum: %s authorized as %s\n", client->strAddr, client->strWorker);
+    return true;
+}
+
+/** Handle one JSON request line. Returns false if the client should be disconnected. */
+static bool ProcessStratumLine(CStratumClient* client, const std::string& strLine)
+{
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type)
+        return false;
+    const Object& request = valRequest.get_obj();
+    const Value& id = find_value(request, "id");
+    const Value& method = find_value(request, "method");
+    const Value& valParams = find_value(request, "params");
+    if (method.type() != str_type)
+        return false;
+    Array params;
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+
+    const std::string& strMethod = method.get_str();
+    LogPrint("stratum", "stratum: %s from %s\n", strMethod, client->strAddr);
+
+    Value result;
+    Value error;
+    try
+    {
+        if (strMethod == "mining.subscribe")
+            result = StratumSubscribe(client, params);
+        else if (strMethod == "mining.authorize")
+            result = StratumAuthorize(client, params);
+        else if (strMethod == "mining.submit")
+            result = StratumSubmit(client, params);
+        else
+            throw stratum_error(STRATUM_ERR_OTHER, "Method not found");
+    }
+    catch (stratum_error& e)
+    {
+        error = StratumErrorArray(e.nCode, e.what());
+    }
+    catch (std::exception& e)
+    {
+        error = StratumErrorArray(STRATUM_ERR_OTHER, e.what());
+    }
+
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    SendStratumMessage(client, reply);
+
+    if (strMethod == "mining.subscribe")
+    {
+        // Hand out the difficulty and the current work straight away
+        Array difficulty;
+        difficulty.push_back(dStratumDifficulty);
+        SendStratumNotification(client, "mining.set_difficulty", difficulty);
+
+        CheckStratumJob();
+        if (!mapStratumJobs.empty())
+            SendStratumNotification(client, "mining.notify", StratumNotifyParams(mapStratumJobs.rbegin()->first, mapStratumJobs.rbegin()->second, true));
+    }
+    return true;
+}
+
+static void StratumReadCB(struct bufferevent *bev, void *ctx)
+{
+    CStratumClient* client = (CStratumClient*)ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t n_read_out = 0;
+    char *line;
+    while ((line = evbuffer_readln(input, &n_read_out, EVBUFFER_EOL_CRLF)) != NULL)
+    {
+        std::string strLine(line, n_read_out);
+        free(line);
+        if (strLine.empty())
+            continue;
+        if (!ProcessStratumLine(client, strLine))
+        {
+            DisconnectStratumClient(client);
+            return;
+        }
+    }
+    if (evbuffer_get_length(input) > MAX_STRATUM_LINE_LENGTH)
+    {
+        LogPrint("stratum", "stratum: line from %s too long\n", client->strAddr);
+        DisconnectStratumClient(client);
+    }
+}
+
+static void StratumEventCB(struct bufferevent *bev, short what, void *ctx)
+{
+    if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+        DisconnectStratumClient((CStratumClient*)ctx);
+}
+
+static void StratumAcceptCB(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *address, int socklen, void *ctx)
+{
+    CService addr;
+    addr.SetSockAddr(address);
+
+    CStratumClient* client = new CStratumClient();
+    client->strAddr = addr.ToString();
+    uint32_t nExtraNonce1 = nNextExtraNonce1++;
+    client->vchExtraNonce1.assign((unsigned char*)&nExtraNonce1, (unsigned char*)&nExtraNonce1 + STRATUM_EXTRANONCE1_SIZE);
+    client->bev = bufferevent_socket_new(stratumBase, fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(client->bev, StratumReadCB, NULL, StratumEventCB, client);
+    bufferevent_enable(client->bev, EV_READ|EV_WRITE);
+    setStratumClients.insert(client);
+    LogPrint("stratum", "stratum: accepted connection from %s\n", client->strAddr);
+}
+
+static void StratumTimerCB(evutil_socket_t fd, short what, void *arg)
+{
+    try
+    {
+        CheckStratumJob();
+    }
+    catch (std::exception& e)
+    {
+        LogPrintf("stratum: failed to update job: %s\n", e.what());
+    }
+}
+
+static void StratumThread()
+{
+    event_base_dispatch(stratumBase);
+
+    BOOST_FOREACH(CStratumClient* client, setStratumClients)
+    {
+        bufferevent_free(client->bev);
+        delete client;
+    }
+    setStratumClients.clear();
+    mapStratumJobs.clear();
+}
+
+bool StartStratumServer(std::string& strError)
+{
+    assert(!stratumBase);
+
+    CBitcoinAddress address(GetArg("-stratumaddress", ""));
+    if (!address.IsValid())
+    {
+        strError = _("-stratum requires a valid -stratumaddress to pay mined blocks to");
+        return false;
+    }
+    scriptStratumPayout.SetDestination(address.Get());
+
+    dStratumDifficulty = atof(GetArg("-stratumdifficulty", strprintf("%g", DEFAULT_STRATUM_DIFFICULTY)).c_str());
+    if (dStratumDifficulty <= 0)
+    {
+        strError = strprintf(_("Invalid -stratumdifficulty=<n>: '%s'"), mapArgs["-stratumdifficulty"]);
+        return false;
+    }
+    // Difficulty 1 is the classic 0x1d00ffff target; very low difficulties saturate at the maximum target
+    CBigNum bnShareTarget = CBigNum().SetCompact(0x1d00ffff) * CBigNum(COIN) / CBigNum(std::max((int64_t)1, (int64_t)(dStratumDifficulty * COIN)));
+    if (bnShareTarget > CBigNum(~uint256(0)))
+        bnShareTarget = CBigNum(~uint256(0));
+    hashStratumShareTarget = bnShareTarget.getuint256();
+
+    CService addrBind;
+    std::string strBind = GetArg("-stratumbind", "127.0.0.1");
+    if (!Lookup(strBind.c_str(), addrBind, GetArg("-stratumport", DEFAULT_STRATUM_PORT), false))
+    {
+        strError = strprintf(_("Cannot resolve -stratumbind address: '%s'"), strBind);
+        return false;
+    }
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if (!addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len))
+    {
+        strError = strprintf(_("Error: bind address family for %s not supported"), addrBind.ToString());
+        return false;
+    }
+
+#ifdef WIN32
+    evthread_use_windows_threads();
+#else
+    evthread_use_pthreads();
+#endif
+    stratumBase = event_base_new();
+    if (!stratumBase)
+    {
+        strError = _("Unable to create event base for the stratum server");
+        return false;
+    }
+
+    stratumListener = evconnlistener_new_bind(stratumBase, StratumAcceptCB, NULL,
+        LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1, (struct sockaddr*)&sockaddr, len);
+    if (!stratumListener)
+    {
+        strError = strprintf(_("Unable to bind to %s on this computer for the stratum server"), addrBind.ToString());
+        event_base_free(stratumBase);
+        stratumBase = NULL;
+        return false;
+    }
+
+    stratumTimer = event_new(stratumBase, -1, EV_PERSIST, StratumTimerCB, NULL);
+    struct timeval time = MillisToTimeval(STRATUM_POLL_INTERVAL);
+    event_add(stratumTimer, &time);
+
+    LogPrintf("stratum: listening on %s, difficulty %g, paying to %s\n", addrBind.ToString(), dStratumDifficulty, address.ToString());
+    stratumThread = boost::thread(boost::bind(&TraceThread<void (*)()>, "stratum", &StratumThread));
+    return true;
+}
+
+void InterruptStratumServer()
+{
+    if (stratumBase)
+    {
+        LogPrintf("stratum: Thread interrupt\n");
+        event_base_loopbreak(stratumBase);
+    }
+}
+
+void StopStratumServer()
+{
+    if (stratumBase)
+    {
+        stratumThread.join();
+        event_free(stratumTimer);
+        stratumTimer = NULL;
+        evconnlistener_free(stratumListener);
+        stratumListener = NULL;
+        event_base_free(stratumBase);
+        stratumBase = NULL;
+    }
+}
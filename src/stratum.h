@@ -0,0 +1,25 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/**
+ * Built-in Stratum v1 mining endpoint.
+ */
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <string>
+
+/** Default for -stratum */
+static const bool DEFAULT_STRATUM = false;
+/** Default for -stratumport */
+static const unsigned short DEFAULT_STRATUM_PORT = 3333;
+/** Default for -stratumdifficulty, the share difficulty handed to miners */
+static const double DEFAULT_STRATUM_DIFFICULTY = 1.0;
+
+/** Start listening for Stratum miners, paying blocks to -stratumaddress. Returns false and sets strError on failure. */
+bool StartStratumServer(std::string& strError);
+void InterruptStratumServer();
+void StopStratumServer();
+
+#endif /* BITCOIN_STRATUM_H */
@@ -101,6 +101,50 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
+static void ReceiveAndProcess(CNode& node, const CSerializeDataRef& msg)
+{
+    LOCK(node.cs_vRecvMsg);
+    BOOST_REQUIRE(node.ReceiveMsgBytes(&(*msg)[0], msg->size()));
+    ProcessMessages(&node);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_blocksonly)
+{
+    CNode::ClearBanned();
+    fBlocksOnly = true;
+    CAddress addr(ip(0xa0b0c001));
+    CNode dummyNode(INVALID_SOCKET, addr, "", true);
+    dummyNode.nVersion = PROTOCOL_VERSION;
+    CBlocksOnlyStats statsBefore = CNode::GetBlocksOnlyStats();
+
+    // Transaction invs are not requested, and are not held against the peer
+    std::vector<CInv> vInv;
+    vInv.push_back(CInv(MSG_TX, GetRandHash()));
+    ReceiveAndProcess(dummyNode, SerializeMessage("inv", vInv));
+    BOOST_CHECK(dummyNode.mapAskFor.empty());
+    BOOST_CHECK_EQUAL(CNode::GetBlocksOnlyStats().nInvIgnored, statsBefore.nInvIgnored + 1);
+    CNodeStateStats state;
+    BOOST_REQUIRE(GetNodeStateStats(dummyNode.GetId(), state));
+    BOOST_CHECK_EQUAL(state.nMisbehavior, 0);
+
+    // An unsolicited transaction is dropped and costs the peer 10 points
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey << OP_1;
+    ReceiveAndProcess(dummyNode, SerializeMessage("tx", tx));
+    BOOST_CHECK(!mempool.exists(tx.GetHash()));
+    BOOST_CHECK(!mapOrphanTransactions.count(tx.GetHash()));
+    BOOST_CHECK_EQUAL(CNode::GetBlocksOnlyStats().nTxRejected, statsBefore.nTxRejected + 1);
+    BOOST_REQUIRE(GetNodeStateStats(dummyNode.GetId(), state));
+    BOOST_CHECK_EQUAL(state.nMisbehavior, 10);
+
+    fBlocksOnly = DEFAULT_BLOCKSONLY;
+}
+
 static bool CheckNBits(unsigned int nbits1, int64_t time1, unsigned int nbits2, int64_t time2)\
 {
     if (time1 > time2)
@@ -2,6 +2,8 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "allocators.h"
+#include "serialize.h"
 #include "util.h"
 
 #include <boost/test/unit_test.hpp>
@@ -114,4 +116,34 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(buffer_pool)
+{
+    BufferPool& pool = BufferPool::Instance();
+
+    // A released block is handed out again for any request of the same class
+    void* p = pool.Allocate(3000);
+    size_t nCached = pool.GetCachedBytes();
+    pool.Free(p, 3000);
+    BOOST_CHECK_EQUAL(pool.GetCachedBytes(), nCached + 4096);
+    BOOST_CHECK(pool.Allocate(2049) == p);
+    BOOST_CHECK_EQUAL(pool.GetCachedBytes(), nCached);
+    pool.Free(p, 2049);
+
+    // Requests past the largest class are not kept
+    nCached = pool.GetCachedBytes();
+    p = pool.Allocate((1 << BufferPool::MAX_CLASS_BITS) + 1);
+    pool.Free(p, (1 << BufferPool::MAX_CLASS_BITS) + 1);
+    BOOST_CHECK_EQUAL(pool.GetCachedBytes(), nCached);
+
+    // Pooled and clearing vectors copy their own kind of allocator
+    CSerializeData vPooled(serialize_allocator<char>(true));
+    vPooled.assign(100, 'x');
+    CSerializeData vCopy(vPooled);
+    BOOST_CHECK(vCopy.get_allocator().fPooled);
+    BOOST_CHECK(vCopy == vPooled);
+    CSerializeData vPlain;
+    BOOST_CHECK(!vPlain.get_allocator().fPooled);
+    BOOST_CHECK(vPlain.get_allocator() != vPooled.get_allocator());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 #include "base58.h"
 #include "key.h"
 #include "main.h"
+#include "protocol.h"
 #include "serialize.h"
 #include "uint256.h"
 #include "util.h"
@@ -451,4 +452,41 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+static vector<CInv> RandomInvs(int nCount)
+{
+    vector<CInv> vInv;
+    for (int i = 0; i < nCount; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+    return vInv;
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    CRollingBloomFilter rb(100, 0.001, 0);
+    vector<CInv> vInv = RandomInvs(399);
+
+    for (unsigned int i = 0; i < vInv.size(); i++) {
+        rb.insert(vInv[i]);
+        // The last 100 items inserted are always found
+        for (unsigned int j = (i < 100 ? 0 : i - 99); j <= i; j++)
+            BOOST_CHECK(rb.contains(vInv[j]));
+    }
+
+    // Others only by chance
+    int nFalsePositives = 0;
+    BOOST_FOREACH(const CInv& inv, RandomInvs(10000))
+        if (rb.contains(inv))
+            nFalsePositives++;
+    BOOST_CHECK(nFalsePositives < 100);
+
+    // The type is part of the key
+    CRollingBloomFilter rbTyped(10, 0.000001, 0);
+    rbTyped.insert(vInv[0]);
+    BOOST_CHECK(rbTyped.contains(vInv[0]));
+    BOOST_CHECK(!rbTyped.contains(CInv(MSG_TXLOCK_REQUEST, vInv[0].hash)));
+
+    rb.clear();
+    BOOST_CHECK(!rb.contains(vInv.back()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,240 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "darksend.h"
+#include "main.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "util.h"
+
+#include <list>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+// Extend pindexFork by nBlocks fake block indexes with random hashes
+static CBlockIndex* ExtendChain(CBlockIndex* pindexFork, int nBlocks, list<uint256>& hashes, list<CBlockIndex>& indexes)
+{
+    CBlockIndex* pindex = pindexFork;
+    for (int i = 0; i < nBlocks; i++) {
+        hashes.push_back(GetRandHash());
+        indexes.push_back(CBlockIndex());
+        CBlockIndex* pnext = &indexes.back();
+        pnext->phashBlock = &hashes.back();
+        pnext->pprev = pindex;
+        pnext->nHeight = pindex->nHeight + 1;
+        pindex = pnext;
+    }
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(masternode_blockhash_reorg)
+{
+    CBlockIndex* pindexOldTip = chainActive.Tip();
+    BOOST_REQUIRE(pindexOldTip != NULL);
+
+    list<uint256> hashes;
+    list<CBlockIndex> indexes;
+    uint256 hash;
+
+    CBlockIndex* pindexA = ExtendChain(chainActive.Genesis(), 20, hashes, indexes);
+    chainActive.SetTip(pindexA);
+
+    // nBlockHeight selects the block before it, and the genesis block is never used
+    BOOST_CHECK(GetBlockHash(hash, 21));
+    BOOST_CHECK(hash == pindexA->GetBlockHash());
+    BOOST_CHECK(GetBlockHash(hash, 11));
+    BOOST_CHECK(hash == chainActive[10]->GetBlockHash());
+    BOOST_CHECK(GetBlockHash(hash, 0));
+    BOOST_CHECK(hash == pindexA->pprev->GetBlockHash());
+    BOOST_CHECK(!GetBlockHash(hash, 1));
+    BOOST_CHECK(!GetBlockHash(hash, 22));
+
+    uint256 hashA6 = chainActive[6]->GetBlockHash();
+    uint256 hashA10 = chainActive[10]->GetBlockHash();
+    uint256 hashA15 = chainActive[15]->GetBlockHash();
+
+    // Reorg to a longer branch forking off at height 10
+    CBlockIndex* pindexB = ExtendChain(chainActive[10], 15, hashes, indexes);
+    chainActive.SetTip(pindexB);
+
+    BOOST_CHECK(GetBlockHash(hash, 11));
+    BOOST_CHECK(hash == hashA10);
+    BOOST_CHECK(GetBlockHash(hash, 16));
+    BOOST_CHECK(hash != hashA15);
+    BOOST_CHECK(hash == chainActive[15]->GetBlockHash());
+    BOOST_CHECK(GetBlockHash(hash, 26));
+    BOOST_CHECK(hash == pindexB->GetBlockHash());
+
+    // Reorg back to a shorter branch: heights past its tip are unknown again
+    CBlockIndex* pindexC = ExtendChain(chainActive[5], 3, hashes, indexes);
+    chainActive.SetTip(pindexC);
+
+    BOOST_CHECK(!GetBlockHash(hash, 16));
+    BOOST_CHECK(GetBlockHash(hash, 9));
+    BOOST_CHECK(hash == pindexC->GetBlockHash());
+    BOOST_CHECK(GetBlockHash(hash, 7));
+    BOOST_CHECK(hash != hashA6);
+    BOOST_CHECK(hash == chainActive[6]->GetBlockHash());
+
+    chainActive.SetTip(pindexOldTip);
+}
+
+static CMasternode MakeMasternode(int i)
+{
+    std::vector<unsigned char> vchPubKey(33);
+    vchPubKey[0] = 0x02;
+    uint256 hashKey = GetRandHash();
+    memcpy(&vchPubKey[1], hashKey.begin(), 32);
+    CPubKey pubkey(vchPubKey);
+
+    // routable, so the entries are also served in list diffs
+    CService addr(strprintf("1.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff), 11994);
+    CTxIn vin(GetRandHash(), i % 4);
+    CMasternode mn(addr, vin, pubkey, std::vector<unsigned char>(), GetAdjustedTime(), pubkey, PROTOCOL_VERSION, CScript(), 0);
+    mn.UpdateLastSeen();
+    return mn;
+}
+
+BOOST_AUTO_TEST_CASE(masternode_registry)
+{
+    const int nMasternodes = 200;
+
+    CBlockIndex* pindexOldTip = chainActive.Tip();
+    list<uint256> hashes;
+    list<CBlockIndex> indexes;
+    chainActive.SetTip(ExtendChain(chainActive.Genesis(), 10, hashes, indexes));
+
+    CMasternodeMan man;
+    std::vector<CMasternode> vMasternodes;
+    for (int i = 0; i < nMasternodes; i++)
+        vMasternodes.push_back(MakeMasternode(i));
+
+    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+        BOOST_CHECK(man.Add(mn));
+    BOOST_CHECK_EQUAL(man.size(), nMasternodes);
+    BOOST_CHECK(!man.Add(vMasternodes[0]));
+
+    // Every entry is found by collateral, pubkey and address
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        CMasternode* pmn = man.Find(mn.vin);
+        BOOST_REQUIRE(pmn != NULL);
+        BOOST_CHECK(pmn->vin.prevout == mn.vin.prevout);
+        pmn = man.Find(mn.pubkey2);
+        BOOST_REQUIRE(pmn != NULL);
+        BOOST_CHECK(pmn->vin.prevout == mn.vin.prevout);
+        pmn = man.Find(mn.addr);
+        BOOST_REQUIRE(pmn != NULL);
+        BOOST_CHECK(pmn->vin.prevout == mn.vin.prevout);
+    }
+
+    // Ranks are a permutation of 1..n
+    std::vector<bool> vRankSeen(nMasternodes + 1, false);
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        int nRank = man.GetMasternodeRank(mn.vin, 5);
+        BOOST_REQUIRE(nRank >= 1 && nRank <= nMasternodes);
+        BOOST_CHECK(!vRankSeen[nRank]);
+        vRankSeen[nRank] = true;
+    }
+    BOOST_CHECK(man.GetMasternodeByRank(1, 5) == man.GetCurrentMasterNode(1, 5));
+
+    // Readers share one snapshot until the list changes
+    MasternodeSnapshot snapshot1 = man.GetMasternodeSnapshot();
+    MasternodeSnapshot snapshot2 = man.GetMasternodeSnapshot();
+    BOOST_CHECK(snapshot1 == snapshot2);
+    BOOST_CHECK_EQUAL(snapshot1->size(), (unsigned int)nMasternodes);
+
+    // Removal drops every index entry
+    for (int i = 0; i < nMasternodes; i += 2)
+        man.Remove(vMasternodes[i].vin);
+    BOOST_CHECK_EQUAL(man.size(), nMasternodes / 2);
+    BOOST_CHECK(man.Find(vMasternodes[0].vin) == NULL);
+    BOOST_CHECK(man.Find(vMasternodes[0].pubkey2) == NULL);
+    BOOST_CHECK(man.Find(vMasternodes[0].addr) == NULL);
+    BOOST_CHECK(man.Find(vMasternodes[1].addr) != NULL);
+    BOOST_CHECK(man.GetMasternodeSnapshot() != snapshot1);
+    BOOST_CHECK_EQUAL(snapshot1->size(), (unsigned int)nMasternodes);
+
+    chainActive.SetTip(pindexOldTip);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_list_diff)
+{
+    CMasternodeMan man;
+    std::vector<CMasternode> vMasternodes;
+    for (int i = 0; i < 4; i++)
+        vMasternodes.push_back(MakeMasternode(i));
+
+    std::vector<CMasternodeListEntry> vEntries;
+    std::vector<COutPoint> vRemoved;
+    uint256 hashEmpty = man.GetListHash();
+    BOOST_CHECK(man.Add(vMasternodes[0]));
+    BOOST_CHECK(man.Add(vMasternodes[1]));
+    BOOST_CHECK(man.Add(vMasternodes[2]));
+    uint256 hashBase = man.GetListHash();
+    BOOST_CHECK(hashBase != hashEmpty);
+
+    // An unknown base gets the full list, the current one an empty diff
+    BOOST_CHECK(!man.GetListDiff(GetRandHash(), vEntries, vRemoved));
+    BOOST_CHECK_EQUAL(vEntries.size(), 3U);
+    BOOST_CHECK(vRemoved.empty());
+    vEntries.clear();
+    BOOST_CHECK(man.GetListDiff(hashBase, vEntries, vRemoved));
+    BOOST_CHECK(vEntries.empty());
+    BOOST_CHECK(vRemoved.empty());
+
+    // The diff from the base holds the added entry and the removed collateral only
+    man.Remove(vMasternodes[0].vin);
+    BOOST_CHECK(man.Add(vMasternodes[3]));
+    BOOST_CHECK(man.GetListDiff(hashBase, vEntries, vRemoved));
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 1U);
+    BOOST_CHECK(vEntries[0].vin.prevout == vMasternodes[3].vin.prevout);
+    BOOST_REQUIRE_EQUAL(vRemoved.size(), 1U);
+    BOOST_CHECK(vRemoved[0] == vMasternodes[0].vin.prevout);
+
+    // Undoing the changes restores the list hash, so both hashes stay valid bases
+    uint256 hashChanged = man.GetListHash();
+    man.Remove(vMasternodes[3].vin);
+    BOOST_CHECK(man.Add(vMasternodes[0]));
+    BOOST_CHECK(man.GetListHash() == hashBase);
+    vEntries.clear();
+    vRemoved.clear();
+    BOOST_CHECK(man.GetListDiff(hashChanged, vEntries, vRemoved));
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 1U);
+    BOOST_CHECK(vEntries[0].vin.prevout == vMasternodes[0].vin.prevout);
+    BOOST_REQUIRE_EQUAL(vRemoved.size(), 1U);
+    BOOST_CHECK(vRemoved[0] == vMasternodes[3].vin.prevout);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_sigcache)
+{
+    CKey key, key2;
+    key.MakeNewKey(true);
+    key2.MakeNewKey(true);
+    std::string strMessage = strprintf("dseep%d", GetTime());
+    std::string strError;
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(darkSendSigner.SignMessage(strMessage, strError, vchSig, key));
+
+    // The second round is answered from the signature cache and must agree with the first
+    for (int i = 0; i < 2; i++) {
+        BOOST_CHECK(darkSendSigner.VerifyMessage(key.GetPubKey(), vchSig, strMessage, strError));
+        BOOST_CHECK(!darkSendSigner.VerifyMessage(key2.GetPubKey(), vchSig, strMessage, strError));
+        BOOST_CHECK(!darkSendSigner.VerifyMessage(key.GetPubKey(), vchSig, strMessage + "x", strError));
+    }
+
+    vector<unsigned char> vchBadSig(vchSig);
+    vchBadSig[0] = 0;
+    BOOST_CHECK(!darkSendSigner.VerifyMessage(key.GetPubKey(), vchBadSig, strMessage, strError));
+    BOOST_CHECK(!darkSendSigner.VerifyMessage(key.GetPubKey(), vchBadSig, strMessage, strError));
+
+    // Without verification threads nothing is deferred
+    uint256 hashEntry;
+    BOOST_CHECK(!darkSendSigner.QueueVerify(strMessage, vchSig, hashEntry));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
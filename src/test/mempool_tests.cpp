@@ -0,0 +1,218 @@
+// Copyright (c) 2011-2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+static CTransaction MakeTx(const uint256& hashPrev, int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
+{
+    // Parent transaction with a child
+    CTransaction txParent = MakeTx(GetRandHash(), 33000LL);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 11000LL);
+
+    CTxMemPool testPool;
+    testPool.setSanityCheck(false);
+    std::list<CTransaction> removed;
+
+    // Nothing in pool, remove should do nothing:
+    testPool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 0);
+    BOOST_CHECK_EQUAL(testPool.DynamicMemoryUsage(), 0);
+
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0, 0, 0.0, 1));
+    BOOST_CHECK(testPool.DynamicMemoryUsage() > 0);
+    BOOST_CHECK_EQUAL(testPool.GetTotalTxSize(),
+                      ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION) +
+                      ::GetSerializeSize(txChild, SER_NETWORK, PROTOCOL_VERSION));
+
+    // Removing the parent recursively takes the child along
+    testPool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+    BOOST_CHECK_EQUAL(testPool.GetTotalTxSize(), 0);
+    BOOST_CHECK_EQUAL(testPool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool;
+    pool.setSanityCheck(false);
+    std::list<CTransaction> removed;
+
+    CTransaction tx1 = MakeTx(GetRandHash(), 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+    CTransaction tx2 = MakeTx(GetRandHash(), 10 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+
+    // Nothing to do when under the limit
+    pool.TrimToSize(pool.DynamicMemoryUsage(), removed);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1), 0);
+
+    // The lowest fee rate transaction goes first
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4, removed);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+
+    // A low fee parent paid for by its high fee child (CPFP) is scored by the
+    // package, so a transaction with a lower rate than the package goes first
+    CTransaction tx3 = MakeTx(GetRandHash(), 10 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 1000LL, 0, 0.0, 1));
+    CTransaction tx4 = MakeTx(tx3.GetHash(), 9 * COIN);
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 50000LL, 0, 0.0, 1));
+    {
+        LOCK(pool.cs);
+        const CTxMemPoolEntry& parent = pool.mapTx[tx3.GetHash()];
+        BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 51000LL);
+        BOOST_CHECK(parent.GetEvictionScore() > pool.mapTx[tx1.GetHash()].GetFeeRate());
+    }
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4, removed);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+    BOOST_CHECK(pool.exists(tx4.GetHash()));
+
+    // The rolling minimum fee is the evicted transaction's score plus the relay fee
+    int64_t nEvictedRate = 10000LL * 1000 / ::GetSerializeSize(tx1, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1), nEvictedRate + CTransaction::nMinRelayTxFee);
+
+    // Next the package goes, parent and child together
+    pool.TrimToSize(pool.DynamicMemoryUsage() / 2, removed);
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    BOOST_CHECK(!pool.exists(tx4.GetHash()));
+
+    // Emptying the pool resets everything
+    pool.TrimToSize(0, removed);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPackageLimitsTest)
+{
+    CTxMemPool pool;
+    pool.setSanityCheck(false);
+    std::string strError;
+
+    // A chain of four, each spending the previous one
+    std::vector<CTransaction> vChain;
+    uint256 hashPrev = GetRandHash();
+    for (int i = 0; i < 4; i++) {
+        vChain.push_back(MakeTx(hashPrev, (10 - i) * COIN));
+        hashPrev = vChain.back().GetHash();
+        pool.addUnchecked(hashPrev, CTxMemPoolEntry(vChain.back(), 1000LL, 0, 0.0, 1));
+    }
+    {
+        LOCK(pool.cs);
+        BOOST_CHECK_EQUAL(pool.mapTx[vChain[0].GetHash()].GetCountWithDescendants(), 4);
+        BOOST_CHECK_EQUAL(pool.mapTx[vChain[3].GetHash()].GetCountWithDescendants(), 1);
+    }
+
+    CTransaction txNext = MakeTx(hashPrev, 5 * COIN);
+    size_t nSize = ::GetSerializeSize(txNext, SER_NETWORK, PROTOCOL_VERSION);
+    size_t nChainSize = 5 * nSize;
+    BOOST_CHECK(pool.CheckPackageLimits(txNext, nSize, 5, nChainSize, 5, nChainSize, strError));
+
+    // One less in either count limit rejects it
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nSize, 4, nChainSize, 5, nChainSize, strError));
+    BOOST_CHECK(strError.find("ancestors") != std::string::npos);
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nSize, 5, nChainSize, 4, nChainSize, strError));
+    BOOST_CHECK(strError.find("descendants") != std::string::npos);
+
+    // Sizes include the new transaction
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nSize, 5, nChainSize - 1, 5, nChainSize, strError));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nSize, 5, nChainSize, 5, nChainSize - 1, strError));
+
+    // Removing the tip gives the root its slot back
+    std::list<CTransaction> removed;
+    pool.remove(vChain[3], removed);
+    {
+        LOCK(pool.cs);
+        BOOST_CHECK_EQUAL(pool.mapTx[vChain[0].GetHash()].GetCountWithDescendants(), 3);
+    }
+    CTransaction txSibling = MakeTx(vChain[2].GetHash(), 5 * COIN);
+    BOOST_CHECK(pool.CheckPackageLimits(txSibling, nSize, 4, nChainSize, 4, nChainSize, strError));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPrioritisedEvictionTest)
+{
+    CTxMemPool pool;
+    pool.setSanityCheck(false);
+    std::list<CTransaction> removed;
+
+    CTransaction tx1 = MakeTx(GetRandHash(), 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+    CTransaction tx2 = MakeTx(GetRandHash(), 10 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+    CTransaction tx3 = MakeTx(tx2.GetHash(), 9 * COIN);
+
+    // A prioritised transaction is kept over a better paying one, and the
+    // delta carries over to its parent's package
+    pool.PrioritiseTransaction(tx2.GetHash(), tx2.GetHash().ToString(), 0.0, 20000LL);
+    pool.PrioritiseTransaction(tx3.GetHash(), tx3.GetHash().ToString(), 0.0, 30000LL);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 0LL, 0, 0.0, 1));
+    {
+        LOCK(pool.cs);
+        BOOST_CHECK_EQUAL(pool.mapTx[tx2.GetHash()].GetModifiedFee(), 25000LL);
+        BOOST_CHECK_EQUAL(pool.mapTx[tx2.GetHash()].GetFeesWithDescendants(), 55000LL);
+    }
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4, removed);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    // A later delta on a transaction in the pool updates its package
+    pool.PrioritiseTransaction(tx2.GetHash(), tx2.GetHash().ToString(), 0.0, -25000LL);
+    {
+        LOCK(pool.cs);
+        BOOST_CHECK_EQUAL(pool.mapTx[tx2.GetHash()].GetModifiedFee(), 0LL);
+        BOOST_CHECK_EQUAL(pool.mapTx[tx2.GetHash()].GetFeesWithDescendants(), 30000LL);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSharedTxTest)
+{
+    CTxMemPool pool;
+    pool.setSanityCheck(false);
+    std::list<CTransaction> removed;
+
+    CTransactionRef ptx = MakeTransactionRef(MakeTx(GetRandHash(), 10 * COIN));
+    uint256 hash = ptx->GetHash();
+    BOOST_CHECK(!pool.get(hash));
+    pool.addUnchecked(hash, CTxMemPoolEntry(ptx, 10000LL, 0, 0.0, 1));
+
+    // The pool hands out the object it was given, not a copy
+    BOOST_CHECK(pool.get(hash) == ptx);
+    BOOST_CHECK_EQUAL(ptx.use_count(), 2);
+
+    // and holders keep it after it leaves the pool
+    CTransactionRef ptxHeld = pool.get(hash);
+    pool.remove(*ptx, removed, true);
+    BOOST_CHECK(!pool.get(hash));
+    BOOST_CHECK(ptxHeld == ptx);
+    BOOST_CHECK(ptxHeld->GetHash() == hash);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,437 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "net.h"
+#include "netbase.h"
+#include "serialize.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#ifndef WIN32
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Tests these internal-to-net.cpp methods:
+extern CNode* StartConnectNode(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, bool fOneShot);
+extern void ThreadSocketHandler();
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+static CBlock MakeBlock(int nTransactions)
+{
+    CBlock block;
+    for (int i = 0; i < nTransactions; i++) {
+        CTransaction tx;
+        tx.vin.resize(2);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 1) << vector<unsigned char>(33, 2);
+        tx.vin[1] = tx.vin[0];
+        tx.vout.resize(2);
+        tx.vout[0].nValue = i;
+        tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 3) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1] = tx.vout[0];
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(net_shared_message)
+{
+    CBlock block = MakeBlock(10);
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+
+    // Without a socket everything stays queued
+    node.PushMessage("block", block);
+    CSerializeDataRef msg = SerializeMessage("block", block);
+    node.PushSerializedMessage(msg);
+    node.PushSerializedMessage(msg);
+
+    LOCK(node.cs_vSend);
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 3);
+    BOOST_CHECK(*node.vSendMsg[0] == *msg);
+    // The queued buffers are the shared one, not copies
+    BOOST_CHECK(node.vSendMsg[1] == msg);
+    BOOST_CHECK(node.vSendMsg[2] == msg);
+    BOOST_CHECK_EQUAL(node.nSendSize, 3 * msg->size());
+}
+
+static void ReadMessage(CNetMessage& msg, const char* pch, unsigned int nBytes)
+{
+    while (nBytes > 0) {
+        int handled = msg.in_data ? msg.readData(pch, nBytes) : msg.readHeader(pch, nBytes);
+        BOOST_REQUIRE(handled > 0);
+        pch += handled;
+        nBytes -= handled;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(net_incremental_receive)
+{
+    // A header alone does not get the declared size allocated
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << CMessageHeader("block", 30 * 1000 * 1000);
+    CNetMessage msgLarge(SER_NETWORK, PROTOCOL_VERSION);
+    ReadMessage(msgLarge, &ssHeader[0], ssHeader.size());
+    BOOST_CHECK(msgLarge.in_data);
+    BOOST_CHECK(msgLarge.vRecv.capacity() < 1000 * 1000);
+    BOOST_CHECK_EQUAL(msgLarge.vRecv.size(), 0);
+
+    // Data delivered in pieces arrives intact and the buffer ends up no larger than the message
+    CSerializeDataRef data = SerializeMessage("block", MakeBlock(2000));
+    BOOST_REQUIRE(data->size() > 2 * 256 * 1024);
+    CNetMessage msg(SER_NETWORK, PROTOCOL_VERSION);
+    for (unsigned int nPos = 0; nPos < data->size(); nPos += 1000)
+        ReadMessage(msg, &(*data)[nPos], min((size_t)1000, data->size() - nPos));
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK(msg.vRecv.capacity() <= msg.hdr.nMessageSize);
+    BOOST_CHECK(equal(msg.vRecv.begin(), msg.vRecv.end(), data->begin() + CMessageHeader::HEADER_SIZE));
+    BOOST_CHECK(msg.vRecv.get_allocator().fPooled);
+}
+
+static void QueueReceived(CNode& node, const char* pszCommand)
+{
+    CSerializeDataRef msg = SerializeMessage(pszCommand, 0);
+    BOOST_REQUIRE(node.ReceiveMsgBytes(&(*msg)[0], msg->size()));
+}
+
+static string PopReceived(CNode& node)
+{
+    int nClass = node.GetNextRecvClass();
+    if (nClass < 0)
+        return "";
+    list<CNetMessage> vMsg;
+    node.PopRecvMessage(nClass, vMsg);
+    return vMsg.front().hdr.GetCommand();
+}
+
+BOOST_AUTO_TEST_CASE(net_recv_priority)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    // No handler threads run here, keep the node off their queue
+    node.fHandlerActive = true;
+    LOCK(node.cs_vRecvMsg);
+
+    // Blocks first, gossip last, arrival order within a class
+    QueueReceived(node, "dsee");
+    QueueReceived(node, "tx");
+    QueueReceived(node, "dseep");
+    QueueReceived(node, "block");
+    QueueReceived(node, "inv");
+    BOOST_CHECK_EQUAL(PopReceived(node), "block");
+    BOOST_CHECK_EQUAL(PopReceived(node), "tx");
+    BOOST_CHECK_EQUAL(PopReceived(node), "inv");
+    BOOST_CHECK_EQUAL(PopReceived(node), "dsee");
+    BOOST_CHECK_EQUAL(PopReceived(node), "dseep");
+    BOOST_CHECK_EQUAL(PopReceived(node), "");
+
+    // Only blocks and headers overtake outstanding getdata
+    node.vRecvGetData.push_back(CInv(MSG_TX, GetRandHash()));
+    QueueReceived(node, "ping");
+    QueueReceived(node, "block");
+    QueueReceived(node, "headers");
+    QueueReceived(node, "filterload");
+    QueueReceived(node, "getdata");
+    BOOST_CHECK_EQUAL(PopReceived(node), "block");
+    BOOST_CHECK_EQUAL(PopReceived(node), "headers");
+    BOOST_CHECK_EQUAL(PopReceived(node), "");
+    node.vRecvGetData.clear();
+    BOOST_CHECK_EQUAL(PopReceived(node), "filterload");
+    BOOST_CHECK_EQUAL(PopReceived(node), "getdata");
+    BOOST_CHECK_EQUAL(PopReceived(node), "ping");
+
+    // Gossip beyond the budget waits for the next tick
+    unsigned int nBudget = GetMessageClassBudget(MSG_CLASS_GOSSIP);
+    for (unsigned int i = 0; i <= nBudget; i++)
+        QueueReceived(node, "mnw");
+    int64_t nTick = GetTimeMillis() / MSG_HANDLER_TICK;
+    while (PopReceived(node) == "mnw") {}
+    if (GetTimeMillis() / MSG_HANDLER_TICK == nTick) {
+        BOOST_CHECK_EQUAL(node.vRecvBudgetUsed[MSG_CLASS_GOSSIP], nBudget);
+        BOOST_CHECK(!node.vRecvQueue[MSG_CLASS_GOSSIP].empty());
+    }
+    node.fHandlerActive = false;
+}
+
+BOOST_AUTO_TEST_CASE(net_recv_deferred_order)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    node.fHandlerActive = true;
+    LOCK(node.cs_vRecvMsg);
+
+    // A dsee waits for its signature and the dseep after it waits behind it
+    QueueReceived(node, "dsee");
+    QueueReceived(node, "dseep");
+    list<CNetMessage> vMsg;
+    BOOST_CHECK(!node.PopRecvMessage(MSG_CLASS_GOSSIP, vMsg));
+    node.DeferRecvMessage(GetRandHash(), vMsg.back(), false);
+    BOOST_CHECK(!node.PopRecvMessage(MSG_CLASS_GOSSIP, vMsg));
+    node.DeferRecvMessage(0, vMsg.back(), false);
+    QueueReceived(node, "mnw");
+
+    // Replayed, they go ahead of newer gossip in arrival order
+    node.RequeueDeferredRecvMessages(2);
+    BOOST_CHECK(node.vRecvDeferred.empty());
+    BOOST_CHECK(node.PopRecvMessage(MSG_CLASS_GOSSIP, vMsg));
+    BOOST_CHECK_EQUAL(vMsg.back().hdr.GetCommand(), "dsee");
+
+    // Deferred again, the replayed dsee takes the dseep back with it, still in front
+    node.DeferRecvMessage(GetRandHash(), vMsg.back(), true);
+    BOOST_REQUIRE_EQUAL(node.vRecvDeferred.size(), 2U);
+    BOOST_CHECK_EQUAL(node.vRecvDeferred[0].second.hdr.GetCommand(), "dsee");
+    BOOST_CHECK_EQUAL(node.vRecvDeferred[1].second.hdr.GetCommand(), "dseep");
+    BOOST_CHECK_EQUAL(node.nRecvReplayed, 0U);
+    BOOST_CHECK_EQUAL(PopReceived(node), "mnw");
+    BOOST_CHECK_EQUAL(PopReceived(node), "");
+
+    node.RequeueDeferredRecvMessages(1);
+    BOOST_CHECK_EQUAL(PopReceived(node), "dsee");
+    node.RequeueDeferredRecvMessages(1);
+    BOOST_CHECK_EQUAL(PopReceived(node), "dseep");
+    node.fHandlerActive = false;
+}
+
+BOOST_AUTO_TEST_CASE(net_msg_stats)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    node.fHandlerActive = true;
+    {
+        LOCK(node.cs_vRecvMsg);
+        QueueReceived(node, "inv");
+        QueueReceived(node, "inv");
+        QueueReceived(node, "dsee");
+    }
+    CBlock block = MakeBlock(3);
+    node.PushMessage("block", block);
+    CSerializeDataRef msg = SerializeMessage("block", block);
+    node.PushSerializedMessage(msg);
+    node.RecordMsgHandlerTime("inv", 1500);
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.mapMsgStats.size(), 3);
+    const CMsgCommandStats& inv = stats.mapMsgStats["inv"];
+    BOOST_CHECK_EQUAL(inv.nRecvMessages, 2);
+    BOOST_CHECK_EQUAL(inv.nRecvBytes, 2 * SerializeMessage("inv", 0)->size());
+    BOOST_CHECK_EQUAL(inv.nSendMessages, 0);
+    BOOST_CHECK_EQUAL(inv.nHandlerTime, 1500);
+    BOOST_CHECK_EQUAL(stats.mapMsgStats["dsee"].nRecvMessages, 1);
+    const CMsgCommandStats& sent = stats.mapMsgStats["block"];
+    BOOST_CHECK_EQUAL(sent.nSendMessages, 2);
+    BOOST_CHECK_EQUAL(sent.nSendBytes, 2 * msg->size());
+
+    // Unknown commands all land in one entry
+    {
+        LOCK(node.cs_vRecvMsg);
+        for (unsigned int i = 0; i < 10; i++)
+            QueueReceived(node, strprintf("junk%u", i).c_str());
+    }
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.mapMsgStats.size(), 4);
+    BOOST_CHECK_EQUAL(stats.mapMsgStats[MSG_STATS_OTHER].nRecvMessages, 10);
+    BOOST_CHECK_EQUAL(stats.mapMsgStats["inv"].nRecvMessages, 2);
+    node.fHandlerActive = false;
+}
+
+BOOST_AUTO_TEST_CASE(net_inventory_known_no_send_buffer)
+{
+    // The known inventory filter is sized from -maxsendbuffer, which may be 0
+    mapArgs["-maxsendbuffer"] = "0";
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    mapArgs.erase("-maxsendbuffer");
+    CInv inv(MSG_TX, GetRandHash());
+    node.AddInventoryKnown(inv);
+    node.PushInventory(inv);
+    BOOST_CHECK(node.vInventoryToSend.empty());
+}
+
+BOOST_AUTO_TEST_CASE(net_blocksonly_version)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", false);
+    node.PushVersion();
+    fBlocksOnly = true;
+    node.PushVersion();
+    fBlocksOnly = DEFAULT_BLOCKSONLY;
+
+    // fRelay is the last field of the version message
+    LOCK(node.cs_vSend);
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 2);
+    BOOST_CHECK_EQUAL(node.vSendMsg[0]->back(), 1);
+    BOOST_CHECK_EQUAL(node.vSendMsg[1]->back(), 0);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(net_vectored_send)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    CNode node(fds[0], CAddress(), "", true);
+    vector<CSerializeDataRef> vMsgs;
+    vMsgs.push_back(SerializeMessage("block", MakeBlock(3)));
+    vMsgs.push_back(SerializeMessage("inv", vector<CInv>(1, CInv(MSG_TX, GetRandHash()))));
+    vMsgs.push_back(SerializeMessage("block", MakeBlock(5)));
+
+    // Queue the messages without the optimistic write, then flush them together
+    {
+        LOCK(node.cs_vSend);
+        node.hSocket = INVALID_SOCKET;
+        BOOST_FOREACH(const CSerializeDataRef& msg, vMsgs)
+            node.QueueSendMsg(msg);
+        node.hSocket = fds[0];
+        SocketSendData(&node);
+        BOOST_CHECK(node.vSendMsg.empty());
+        BOOST_CHECK_EQUAL(node.nSendSize, 0);
+    }
+
+    CSerializeData vExpected;
+    BOOST_FOREACH(const CSerializeDataRef& msg, vMsgs)
+        vExpected.insert(vExpected.end(), msg->begin(), msg->end());
+    BOOST_CHECK_EQUAL(node.nSendBytes, vExpected.size());
+
+    CSerializeData vReceived(vExpected.size());
+    size_t nRead = 0;
+    while (nRead < vReceived.size()) {
+        ssize_t n = read(fds[1], &vReceived[nRead], vReceived.size() - nRead);
+        BOOST_REQUIRE(n > 0);
+        nRead += n;
+    }
+    BOOST_CHECK(vReceived == vExpected);
+
+    close(fds[1]);
+}
+
+static SOCKET ListenLocal(int nBacklog, CService& addrRet)
+{
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+    BOOST_REQUIRE(listen(hListen, nBacklog) == 0);
+    socklen_t len = sizeof(sin);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sin, &len) == 0);
+    addrRet = CService(sin);
+    return hListen;
+}
+
+static bool WaitWritable(SOCKET hSocket, int nTimeout)
+{
+    struct timeval timeout = MillisToTimeval(nTimeout);
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, NULL, &fdset, NULL, &timeout) > 0;
+}
+
+BOOST_AUTO_TEST_CASE(net_connect_blackholed)
+{
+    // A listener that never accepts drops further SYNs once its backlog is
+    // full, which from the outside looks like an unreachable address
+    CService addrBlackhole;
+    SOCKET hBlackhole = ListenLocal(0, addrBlackhole);
+    vector<SOCKET> vSockets;
+    SOCKET hStuck = INVALID_SOCKET;
+    for (int i = 0; i < 16 && hStuck == INVALID_SOCKET; i++) {
+        SOCKET hSocket;
+        bool fInProgress;
+        BOOST_REQUIRE(StartConnectSocket(addrBlackhole, hSocket, fInProgress));
+        vSockets.push_back(hSocket);
+        if (fInProgress && !WaitWritable(hSocket, 200))
+            hStuck = hSocket;
+    }
+    BOOST_REQUIRE(hStuck != INVALID_SOCKET);
+    vSockets.pop_back();
+    int nErr;
+    BOOST_CHECK(!CheckConnectSocket(hStuck, nErr));
+
+    // A reachable peer connects while the other attempt is still hanging
+    CService addrGood;
+    SOCKET hGood = ListenLocal(5, addrGood);
+    SOCKET hSocket;
+    bool fInProgress;
+    BOOST_REQUIRE(StartConnectSocket(addrGood, hSocket, fInProgress));
+    if (fInProgress)
+        BOOST_CHECK(WaitWritable(hSocket, 5000));
+    BOOST_CHECK(CheckConnectSocket(hSocket, nErr));
+    BOOST_CHECK_EQUAL(nErr, 0);
+    BOOST_CHECK(!CheckConnectSocket(hStuck, nErr));
+    close(hSocket);
+
+    // A refused connect fails right away or reports its error
+    close(hGood);
+    if (StartConnectSocket(addrGood, hSocket, fInProgress)) {
+        BOOST_CHECK(WaitWritable(hSocket, 5000));
+        BOOST_CHECK(CheckConnectSocket(hSocket, nErr));
+        BOOST_CHECK(nErr != 0);
+        close(hSocket);
+    }
+
+    // The version message waits in the queue until the connect completes
+    {
+        CNode node(hStuck, CAddress(addrBlackhole), "", false, true);
+        LOCK(node.cs_vSend);
+        BOOST_CHECK_EQUAL(node.vSendMsg.size(), 1);
+        SocketSendData(&node);
+        BOOST_CHECK_EQUAL(node.vSendMsg.size(), 1);
+        BOOST_CHECK_EQUAL(node.nSendBytes, 0);
+    }
+
+    BOOST_FOREACH(SOCKET hQueued, vSockets)
+        close(hQueued);
+    close(hBlackhole);
+}
+
+static void FillSlotsRefused(CSemaphore* psem, CAddress addr, int nAttempts)
+{
+    for (int i = 0; i < nAttempts; i++) {
+        CSemaphoreGrant grant(*psem);
+        StartConnectNode(addr, &grant, false);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(net_connect_refused_slots)
+{
+    // Nothing listens on a port we just closed, so every connect fails fast
+    CService addrRefused;
+    close(ListenLocal(0, addrRefused));
+
+    BOOST_REQUIRE(InitSocketEvents("select"));
+    boost::thread threadSocket(&ThreadSocketHandler);
+
+    // Several threads filling outbound slots while the socket thread drops the failures
+    const int nSlots = 4;
+    CSemaphore sem(nSlots);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nSlots; i++)
+        threadGroup.create_thread(boost::bind(&FillSlotsRefused, &sem, CAddress(addrRefused), 50));
+    threadGroup.join_all();
+
+    // Every failed node gives its slot back
+    int nFree = 0;
+    for (int nWait = 0; nWait < 100 && nFree < nSlots; nWait++) {
+        if (sem.try_wait())
+            nFree++;
+        else
+            MilliSleep(100);
+    }
+    BOOST_CHECK_EQUAL(nFree, nSlots);
+
+    threadSocket.interrupt();
+    threadSocket.join();
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
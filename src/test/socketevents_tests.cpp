@@ -0,0 +1,87 @@
+// Copyright (c) 2015 The Chaincoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(socketevents_tests)
+
+#ifndef WIN32
+static int CountEvents(CSocketEvents* pevents, void* pContext, int nEvent)
+{
+    vector<CSocketEvents::Event> vEvents;
+    BOOST_CHECK(pevents->Wait(0, vEvents));
+    int nCount = 0;
+    for (unsigned int i = 0; i < vEvents.size(); i++)
+        if (vEvents[i].pContext == pContext && (vEvents[i].nEvents & nEvent))
+            nCount++;
+    return nCount;
+}
+
+static void CheckSocketEvents(const string& strMode, bool fEdgeTriggered)
+{
+    boost::scoped_ptr<CSocketEvents> pevents(CreateSocketEvents(strMode));
+    BOOST_REQUIRE(pevents);
+
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int nContext = 0;
+    BOOST_CHECK(pevents->Add(fds[0], &nContext, true, false));
+
+    // Nothing to read, and send readiness is not asked for
+    BOOST_CHECK_EQUAL(CountEvents(pevents.get(), &nContext, CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_SEND), 0);
+
+    BOOST_CHECK(write(fds[1], "x", 1) == 1);
+    BOOST_CHECK_EQUAL(CountEvents(pevents.get(), &nContext, CSocketEvents::EVENT_RECV), 1);
+    // Unread data is only reported again when level-triggered
+    BOOST_CHECK_EQUAL(CountEvents(pevents.get(), &nContext, CSocketEvents::EVENT_RECV), fEdgeTriggered ? 0 : 1);
+
+    // Asking for send readiness reports a writable socket right away
+    pevents->Modify(fds[0], &nContext, true, true);
+    BOOST_CHECK_EQUAL(CountEvents(pevents.get(), &nContext, CSocketEvents::EVENT_SEND), 1);
+    pevents->Modify(fds[0], &nContext, false, false);
+    BOOST_CHECK_EQUAL(CountEvents(pevents.get(), &nContext, CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_SEND), 0);
+
+    // A removed socket is not reported, and a stale context can't remove its successor
+    pevents->Remove(fds[0], &nContext);
+    pevents->Modify(fds[0], &nContext, true, true);
+    BOOST_CHECK_EQUAL(CountEvents(pevents.get(), &nContext, CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_SEND), 0);
+    int nOther = 0;
+    BOOST_CHECK(pevents->Add(fds[0], &nOther, true, false));
+    pevents->Remove(fds[0], &nContext);
+    BOOST_CHECK_EQUAL(CountEvents(pevents.get(), &nOther, CSocketEvents::EVENT_RECV), 1);
+
+    pevents->Remove(fds[0], &nOther);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_select)
+{
+    CheckSocketEvents("select", false);
+}
+
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(socketevents_epoll)
+{
+    CheckSocketEvents("epoll", true);
+}
+#endif
+#endif
+
+BOOST_AUTO_TEST_CASE(socketevents_unknown_mode)
+{
+    BOOST_CHECK(CreateSocketEvents("poll") == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include <utility>
 #include <vector>
 
+#include <boost/assign/list_of.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -21,6 +22,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -303,4 +306,54 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+// A transaction paying the given amounts to script, spending hashPrev:0 unless it's null
+static CWalletTx MakeRoundsTx(const CScript& script, const uint256& hashPrev, const vector<int64_t>& vValues)
+{
+    CTransaction tx;
+    if (hashPrev != 0)
+        tx.vin.push_back(CTxIn(COutPoint(hashPrev, 0)));
+    BOOST_FOREACH(int64_t nValue, vValues)
+        tx.vout.push_back(CTxOut(nValue, script));
+    return CWalletTx(pwalletMain, tx);
+}
+
+BOOST_AUTO_TEST_CASE(darksend_rounds_index)
+{
+    LOCK(pwalletMain->cs_wallet);
+
+    if (darkSendDenominations.empty())
+        darkSendDenominations.push_back((1 * COIN) + 1000);
+    int64_t nDenom = darkSendDenominations[0];
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKey(key));
+    CScript script;
+    script.SetDestination(key.GetPubKey().GetID());
+
+    // tx0 mixes a denomination with change, tx1 and tx2 are denominated only
+    CWalletTx wtx0 = MakeRoundsTx(script, 0, boost::assign::list_of(nDenom)(5 * COIN));
+    CWalletTx wtx1 = MakeRoundsTx(script, wtx0.GetHash(), boost::assign::list_of(nDenom)(nDenom));
+    CWalletTx wtx2 = MakeRoundsTx(script, wtx1.GetHash(), boost::assign::list_of(nDenom));
+
+    // Children arriving before their parents get their rounds redone when the parents show up
+    pwalletMain->AddToWallet(wtx2);
+    BOOST_CHECK_EQUAL(pwalletMain->GetOutpointDarksendRounds(COutPoint(wtx2.GetHash(), 0)), 0);
+    pwalletMain->AddToWallet(wtx1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetOutpointDarksendRounds(COutPoint(wtx2.GetHash(), 0)), 1);
+    pwalletMain->AddToWallet(wtx0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetOutpointDarksendRounds(COutPoint(wtx0.GetHash(), 0)), 0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetOutpointDarksendRounds(COutPoint(wtx0.GetHash(), 1)), -2);
+    BOOST_CHECK_EQUAL(pwalletMain->GetOutpointDarksendRounds(COutPoint(wtx1.GetHash(), 1)), 1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetOutpointDarksendRounds(COutPoint(wtx2.GetHash(), 0)), 2);
+
+    // Dropping a transaction takes its descendants back to the start of their chain
+    pwalletMain->EraseFromWallet(wtx0.GetHash());
+    BOOST_CHECK_EQUAL(pwalletMain->GetOutpointDarksendRounds(COutPoint(wtx1.GetHash(), 0)), 0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetOutpointDarksendRounds(COutPoint(wtx2.GetHash(), 0)), 1);
+
+    pwalletMain->EraseFromWallet(wtx1.GetHash());
+    pwalletMain->EraseFromWallet(wtx2.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,10 +5,25 @@
 
 #include "core.h"
 #include "txmempool.h"
+#include "memusage.h"
+#include "util.h"
+
+#include <math.h>
 
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry()
+static size_t RecursiveDynamicUsage(const CTransaction& tx)
+{
+    size_t mem = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mem += memusage::DynamicUsage(txin.scriptSig);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        mem += memusage::DynamicUsage(txout.scriptPubKey);
+    return mem;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry():
+    nFee(0), nTxSize(0), nUsageSize(0), nTime(0), dPriority(0.0), nFeeDelta(0), nFeesWithDescendants(0), nSizeWithDescendants(0), nCountWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -16,9 +31,27 @@ CTxMemPoolEntry::CTxMemPoolEntry()
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight):
+    tx(MakeTransactionRef(_tx)), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+{
+    nTxSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = RecursiveDynamicUsage(*tx) + memusage::MallocUsage(sizeof(CTransaction));
+    nFeeDelta = 0;
+    nFeesWithDescendants = nFee;
+    nSizeWithDescendants = nTxSize;
+    nCountWithDescendants = 1;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, int64_t _nFee,
+                                 int64_t _nTime, double _dPriority,
+                                 unsigned int _nHeight):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
 {
-    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nTxSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = RecursiveDynamicUsage(*tx) + memusage::MallocUsage(sizeof(CTransaction));
+    nFeeDelta = 0;
+    nFeesWithDescendants = nFee;
+    nSizeWithDescendants = nTxSize;
+    nCountWithDescendants = 1;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -26,10 +59,29 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
     *this = other;
 }
 
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nModifyFee, int64_t nModifySize, int64_t nModifyCount)
+{
+    nFeesWithDescendants += nModifyFee;
+    nSizeWithDescendants += nModifySize;
+    nCountWithDescendants += nModifyCount;
+}
+
+void CTxMemPoolEntry::UpdateFeeDelta(int64_t nNewFeeDelta)
+{
+    nFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
+int64_t CTxMemPoolEntry::GetEvictionScore() const
+{
+    int64_t nPackageRate = nSizeWithDescendants ? nFeesWithDescendants * 1000 / (int64_t)nSizeWithDescendants : 0;
+    return std::max(GetModifiedFeeRate(), nPackageRate);
+}
+
 double
 CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 {
-    int64_t nValueIn = tx.GetValueOut()+nFee;
+    int64_t nValueIn = tx->GetValueOut()+nFee;
     double deltaPriority = ((double)(currentHeight-nHeight)*nValueIn)/nTxSize;
     double dResult = dPriority + deltaPriority;
     return dResult;
@@ -41,6 +93,12 @@ CTxMemPool::CTxMemPool()
     // accepting transactions becomes O(N^2) where N is the number
     // of transactions in the pool
     fSanityCheck = false;
+    nTransactionsUpdated = 0;
+    totalTxSize = 0;
+    cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
 }
 
 void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
@@ -69,6 +127,45 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, size_t nTxSize, unsigned int nLimitAncestorCount, size_t nLimitAncestorSize,
+                                    unsigned int nLimitDescendantCount, size_t nLimitDescendantSize, std::string& strError) const
+{
+    LOCK(cs);
+    // Like calculateAncestors, but gives up as soon as a limit is exceeded
+    std::set<uint256> setAncestors;
+    size_t nAncestorSize = nTxSize;
+    std::vector<const CTransaction*> vToVisit(1, &tx);
+    while (!vToVisit.empty()) {
+        const CTransaction* ptx = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin) {
+            std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(txin.prevout.hash);
+            if (it == mapTx.end() || !setAncestors.insert(it->first).second)
+                continue;
+            const CTxMemPoolEntry& anc = it->second;
+            nAncestorSize += anc.GetTxSize();
+            if (setAncestors.size() + 1 > nLimitAncestorCount) {
+                strError = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestorCount);
+                return false;
+            }
+            if (nAncestorSize > nLimitAncestorSize) {
+                strError = strprintf("exceeds ancestor size limit [limit: %u]", nLimitAncestorSize);
+                return false;
+            }
+            if (anc.GetCountWithDescendants() + 1 > nLimitDescendantCount) {
+                strError = strprintf("too many descendants for tx %s [limit: %u]", it->first.ToString(), nLimitDescendantCount);
+                return false;
+            }
+            if (anc.GetSizeWithDescendants() + nTxSize > nLimitDescendantSize) {
+                strError = strprintf("exceeds descendant size limit for tx %s [limit: %u]", it->first.ToString(), nLimitDescendantSize);
+                return false;
+            }
+            vToVisit.push_back(&anc.GetTx());
+        }
+    }
+    return true;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
@@ -76,10 +173,52 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
+        if (mapTx.count(hash))
+            return false;
+        std::map<uint256, CTxMemPoolEntry>::iterator itNew = mapTx.insert(make_pair(hash, entry)).first;
+        const CTransaction& tx = itNew->second.GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        std::map<uint256, std::pair<double, int64_t> >::const_iterator itDelta = mapDeltas.find(hash);
+        if (itDelta != mapDeltas.end())
+            itNew->second.UpdateFeeDelta(itDelta->second.second);
+
+        // Transactions put back after a reorg may already have spenders in the pool
+        std::set<uint256> setDescendants;
+        calculateDescendants(hash, setDescendants);
+        setDescendants.erase(hash);
+        BOOST_FOREACH(const uint256& hashDesc, setDescendants) {
+            const CTxMemPoolEntry& desc = mapTx[hashDesc];
+            itNew->second.UpdateDescendantState(desc.GetModifiedFee(), desc.GetTxSize(), 1);
+        }
+        setEntriesByScore.insert(make_pair(itNew->second.GetEvictionScore(), hash));
+
+        std::set<uint256> setAncestors;
+        calculateAncestors(tx, setAncestors);
+        if (setDescendants.empty()) {
+            BOOST_FOREACH(const uint256& hashAnc, setAncestors)
+                updateDescendantState(mapTx.find(hashAnc), itNew->second.GetModifiedFee(), entry.GetTxSize(), 1);
+        } else {
+            // Some of those spenders may already be counted by an ancestor through
+            // another path, so recount the ancestors from scratch
+            BOOST_FOREACH(const uint256& hashAnc, setAncestors) {
+                std::map<uint256, CTxMemPoolEntry>::iterator itAnc = mapTx.find(hashAnc);
+                std::set<uint256> setAncDescendants;
+                calculateDescendants(hashAnc, setAncDescendants);
+                int64_t nFees = 0;
+                int64_t nSize = 0;
+                BOOST_FOREACH(const uint256& hashDesc, setAncDescendants) {
+                    const CTxMemPoolEntry& desc = mapTx[hashDesc];
+                    nFees += desc.GetModifiedFee();
+                    nSize += desc.GetTxSize();
+                }
+                updateDescendantState(itAnc, nFees - itAnc->second.GetFeesWithDescendants(),
+                                      nSize - (int64_t)itAnc->second.GetSizeWithDescendants(),
+                                      (int64_t)setAncDescendants.size() - itAnc->second.GetCountWithDescendants());
+            }
+        }
+        totalTxSize += entry.GetTxSize();
+        cachedInnerUsage += entry.DynamicMemoryUsage();
         nTransactionsUpdated++;
     }
     return true;
@@ -100,12 +239,22 @@ void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed
                 remove(*it->second.ptx, removed, true);
             }
         }
-        if (mapTx.count(hash))
+        std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+        if (it != mapTx.end())
         {
             removed.push_front(tx);
+            // Ancestors lose just this transaction: its descendants either left
+            // before it, or it was mined, and then so were its ancestors
+            std::set<uint256> setAncestors;
+            calculateAncestors(tx, setAncestors);
+            BOOST_FOREACH(const uint256& hashAnc, setAncestors)
+                updateDescendantState(mapTx.find(hashAnc), -it->second.GetModifiedFee(), -(int64_t)it->second.GetTxSize(), -1);
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            setEntriesByScore.erase(make_pair(it->second.GetEvictionScore(), hash));
+            totalTxSize -= it->second.GetTxSize();
+            cachedInnerUsage -= it->second.DynamicMemoryUsage();
+            mapTx.erase(it);
             nTransactionsUpdated++;
         }
     }
@@ -128,11 +277,30 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
     }
 }
 
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, std::list<CTransaction>& conflicts)
+{
+    LOCK(cs);
+    BOOST_FOREACH(const CTransaction& tx, vtx) {
+        list<CTransaction> unused;
+        remove(tx, unused);
+        removeConflicts(tx, conflicts);
+        ClearPrioritisation(tx.GetHash());
+    }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setEntriesByScore.clear();
+    totalTxSize = 0;
+    cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -144,8 +312,26 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     LOCK(cs);
+    uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
     for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
+        checkTotal += it->second.GetTxSize();
+        innerUsage += it->second.DynamicMemoryUsage();
+        assert(setEntriesByScore.count(make_pair(it->second.GetEvictionScore(), it->first)));
+        std::set<uint256> setDescendants;
+        calculateDescendants(it->first, setDescendants);
+        int64_t nFeesWithDescendants = 0;
+        size_t nSizeWithDescendants = 0;
+        BOOST_FOREACH(const uint256& hashDesc, setDescendants) {
+            std::map<uint256, CTxMemPoolEntry>::const_iterator itDesc = mapTx.find(hashDesc);
+            assert(itDesc != mapTx.end());
+            nFeesWithDescendants += itDesc->second.GetModifiedFee();
+            nSizeWithDescendants += itDesc->second.GetTxSize();
+        }
+        assert(it->second.GetFeesWithDescendants() == nFeesWithDescendants);
+        assert(it->second.GetSizeWithDescendants() == nSizeWithDescendants);
+        assert(it->second.GetCountWithDescendants() == setDescendants.size());
         const CTransaction& tx = it->second.GetTx();
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
@@ -174,6 +360,9 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
+    assert(setEntriesByScore.size() == mapTx.size());
+    assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -195,6 +384,164 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     return true;
 }
 
+CTransactionRef CTxMemPool::get(const uint256& hash) const
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end())
+        return CTransactionRef();
+    return i->second.GetSharedTx();
+}
+
+void CTxMemPool::PrioritiseTransaction(const uint256& hash, const string& strHash, double dPriorityDelta, int64_t nFeeDelta)
+{
+    {
+        LOCK(cs);
+        std::pair<double, int64_t>& deltas = mapDeltas[hash];
+        deltas.first += dPriorityDelta;
+        deltas.second += nFeeDelta;
+        // Keep the eviction order of a transaction already in the pool, and its ancestors', in step
+        std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+        if (it != mapTx.end() && nFeeDelta != 0) {
+            setEntriesByScore.erase(make_pair(it->second.GetEvictionScore(), hash));
+            it->second.UpdateFeeDelta(deltas.second);
+            setEntriesByScore.insert(make_pair(it->second.GetEvictionScore(), hash));
+            std::set<uint256> setAncestors;
+            calculateAncestors(it->second.GetTx(), setAncestors);
+            BOOST_FOREACH(const uint256& hashAnc, setAncestors)
+                updateDescendantState(mapTx.find(hashAnc), nFeeDelta, 0, 0);
+        }
+        nTransactionsUpdated++;
+    }
+    LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, nFeeDelta);
+}
+
+void CTxMemPool::ApplyDeltas(const uint256& hash, double& dPriorityDelta, int64_t& nFeeDelta) const
+{
+    LOCK(cs);
+    std::map<uint256, std::pair<double, int64_t> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos == mapDeltas.end())
+        return;
+    const std::pair<double, int64_t>& deltas = pos->second;
+    dPriorityDelta += deltas.first;
+    nFeeDelta += deltas.second;
+}
+
+void CTxMemPool::ClearPrioritisation(const uint256& hash)
+{
+    LOCK(cs);
+    mapDeltas.erase(hash);
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) +
+           memusage::DynamicUsage(setEntriesByScore) + memusage::DynamicUsage(mapDeltas) + cachedInnerUsage;
+}
+
+void CTxMemPool::calculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    // Walk mapNextTx breadth-first collecting every in-mempool spender of hash
+    std::vector<uint256> vToVisit(1, hash);
+    while (!vToVisit.empty()) {
+        uint256 hashCur = vToVisit.back();
+        vToVisit.pop_back();
+        if (!setDescendants.insert(hashCur).second)
+            continue;
+        std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.lower_bound(COutPoint(hashCur, 0));
+        for (; it != mapNextTx.end() && it->first.hash == hashCur; ++it)
+            vToVisit.push_back(it->second.ptx->GetHash());
+    }
+}
+
+void CTxMemPool::calculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const
+{
+    std::vector<const CTransaction*> vToVisit(1, &tx);
+    while (!vToVisit.empty()) {
+        const CTransaction* ptx = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin) {
+            std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(it->first).second)
+                vToVisit.push_back(&it->second.GetTx());
+        }
+    }
+}
+
+void CTxMemPool::updateDescendantState(std::map<uint256, CTxMemPoolEntry>::iterator it, int64_t nModifyFee, int64_t nModifySize, int64_t nModifyCount)
+{
+    AssertLockHeld(cs);
+    // the score is part of the set key
+    setEntriesByScore.erase(make_pair(it->second.GetEvictionScore(), it->first));
+    it->second.UpdateDescendantState(nModifyFee, nModifySize, nModifyCount);
+    setEntriesByScore.insert(make_pair(it->second.GetEvictionScore(), it->first));
+}
+
+void CTxMemPool::trackPackageRemoved(int64_t nFeeRate)
+{
+    AssertLockHeld(cs);
+    if (nFeeRate > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = nFeeRate;
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit, std::list<CTransaction>& removed)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    int64_t nMaxFeeRateRemoved = 0;
+    // A transaction cannot outlive its parent, so every in-mempool descendant
+    // leaves with it; the eviction score keeps a parent as long as its
+    // descendants make the package worth mining.
+    while (!setEntriesByScore.empty() && DynamicMemoryUsage() > sizelimit) {
+        std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(setEntriesByScore.begin()->second);
+        assert(it != mapTx.end());
+
+        // Whoever wants back in must beat the evicted package by at least the
+        // relay fee, so an attacker cannot churn the pool at the relay minimum.
+        int64_t nFeeRate = it->second.GetEvictionScore() + CTransaction::nMinRelayTxFee;
+        trackPackageRemoved(nFeeRate);
+        nMaxFeeRateRemoved = std::max(nMaxFeeRateRemoved, nFeeRate);
+
+        list<CTransaction> txRemoved;
+        remove(it->second.GetTx(), txRemoved, true);
+        nTxnRemoved += txRemoved.size();
+        removed.splice(removed.end(), txRemoved);
+    }
+
+    if (nTxnRemoved > 0)
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %d\n", nTxnRemoved, nMaxFeeRateRemoved);
+}
+
+int64_t CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return (int64_t)rollingMinimumFeeRate;
+
+    int64_t nTime = GetTime();
+    if (nTime > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < sizelimit / 4)
+            halflife /= 4;
+        else if (nUsage < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (nTime - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = nTime;
+
+        if (rollingMinimumFeeRate < CTransaction::nMinRelayTxFee / 2) {
+            rollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return std::max((int64_t)rollingMinimumFeeRate, CTransaction::nMinRelayTxFee);
+}
+
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
 bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) {
@@ -6,6 +6,7 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "coins.h"
 #include "core.h"
@@ -20,25 +21,47 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 class CTxMemPoolEntry
 {
 private:
-    CTransaction tx;
+    CTransactionRef tx;
     int64_t nFee; // Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; // ... and avoid recomputing tx size
+    size_t nUsageSize; // ... and total memory usage
     int64_t nTime; // Local time when entering the mempool
     double dPriority; // Priority when entering the mempool
     unsigned int nHeight; // Chain height when entering the mempool
+    int64_t nFeeDelta; // Fee adjustment from prioritisetransaction
+    int64_t nFeesWithDescendants; // Modified fee of this transaction and all its in-mempool descendants
+    size_t nSizeWithDescendants; // ... and their total size
+    unsigned int nCountWithDescendants; // ... and how many there are, this one included
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
                     int64_t _nTime, double _dPriority, unsigned int _nHeight);
+    CTxMemPoolEntry(const CTransactionRef& _tx, int64_t _nFee,
+                    int64_t _nTime, double _dPriority, unsigned int _nHeight);
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
-    const CTransaction& GetTx() const { return this->tx; }
+    const CTransaction& GetTx() const { return *this->tx; }
+    const CTransactionRef& GetSharedTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     int64_t GetFee() const { return nFee; }
+    // Fee with the prioritisetransaction delta, as used for eviction
+    int64_t GetModifiedFee() const { return nFee + nFeeDelta; }
     size_t GetTxSize() const { return nTxSize; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+    // Fee rate in satoshis per 1000 bytes
+    int64_t GetFeeRate() const { return nTxSize ? nFee * 1000 / (int64_t)nTxSize : 0; }
+    int64_t GetModifiedFeeRate() const { return nTxSize ? GetModifiedFee() * 1000 / (int64_t)nTxSize : 0; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+    size_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    unsigned int GetCountWithDescendants() const { return nCountWithDescendants; }
+    void UpdateDescendantState(int64_t nModifyFee, int64_t nModifySize, int64_t nModifyCount);
+    void UpdateFeeDelta(int64_t nNewFeeDelta);
+    // Eviction score: the higher of its own modified fee rate and that of the package
+    // with its descendants, so a parent paid for by its children stays with them
+    int64_t GetEvictionScore() const;
 };
 
 /*
@@ -57,10 +80,30 @@ private:
     bool fSanityCheck; // Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
 
+    uint64_t totalTxSize; // sum of the serialized sizes of all mempool transactions
+    uint64_t cachedInnerUsage; // sum of the dynamic memory usage of all entries (not the maps themselves)
+
+    // Minimum fee rate (satoshis per 1000 bytes) raised whenever TrimToSize
+    // evicts a package, decaying back towards zero once blocks are found.
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate;
+
+    void trackPackageRemoved(int64_t nFeeRate);
+    void calculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void calculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const;
+    void updateDescendantState(std::map<uint256, CTxMemPoolEntry>::iterator it, int64_t nModifyFee, int64_t nModifySize, int64_t nModifyCount);
+
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
+
     mutable CCriticalSection cs;
     std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    // Eviction order: entries keyed by GetEvictionScore(), lowest first
+    std::set<std::pair<int64_t, uint256> > setEntriesByScore;
+    // Priority and fee adjustments set by prioritisetransaction, by txid
+    std::map<uint256, std::pair<double, int64_t> > mapDeltas;
 
     CTxMemPool();
 
@@ -73,21 +116,56 @@ public:
     void check(CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /*
+     * Check that adding tx (of nTxSize bytes) keeps its in-mempool ancestors within
+     * nLimitAncestorCount transactions and nLimitAncestorSize bytes, both counting tx,
+     * and every ancestor's descendants within nLimitDescendantCount and nLimitDescendantSize.
+     * This bounds the bookkeeping of addUnchecked and remove. Fills strError if not.
+     */
+    bool CheckPackageLimits(const CTransaction& tx, size_t nTxSize, unsigned int nLimitAncestorCount, size_t nLimitAncestorSize,
+                            unsigned int nLimitDescendantCount, size_t nLimitDescendantSize, std::string& strError) const;
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
+    void removeForBlock(const std::vector<CTransaction>& vtx, std::list<CTransaction>& conflicts);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    /** Affect CreateNewBlock prioritisation of transactions */
+    void PrioritiseTransaction(const uint256& hash, const std::string& strHash, double dPriorityDelta, int64_t nFeeDelta);
+    void ApplyDeltas(const uint256& hash, double& dPriorityDelta, int64_t& nFeeDelta) const;
+    void ClearPrioritisation(const uint256& hash);
+
+    /*
+     * Remove the transactions with the lowest eviction score, together with their
+     * in-mempool descendants, until the pool's memory usage is at most sizelimit bytes.
+     */
+    void TrimToSize(size_t sizelimit, std::list<CTransaction>& removed);
+
+    /*
+     * The minimum fee rate (satoshis per 1000 bytes) a transaction must pay to
+     * enter a pool limited to sizelimit bytes. Zero unless the pool has been trimmed
+     * recently; decays with a half-life of ROLLING_FEE_HALFLIFE afterwards.
+     */
+    int64_t GetMinFee(size_t sizelimit) const;
+
+    size_t DynamicMemoryUsage() const;
+
     unsigned long size()
     {
         LOCK(cs);
         return mapTx.size();
     }
 
+    uint64_t GetTotalTxSize()
+    {
+        LOCK(cs);
+        return totalTxSize;
+    }
+
     bool exists(uint256 hash)
     {
         LOCK(cs);
@@ -95,6 +173,8 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    /** The pool's own copy of a transaction, or NULL; it stays valid after the transaction leaves the pool */
+    CTransactionRef get(const uint256& hash) const;
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -27,7 +27,7 @@ extern const std::string CLIENT_DATE;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 70003;
+static const int PROTOCOL_VERSION = 70004;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -49,4 +49,10 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "mnlistget"/"mnlist" masternode list sync starts with this version
+static const int MNLIST_VERSION = 70004;
+
+// masternodes announced with this proto version or later can be activated remotely
+static const int MIN_MN_PROTO_VERSION = 70003;
+
 #endif
@@ -650,6 +650,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         // Break debit/credit balance caches:
         wtx.MarkDirty();
 
+        // It may have come in after wallet transactions spending it
+        if (fInsertedNew)
+            UpdateDarksendRounds(hash);
+
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -690,9 +694,15 @@ bool CWallet::AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction&
 void CWallet::SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    bool fDisconnected = !pblock && mi != mapWallet.end() && mi->second.hashBlock != 0;
     if (!AddToWalletIfInvolvingMe(hash, tx, pblock, true))
         return; // Not one of ours
 
+    // Its block was disconnected, its rounds (and everything built on them) are redone
+    if (fDisconnected)
+        UpdateDarksendRounds(hash);
+
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
     // recomputed, also:
@@ -709,12 +719,170 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        if (mapWallet.erase(hash)) {
             CWalletDB(strWalletFile).EraseTx(hash);
+            UpdateDarksendRounds(hash);
+        }
     }
     return;
 }
 
+int CWallet::ComputeDarksendRounds(const COutPoint& outpoint, CWalletDB* pwalletdb)
+{
+    std::map<COutPoint, int>::const_iterator it = mapDarksendRounds.find(outpoint);
+    if (it != mapDarksendRounds.end())
+        return it->second;
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi == mapWallet.end())
+        return -1;
+    const CWalletTx& wtx = mi->second;
+
+    int nRounds;
+    if (outpoint.n >= wtx.vout.size())
+        nRounds = -4;
+    else if (IsCollateralAmount(wtx.vout[outpoint.n].nValue))
+        nRounds = -3;
+    else if (!IsDenominatedAmount(wtx.vout[outpoint.n].nValue)) //NOT DENOM
+        nRounds = -2;
+    else
+    {
+        bool fAllDenoms = true;
+        BOOST_FOREACH(const CTxOut& out, wtx.vout)
+            fAllDenoms = fAllDenoms && IsDenominatedAmount(out.nValue);
+
+        // denominated, but if there's another non-denominated output in the same tx we're the first in the chain
+        nRounds = 0;
+        if (fAllDenoms)
+        {
+            // one more than the shortest chain of denominated inputs of ours
+            int nShortest = -1;
+            BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            {
+                if (!IsMine(txin))
+                    continue;
+                int n = ComputeDarksendRounds(txin.prevout, pwalletdb);
+                if (n >= 0 && (nShortest == -1 || n < nShortest))
+                    nShortest = n;
+            }
+            if (nShortest >= 0)
+                nRounds = nShortest + 1;
+        }
+    }
+
+    mapDarksendRounds[outpoint] = nRounds;
+    if (pwalletdb)
+        pwalletdb->WriteDarksendRounds(outpoint, nRounds);
+    return nRounds;
+}
+
+int CWallet::GetOutpointDarksendRounds(const COutPoint& outpoint)
+{
+    LOCK(cs_wallet);
+
+    std::map<COutPoint, int>::const_iterator it = mapDarksendRounds.find(outpoint);
+    if (it != mapDarksendRounds.end())
+        return it->second;
+
+    // Not indexed yet, e.g. asked for before the denominations were set up
+    if (darkSendDenominations.empty())
+        return -2;
+
+    CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile) : NULL;
+    int nRounds = ComputeDarksendRounds(outpoint, pwalletdb);
+    delete pwalletdb;
+    return nRounds;
+}
+
+void CWallet::UpdateDarksendRounds(const uint256& hash)
+{
+    LOCK(cs_wallet);
+
+    // Drop the entries of the transaction and of everything spending its outputs, recursively
+    std::vector<uint256> vAffected(1, hash);
+    std::set<uint256> setAffected(vAffected.begin(), vAffected.end());
+    std::vector<COutPoint> vErased;
+    for (unsigned int i = 0; i < vAffected.size(); i++)
+    {
+        std::map<COutPoint, int>::iterator it = mapDarksendRounds.lower_bound(COutPoint(vAffected[i], 0));
+        while (it != mapDarksendRounds.end() && it->first.hash == vAffected[i])
+        {
+            vErased.push_back(it->first);
+            mapDarksendRounds.erase(it++);
+        }
+
+        TxSpends::const_iterator its = mapTxSpends.lower_bound(COutPoint(vAffected[i], 0));
+        for (; its != mapTxSpends.end() && its->first.hash == vAffected[i]; ++its)
+            if (setAffected.insert(its->second).second)
+                vAffected.push_back(its->second);
+    }
+
+    // and compute them again, each output once
+    CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile) : NULL;
+    if (!darkSendDenominations.empty())
+    {
+        BOOST_FOREACH(const uint256& hashAffected, vAffected)
+        {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashAffected);
+            if (mi == mapWallet.end())
+                continue;
+            for (unsigned int n = 0; n < mi->second.vout.size(); n++)
+                if (IsMine(mi->second.vout[n]))
+                    ComputeDarksendRounds(COutPoint(hashAffected, n), pwalletdb);
+        }
+    }
+    if (pwalletdb)
+    {
+        BOOST_FOREACH(const COutPoint& outpoint, vErased)
+            if (!mapDarksendRounds.count(outpoint))
+                pwalletdb->EraseDarksendRounds(outpoint);
+        delete pwalletdb;
+    }
+}
+
+void CWallet::IndexDarksendRounds()
+{
+    LOCK(cs_wallet);
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << darkSendDenominations;
+    uint256 hashDenoms = ss.GetHash();
+
+    CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile) : NULL;
+
+    // Computed against other denominations, start over
+    if (hashDenoms != hashDarksendRoundsDenoms)
+    {
+        if (pwalletdb)
+        {
+            BOOST_FOREACH(const PAIRTYPE(COutPoint, int)& item, mapDarksendRounds)
+                pwalletdb->EraseDarksendRounds(item.first);
+            pwalletdb->WriteDarksendRoundsDenoms(hashDenoms);
+        }
+        mapDarksendRounds.clear();
+        hashDarksendRoundsDenoms = hashDenoms;
+    }
+
+    // Fill in what's missing, oldest transactions first so the recursion into parents stays shallow
+    std::vector<std::pair<int64_t, uint256> > vOrdered;
+    vOrdered.reserve(mapWallet.size());
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vOrdered.push_back(make_pair(it->second.nOrderPos, it->first));
+    sort(vOrdered.begin(), vOrdered.end());
+
+    int nIndexed = mapDarksendRounds.size();
+    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vOrdered)
+    {
+        const CWalletTx& wtx = mapWallet[item.second];
+        for (unsigned int n = 0; n < wtx.vout.size(); n++)
+            if (IsMine(wtx.vout[n]))
+                ComputeDarksendRounds(COutPoint(item.second, n), pwalletdb);
+    }
+    delete pwalletdb;
+
+    LogPrintf("Darksend rounds index: %u outputs, %u new\n", mapDarksendRounds.size(), mapDarksendRounds.size() - nIndexed);
+}
+
 
 bool CWallet::IsMine(const CTxIn &txin) const
 {
@@ -1001,7 +1169,7 @@ void CWalletTx::RelayWalletTransaction(std::string strCommand)
             LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             if(strCommand == "txlreq"){
-                mapTxLockReq.insert(make_pair(hash, ((CTransaction)*this)));
+                mapTxLockReq.insert(make_pair(hash, MakeTransactionRef(*this)));
                 CreateNewLock(((CTransaction)*this));
                 RelayTransactionLockReq(((CTransaction)*this), hash, true);
             } else {
@@ -131,6 +131,11 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Darksend rounds of wallet outputs, computed when their transaction comes in and kept in the
+    // wallet file. Entries for a transaction and everything spending it are redone when it changes.
+    std::map<COutPoint, int> mapDarksendRounds;
+    int ComputeDarksendRounds(const COutPoint& outpoint, CWalletDB* pwalletdb);
+
 public:
     bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
     bool SelectCoinsDark(int64_t nValueMin, int64_t nValueMax, std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax) const;
@@ -187,6 +192,9 @@ public:
 
     std::map<uint256, CWalletTx> mapWallet;
 
+    // denominations the stored Darksend rounds were computed with
+    uint256 hashDarksendRoundsDenoms;
+
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -268,6 +276,14 @@ public:
     void SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
+
+    void LoadDarksendRounds(const COutPoint& outpoint, int nRounds) { mapDarksendRounds[outpoint] = nRounds; }
+    /// Darksend rounds of a wallet output, from the rounds index
+    int GetOutpointDarksendRounds(const COutPoint& outpoint);
+    /// Redo the rounds of a transaction's outputs and of all wallet transactions spending them
+    void UpdateDarksendRounds(const uint256& hash);
+    /// Bring the rounds index in line with the current Darksend denominations and wallet transactions
+    void IndexDarksendRounds();
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
@@ -158,6 +158,24 @@ bool CWalletDB::WriteMinVersion(int nVersion)
     return Write(std::string("minversion"), nVersion);
 }
 
+bool CWalletDB::WriteDarksendRounds(const COutPoint& outpoint, int nRounds)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("dsrounds"), outpoint), nRounds);
+}
+
+bool CWalletDB::EraseDarksendRounds(const COutPoint& outpoint)
+{
+    nWalletDBUpdated++;
+    return Erase(std::make_pair(std::string("dsrounds"), outpoint));
+}
+
+bool CWalletDB::WriteDarksendRoundsDenoms(const uint256& hashDenoms)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("dsroundsdenoms"), hashDenoms);
+}
+
 bool CWalletDB::ReadAccount(const string& strAccount, CAccount& account)
 {
     account.SetNull();
@@ -520,6 +538,18 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             ssValue >> pwallet->vchDefaultKey;
         }
+        else if (strType == "dsrounds")
+        {
+            COutPoint outpoint;
+            ssKey >> outpoint;
+            int nRounds;
+            ssValue >> nRounds;
+            pwallet->LoadDarksendRounds(outpoint, nRounds);
+        }
+        else if (strType == "dsroundsdenoms")
+        {
+            ssValue >> pwallet->hashDarksendRoundsDenoms;
+        }
         else if (strType == "pool")
         {
             int64_t nIndex;
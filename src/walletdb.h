@@ -106,6 +106,10 @@ public:
 
     bool WriteMinVersion(int nVersion);
 
+    bool WriteDarksendRounds(const COutPoint& outpoint, int nRounds);
+    bool EraseDarksendRounds(const COutPoint& outpoint);
+    bool WriteDarksendRoundsDenoms(const uint256& hashDenoms);
+
     bool ReadAccount(const std::string& strAccount, CAccount& account);
     bool WriteAccount(const std::string& strAccount, const CAccount& account);
 